@@ -0,0 +1,368 @@
+#include "../src/png.hpp"
+#include "corpus.hpp"
+#include "reference-decoders.hpp"
+#include "zlib-reference.hpp"
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <print>
+#include <spanstream>
+#include <string>
+#include <string_view>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// png::readPng against the other PNG decoders found on the system, libpng, spng and stb_image, on the same files
+// held in memory: the PNG files of the directories given on the command line, PngSuite and a few large synthetic
+// images by default. Every decoder reports its throughput, the allocations and peak resident memory per image
+// and how many images it decodes differently from readPng. The image data is also inflated with zlib on its own,
+// which tells how much of a gap comes from inflating rather than from the rest of decoding
+namespace
+{
+
+// Mismatching images listed by name, per decoder
+constexpr int ListedMismatches = 5;
+
+#ifdef __GLIBC__
+
+constexpr bool MemoryMeasured = true;
+
+std::atomic<std::size_t> allocationCount;
+std::atomic<std::size_t> allocatedBytes;
+
+#else
+
+constexpr bool MemoryMeasured = false;
+
+#endif
+
+}
+
+#ifdef __GLIBC__
+
+// glibc lets the program replace malloc and still reach its own under these names. Counting there rather than in
+// operator new also catches the C libraries, which allocate with malloc directly
+extern "C"
+{
+
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t count, std::size_t size);
+void* __libc_realloc(void* pointer, std::size_t size);
+void __libc_free(void* pointer);
+
+void* malloc(std::size_t size) noexcept
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void* calloc(std::size_t count, std::size_t size) noexcept
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	allocatedBytes.fetch_add(count * size, std::memory_order_relaxed);
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, std::size_t size) noexcept
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+	return __libc_realloc(pointer, size);
+}
+
+void free(void* pointer) noexcept
+{
+	__libc_free(pointer);
+}
+
+}
+
+#endif
+
+namespace
+{
+
+struct Sample
+{
+	std::string name;
+	std::vector<std::uint8_t> file;
+	png::Image image{};
+};
+
+struct Result
+{
+	std::size_t decoded{};
+	std::size_t failed{};
+	std::size_t mismatches{};
+	std::size_t fileBytes{};
+	std::size_t pixels{};
+	double seconds{};
+	std::size_t allocations{};
+	std::size_t allocatedBytes{};
+	std::size_t peakBytes{};
+};
+
+bool decodeReadPng(std::span<const std::uint8_t> file, std::vector<std::uint8_t>& rgba, std::uint32_t& width, std::uint32_t& height)
+{
+	static deflate::Inflater inflater;
+
+	std::ispanstream stream(std::span((const char*)file.data(), file.size()));
+	auto image = png::readPng(stream, inflater);
+	if (!image)
+	{
+		return false;
+	}
+
+	width = image->width;
+	height = image->height;
+	rgba = std::move(image->data);
+
+	return true;
+}
+
+// Bytes of a field of /proc/self/status, like VmRSS, 0 if it can't be read
+std::size_t statusBytes(std::string_view field)
+{
+	std::ifstream status("/proc/self/status");
+
+	for (std::string line; std::getline(status, line);)
+	{
+		if (line.starts_with(field) && line.size() > field.size() && line[field.size()] == ':')
+		{
+			return std::stoull(line.substr(field.size() + 1)) * 1024;
+		}
+	}
+
+	return 0;
+}
+
+// Peak resident memory is only kept for the whole process, writing 5 to clear_refs starts it over from the current one
+void resetPeakResident()
+{
+	std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+// Decodes every sample with decode, once measured for memory and checked against readPng's image, then timed
+Result run(referenceDecoders::Decoder decoder, std::span<const Sample> samples)
+{
+	Result result;
+
+	std::vector<std::uint8_t> rgba;
+	std::uint32_t width{};
+	std::uint32_t height{};
+	int listed = 0;
+
+	for (const auto& sample : samples)
+	{
+		rgba = {};
+
+#ifdef __GLIBC__
+		// Memory freed by the previous image goes back to the system first, or reusing it wouldn't show as resident growth
+		malloc_trim(0);
+
+		const auto residentBefore = statusBytes("VmRSS");
+		resetPeakResident();
+
+		const auto allocationsBefore = allocationCount.load();
+		const auto bytesBefore = allocatedBytes.load();
+#endif
+
+		const bool decoded = decoder.decode(sample.file, rgba, width, height);
+
+#ifdef __GLIBC__
+		const auto allocations = allocationCount.load() - allocationsBefore;
+		const auto bytes = allocatedBytes.load() - bytesBefore;
+		const auto peak = statusBytes("VmHWM");
+#endif
+
+		if (!decoded)
+		{
+			result.failed++;
+			continue;
+		}
+
+		if (width != sample.image.width || height != sample.image.height || rgba != sample.image.data)
+		{
+			result.mismatches++;
+
+			if (listed++ < ListedMismatches)
+			{
+				std::println("  {} decodes {} differently", decoder.name, sample.name);
+			}
+		}
+
+		const auto pixels = std::size_t(width) * height;
+		const auto repeats = int(std::clamp<std::size_t>(corpus::DecodeBytes / (pixels * 4), 3, 1000));
+
+		result.decoded++;
+		result.fileBytes += sample.file.size();
+		result.pixels += pixels;
+		result.seconds += corpus::bestSeconds([&]() { decoder.decode(sample.file, rgba, width, height); }, repeats);
+
+#ifdef __GLIBC__
+		result.allocations += allocations;
+		result.allocatedBytes += bytes;
+
+		if (peak > residentBefore)
+		{
+			result.peakBytes = std::max(result.peakBytes, peak - residentBefore);
+		}
+#endif
+	}
+
+	return result;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<std::filesystem::path> directories(argv + 1, argv + argc);
+	if (directories.empty())
+	{
+		directories.push_back(TEST_FILES_DIR);
+	}
+
+	std::vector<Sample> samples;
+
+	if (argc == 1)
+	{
+		samples.push_back({ "photo", corpus::encode({ corpus::ImageSize, corpus::ImageSize, corpus::makePhoto(corpus::ImageSize, corpus::ImageSize) }) });
+		samples.push_back({ "flat", corpus::encode({ corpus::ImageSize, corpus::ImageSize, corpus::makeFlat(corpus::ImageSize, corpus::ImageSize) }) });
+	}
+
+	for (const auto& directory : directories)
+	{
+		for (const auto& entry : std::filesystem::directory_iterator(directory))
+		{
+			if (entry.path().extension() != ".png")
+			{
+				continue;
+			}
+
+			std::ifstream stream(entry.path(), std::ios::binary);
+			samples.push_back({ entry.path().filename().string(), { std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() } });
+		}
+	}
+
+	// readPng's image is the one the others are checked against, files it rejects are left out quietly
+	std::erase_if(samples, [](Sample& sample)
+	{
+		std::cerr.setstate(std::ios::failbit);
+
+		std::ispanstream stream(std::span((const char*)sample.file.data(), sample.file.size()));
+		auto image = png::readPng(stream);
+
+		std::cerr.clear();
+
+		if (image)
+		{
+			sample.image = std::move(*image);
+		}
+
+		return !image;
+	});
+
+	std::vector<referenceDecoders::Decoder> decoders{ { "png::readPng", decodeReadPng } };
+	for (const auto& decoder : referenceDecoders::available())
+	{
+		decoders.push_back(decoder);
+	}
+
+	std::println("{} images", samples.size());
+
+	std::vector<Result> results;
+	for (const auto& decoder : decoders)
+	{
+		results.push_back(run(decoder, samples));
+	}
+
+	std::println("");
+	std::println("{:<14}{:>9}{:>9}{:>10}{:>9}{:>14}{:>13}{:>12}{:>9}", "decoder", "decoded", "failed", "MB/s", "MP/s", "allocs/image", "KB/image", "peak MB", "differ");
+
+	for (std::size_t index = 0; index < decoders.size(); index++)
+	{
+		const auto& result = results[index];
+		const auto images = double(std::max<std::size_t>(result.decoded, 1));
+
+		std::print("{:<14}{:>9}{:>9}{:>10.1f}{:>9.1f}", decoders[index].name, result.decoded, result.failed,
+			result.fileBytes / 1e6 / result.seconds, result.pixels / 1e6 / result.seconds);
+
+		if (MemoryMeasured)
+		{
+			std::println("{:>14.1f}{:>13.1f}{:>12.1f}{:>9}", result.allocations / images, result.allocatedBytes / 1024.0 / images,
+				result.peakBytes / 1e6, result.mismatches);
+		}
+		else
+		{
+			std::println("{:>14}{:>13}{:>12}{:>9}", "-", "-", "-", result.mismatches);
+		}
+	}
+
+	// The image data inflated on its own, by deflate and by zlib, grouped by colour type
+	std::println("");
+	std::println("{:<14}{:>9}{:>16}{:>14}{:>8}", "inflate", "images", "deflate MB/s", "zlib MB/s", "speed");
+
+	struct InflateGroup
+	{
+		std::size_t images{};
+		std::size_t bytes{};
+		double seconds{};
+		double referenceSeconds{};
+	};
+
+	std::array<InflateGroup, 7> groups{};
+	deflate::Inflater inflater;
+
+	for (const auto& sample : samples)
+	{
+		const auto chunks = png::readChunks(sample.file);
+		const auto info = png::readHeaderChunk(chunks->front());
+
+		std::vector<std::uint8_t> compressed;
+		for (const auto& chunk : *chunks)
+		{
+			if (chunk.type == "IDAT")
+			{
+				compressed.insert(compressed.end(), chunk.data.begin(), chunk.data.end());
+			}
+		}
+
+		const auto output = inflater.decompress(compressed, deflate::Format::Zlib);
+		if (!output)
+		{
+			continue;
+		}
+
+		std::vector<std::uint8_t> referenceOutput(output->size());
+		if (!zlibReference::decompress(compressed, referenceOutput, zlibReference::Framing::Zlib) || referenceOutput != *output)
+		{
+			std::println("  zlib inflates {} differently", sample.name);
+			continue;
+		}
+
+		const auto repeats = int(std::clamp<std::size_t>(corpus::DecodeBytes / std::max<std::size_t>(output->size(), 1), 3, 1000));
+
+		auto& group = groups[std::min<std::size_t>(info->colorType, groups.size() - 1)];
+		group.images++;
+		group.bytes += output->size();
+		group.seconds += corpus::bestSeconds([&]() { inflater.decompress(compressed, deflate::Format::Zlib, output->size()); }, repeats);
+		group.referenceSeconds += corpus::bestSeconds([&]() { zlibReference::decompress(compressed, referenceOutput, zlibReference::Framing::Zlib); }, repeats);
+	}
+
+	for (std::size_t colorType = 0; colorType < groups.size(); colorType++)
+	{
+		const auto& group = groups[colorType];
+		if (group.images == 0)
+		{
+			continue;
+		}
+
+		std::println("{:<14}{:>9}{:>16.1f}{:>14.1f}{:>7.2f}x", corpus::colorTypeName(std::uint8_t(colorType)), group.images,
+			group.bytes / 1e6 / group.seconds, group.bytes / 1e6 / group.referenceSeconds, group.referenceSeconds / group.seconds);
+	}
+}
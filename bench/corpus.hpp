@@ -0,0 +1,168 @@
+#pragma once
+
+#include "../src/png.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <string_view>
+#include <vector>
+
+// Synthetic data the benchmarks share, generated from fixed seeds so runs compare
+namespace corpus
+{
+
+struct Corpus
+{
+	std::string_view name;
+	std::vector<std::uint8_t> data;
+};
+
+// Side of the square synthetic images
+constexpr std::uint32_t ImageSize = 2048;
+
+// Decoded bytes each file is decoded for at least, so small files still run long enough to time
+constexpr std::size_t DecodeBytes = 64 << 20;
+
+inline std::vector<std::uint8_t> makeText(std::size_t size)
+{
+	static constexpr std::string_view words[]{ "{\"id\": ", "\"name\": \"", "\"value\": ", "\"tags\": [", "], ", "}, ", "true", "false", "null", "\n\t" };
+
+	std::mt19937 random(1);
+	std::vector<std::uint8_t> data;
+	data.reserve(size);
+
+	while (data.size() < size)
+	{
+		const auto word = words[random() % std::size(words)];
+		data.insert(data.end(), word.begin(), word.end());
+
+		for (auto digits = random() % 6; digits > 0; digits--)
+		{
+			data.push_back('0' + random() % 10);
+		}
+	}
+
+	data.resize(size);
+	return data;
+}
+
+inline std::vector<std::uint8_t> makeNoise(std::size_t size)
+{
+	std::mt19937 random(2);
+	std::vector<std::uint8_t> data(size);
+
+	for (auto& byte : data)
+	{
+		byte = std::uint8_t(random());
+	}
+
+	return data;
+}
+
+inline std::vector<std::uint8_t> makeRuns(std::size_t size)
+{
+	std::mt19937 random(3);
+	std::vector<std::uint8_t> data;
+	data.reserve(size);
+
+	while (data.size() < size)
+	{
+		data.insert(data.end(), 1 + random() % 300, std::uint8_t(random() % 4));
+	}
+
+	data.resize(size);
+	return data;
+}
+
+// RGBA pixels like a photo: smooth gradients with sensor noise, fully opaque
+inline std::vector<std::uint8_t> makePhoto(std::uint32_t width, std::uint32_t height)
+{
+	std::mt19937 random(4);
+	std::vector<std::uint8_t> data(std::size_t(width) * height * 4);
+
+	auto* pixel = data.data();
+	for (std::uint32_t y = 0; y < height; y++)
+	{
+		for (std::uint32_t x = 0; x < width; x++)
+		{
+			const auto noise = int(random() % 9) - 4;
+
+			pixel[0] = std::uint8_t(std::clamp(int(x * 255 / width) + noise, 0, 255));
+			pixel[1] = std::uint8_t(std::clamp(int(y * 255 / height) + noise, 0, 255));
+			pixel[2] = std::uint8_t(std::clamp(int((x + y) * 255 / (width + height)) + noise, 0, 255));
+			pixel[3] = 255;
+
+			pixel += 4;
+		}
+	}
+
+	return data;
+}
+
+// RGBA pixels like a screenshot: flat rectangles of a few colors over a plain background
+inline std::vector<std::uint8_t> makeFlat(std::uint32_t width, std::uint32_t height)
+{
+	std::mt19937 random(5);
+	std::vector<std::uint8_t> data(std::size_t(width) * height * 4, 240);
+
+	for (int rectangle = 0; rectangle < 200; rectangle++)
+	{
+		const auto left = random() % width;
+		const auto top = random() % height;
+		const auto right = std::min<std::uint32_t>(width, left + 1 + random() % (width / 4 + 1));
+		const auto bottom = std::min<std::uint32_t>(height, top + 1 + random() % (height / 4 + 1));
+		const std::uint8_t color[4]{ std::uint8_t(random()), std::uint8_t(random()), std::uint8_t(random()), 255 };
+
+		for (auto y = top; y < bottom; y++)
+		{
+			for (auto x = left; x < right; x++)
+			{
+				std::copy_n(color, 4, data.data() + (std::size_t(y) * width + x) * 4);
+			}
+		}
+	}
+
+	return data;
+}
+
+inline std::string_view colorTypeName(std::uint8_t colorType)
+{
+	switch (colorType)
+	{
+	case 0: return "gray";
+	case 2: return "rgb";
+	case 3: return "palette";
+	case 4: return "grayalpha";
+	default: return "rgba";
+	}
+}
+
+// image as a PNG file written with the default options
+inline std::vector<std::uint8_t> encode(const png::Image& image)
+{
+	std::vector<std::uint8_t> file;
+	png::writePng(image, [&](std::span<const std::uint8_t> data) { file.insert(file.end(), data.begin(), data.end()); });
+
+	return file;
+}
+
+// Fastest of a few runs, which filters out most of the noise of a busy machine
+template<typename F>
+double bestSeconds(F&& function, int repeats = 5)
+{
+	double best = 1e30;
+	for (int x = 0; x < repeats; x++)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		function();
+		const auto end = std::chrono::steady_clock::now();
+
+		best = std::min(best, std::chrono::duration<double>(end - start).count());
+	}
+
+	return best;
+}
+
+}
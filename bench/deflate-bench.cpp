@@ -0,0 +1,119 @@
+#include "../src/png.hpp"
+#include "corpus.hpp"
+#include "zlib-reference.hpp"
+
+#include <print>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// Compression speed and ratio of deflate::deflate against zlib at every level, the optimal parse
+// of level 10 against zlib's level 9 and using every hardware thread,
+// then the same for whole PNG encodes through png::writePng, fast mode and strip threads included,
+// and the size each filter strategy gets at the default level
+namespace
+{
+
+constexpr std::size_t DataSize = 8 << 20;
+constexpr std::uint32_t ImageSize = 2048;
+
+}
+
+int main()
+{
+	const corpus::Corpus corpora[]{
+		{ "text", corpus::makeText(DataSize) },
+		{ "noise", corpus::makeNoise(DataSize) },
+		{ "runs", corpus::makeRuns(DataSize) },
+	};
+
+	std::println("{:<8}{:>6}{:>10}{:>14}{:>10}{:>14}", "data", "level", "ratio", "deflate MB/s", "zlib", "zlib MB/s");
+
+	deflate::Deflater deflater;
+	deflater.threadCount = 0;
+
+	for (const auto& sample : corpora)
+	{
+		for (int level = 0; level <= deflate::Deflater::OptimalLevel; level++)
+		{
+			const int runs = level == deflate::Deflater::OptimalLevel ? 1 : 3;
+
+			std::vector<std::uint8_t> compressed;
+			const auto seconds = corpus::bestSeconds([&]() { compressed = deflater.deflate(sample.data, level); }, runs);
+
+			std::vector<std::uint8_t> reference;
+			const auto referenceSeconds = corpus::bestSeconds([&]() { reference = zlibReference::compress(sample.data, std::min(level, 9), zlibReference::Framing::Zlib); }, runs);
+
+			const auto output = deflate::inflate(compressed);
+			if (!output || *output != sample.data)
+			{
+				std::println("{:<8}{:>6}  round trip mismatch", sample.name, level);
+				return 1;
+			}
+
+			const auto megabytes = sample.data.size() / 1e6;
+			std::println("{:<8}{:>6}{:>10.3f}{:>14.1f}{:>10.3f}{:>14.1f}", sample.name, level,
+				double(compressed.size()) / sample.data.size(), megabytes / seconds,
+				double(reference.size()) / sample.data.size(), megabytes / referenceSeconds);
+		}
+	}
+
+	const corpus::Corpus images[]{
+		{ "photo", corpus::makePhoto(ImageSize, ImageSize) },
+		{ "flat", corpus::makeFlat(ImageSize, ImageSize) },
+	};
+
+	const auto encode = [&](const png::Image& image, const png::WriteOptions& options, int repeats)
+	{
+		std::vector<std::uint8_t> file;
+		const auto seconds = corpus::bestSeconds([&]()
+		{
+			file.clear();
+			png::writePng(image, [&](std::span<const std::uint8_t> data) { file.insert(file.end(), data.begin(), data.end()); }, options, deflater);
+		}, repeats);
+
+		return std::pair(file.size(), image.data.size() / 1e6 / seconds);
+	};
+
+	std::println("");
+	std::println("{:<8}{:>6}{:>9}{:>12}{:>12}", "image", "level", "threads", "bytes", "MB/s");
+
+	for (const auto& sample : images)
+	{
+		const png::Image image{ ImageSize, ImageSize, sample.data };
+
+		// Level -1 stands for the fast mode, each encoded on one thread then in strips on every hardware thread
+		for (int level = -1; level <= 9; level++)
+		{
+			for (unsigned threadCount : { 1u, parallel::defaultThreadCount() })
+			{
+				const auto [size, speed] = encode(image, { .level = std::max(level, 0), .fast = level < 0, .threadCount = threadCount }, 3);
+
+				const auto levelName = level < 0 ? std::string("fast") : std::to_string(level);
+				std::println("{:<8}{:>6}{:>9}{:>12}{:>12.1f}", sample.name, levelName, threadCount, size, speed);
+			}
+		}
+	}
+
+	const std::pair<std::string_view, png::FilterStrategy> strategies[]
+	{
+		{ "paeth", png::FilterStrategy::Fixed },
+		{ "sum", png::FilterStrategy::MinimumSum },
+		{ "entropy", png::FilterStrategy::Entropy },
+		{ "brute", png::FilterStrategy::BruteForce },
+	};
+
+	std::println("");
+	std::println("{:<8}{:>10}{:>12}{:>12}", "image", "filters", "bytes", "MB/s");
+
+	for (const auto& sample : images)
+	{
+		const png::Image image{ ImageSize, ImageSize, sample.data };
+
+		for (const auto& [name, strategy] : strategies)
+		{
+			const auto [size, speed] = encode(image, { .filterStrategy = strategy, .threadCount = 0 }, 1);
+			std::println("{:<8}{:>10}{:>12}{:>12.1f}", sample.name, name, size, speed);
+		}
+	}
+}
@@ -0,0 +1,98 @@
+#include "../src/deflate.hpp"
+#include "corpus.hpp"
+#include "zlib-reference.hpp"
+
+#include <print>
+#include <string_view>
+
+// Decompression throughput of deflate::decompress against zlib on synthetic data,
+// for every framing and a few compression levels
+namespace
+{
+
+constexpr std::size_t DataSize = 16 << 20;
+
+}
+
+int main()
+{
+	const corpus::Corpus corpora[]{
+		{ "text", corpus::makeText(DataSize) },
+		{ "noise", corpus::makeNoise(DataSize) },
+		{ "runs", corpus::makeRuns(DataSize) },
+	};
+
+	struct Framing
+	{
+		std::string_view name;
+		deflate::Format format;
+		zlibReference::Framing reference;
+	};
+
+	static constexpr Framing framings[]{
+		{ "raw", deflate::Format::Raw, zlibReference::Framing::Raw },
+		{ "zlib", deflate::Format::Zlib, zlibReference::Framing::Zlib },
+		{ "gzip", deflate::Format::Gzip, zlibReference::Framing::Gzip },
+	};
+
+	std::println("{:<8}{:<6}{:>6}{:>10}{:>14}{:>14}{:>8}", "data", "frame", "level", "ratio", "deflate MB/s", "zlib MB/s", "speed");
+
+	deflate::Inflater inflater;
+	std::vector<std::uint8_t> referenceOutput(DataSize);
+
+	for (const auto& sample : corpora)
+	{
+		for (const auto level : { 1, 6, 9 })
+		{
+			for (const auto& framing : framings)
+			{
+				const auto compressed = zlibReference::compress(sample.data, level, framing.reference);
+
+				std::optional<std::vector<std::uint8_t>> output;
+				const auto seconds = corpus::bestSeconds([&]() { output = inflater.decompress(compressed, framing.format, sample.data.size()); });
+
+				bool referenceOk = true;
+				const auto referenceSeconds = corpus::bestSeconds([&]() { referenceOk &= zlibReference::decompress(compressed, referenceOutput, framing.reference); });
+
+				if (!output || *output != sample.data || !referenceOk)
+				{
+					std::println("{:<8}{:<6}{:>6}  output mismatch", sample.name, framing.name, level);
+					return 1;
+				}
+
+				const auto megabytes = sample.data.size() / 1e6;
+				std::println("{:<8}{:<6}{:>6}{:>10.3f}{:>14.1f}{:>14.1f}{:>7.2f}x", sample.name, framing.name, level,
+					double(compressed.size()) / sample.data.size(), megabytes / seconds, megabytes / referenceSeconds, referenceSeconds / seconds);
+			}
+		}
+	}
+
+	// Members of 64KiB, the layout bgzip writes, decoded one after the other and then on every hardware thread
+	constexpr std::size_t MemberSize = 65536;
+
+	const auto& text = corpora[0].data;
+
+	std::vector<std::uint8_t> members;
+	for (std::size_t offset = 0; offset < text.size(); offset += MemberSize)
+	{
+		const auto member = zlibReference::compress(std::span(text).subspan(offset, std::min(MemberSize, text.size() - offset)), 6, zlibReference::Framing::Gzip);
+		members.insert(members.end(), member.begin(), member.end());
+	}
+
+	std::optional<std::vector<std::uint8_t>> sequentialOutput;
+	const auto sequentialSeconds = corpus::bestSeconds([&]() { sequentialOutput = inflater.decompress(members, deflate::Format::Gzip, text.size()); });
+
+	std::optional<std::vector<std::uint8_t>> parallelOutput;
+	const auto parallelSeconds = corpus::bestSeconds([&]() { parallelOutput = deflate::decompressParallel(members); });
+
+	if (!sequentialOutput || *sequentialOutput != text || !parallelOutput || *parallelOutput != text)
+	{
+		std::println("gzip members  output mismatch");
+		return 1;
+	}
+
+	const auto megabytes = text.size() / 1e6;
+	std::println("");
+	std::println("{} gzip members: sequential {:.1f} MB/s, {} threads {:.1f} MB/s", deflate::gzipMembers(members).size(),
+		megabytes / sequentialSeconds, parallel::defaultThreadCount(), megabytes / parallelSeconds);
+}
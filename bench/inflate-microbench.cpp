@@ -0,0 +1,380 @@
+#include "../src/deflate.hpp"
+#include "corpus.hpp"
+
+#include <print>
+#include <random>
+#include <string_view>
+
+// Inflate throughput on synthetic streams that each stress one part of the decoder, built symbol by symbol
+// so the block types and match shapes are exactly the ones named, then the parts on their own: bit reads,
+// Huffman decoding and match copies at every instruction set level the CPU runs
+namespace
+{
+
+constexpr std::size_t DataSize = 16 << 20;
+
+// Symbols and the bytes they decode to
+struct SymbolStream
+{
+	std::vector<deflate::Symbol> symbols;
+	std::vector<std::uint8_t> data;
+
+	void literal(std::uint8_t byte)
+	{
+		symbols.push_back({ byte, 0 });
+		data.push_back(byte);
+	}
+
+	void match(std::size_t length, std::size_t distance)
+	{
+		symbols.push_back({ std::uint16_t(length), std::uint16_t(distance) });
+
+		for (std::size_t x = 0; x < length; x++)
+		{
+			data.push_back(data[data.size() - distance]);
+		}
+	}
+};
+
+struct StreamClass
+{
+	std::string_view name;
+	std::vector<std::uint8_t> compressed;
+	std::vector<std::uint8_t> data;
+};
+
+// Codes symbols as dynamic or fixed blocks of blockSymbols symbols each
+void writeBlocks(deflate::BitWriter& writer, std::span<const deflate::Symbol> symbols, std::size_t blockSymbols, bool dynamic)
+{
+	using namespace deflate;
+
+	for (std::size_t begin = 0; begin < symbols.size(); begin += blockSymbols)
+	{
+		const auto block = symbols.subspan(begin, std::min(blockSymbols, symbols.size() - begin));
+		const bool final = begin + block.size() == symbols.size();
+
+		std::array<std::uint8_t, Alphabet::LiteralCount> literalLengths{};
+		std::array<std::uint8_t, Alphabet::DistanceCount> distanceLengths{};
+		std::array<std::uint16_t, Alphabet::LiteralCount> literalCodes{};
+		std::array<std::uint16_t, Alphabet::DistanceCount> distanceCodes{};
+
+		if (dynamic)
+		{
+			const BlockFrequencies frequencies(block);
+			buildCodeLengths(frequencies.literals, MaxCodeLength, literalLengths);
+			buildCodeLengths(frequencies.distances, MaxCodeLength, distanceLengths);
+			buildCodes(literalLengths, literalCodes);
+			buildCodes(distanceLengths, distanceCodes);
+
+			DynamicHeader(literalLengths, distanceLengths).write(writer, final);
+		}
+		else
+		{
+			std::copy_n(fixedCodes.literalLengths.begin(), literalLengths.size(), literalLengths.begin());
+			std::copy_n(fixedCodes.literalCodes.begin(), literalCodes.size(), literalCodes.begin());
+			std::copy_n(fixedCodes.distanceLengths.begin(), distanceLengths.size(), distanceLengths.begin());
+			std::copy_n(fixedCodes.distanceCodes.begin(), distanceCodes.size(), distanceCodes.begin());
+
+			writer.writeBits(final, 1);
+			writer.writeBits(1, 2);
+		}
+
+		for (const auto symbol : block)
+		{
+			if (symbol.distance == 0)
+			{
+				writer.writeBits(literalCodes[symbol.literalLength], literalLengths[symbol.literalLength]);
+				continue;
+			}
+
+			const auto lengthSymbol = Alphabet::LengthSymbols[symbol.literalLength];
+			const auto distanceSymbol = Alphabet::distanceSymbol(symbol.distance);
+			const auto literal = Alphabet::LengthOffest + lengthSymbol;
+
+			writer.writeBits(literalCodes[literal], literalLengths[literal]);
+			writer.writeBits(symbol.literalLength - Alphabet::Length[lengthSymbol].baseLength, Alphabet::Length[lengthSymbol].extraBits);
+			writer.writeBits(distanceCodes[distanceSymbol], distanceLengths[distanceSymbol]);
+			writer.writeBits(symbol.distance - Alphabet::Distance[distanceSymbol].baseLength, Alphabet::Distance[distanceSymbol].extraBits);
+		}
+
+		writer.writeBits(literalCodes[Alphabet::EndOfBlock], literalLengths[Alphabet::EndOfBlock]);
+	}
+
+	writer.alignToByte();
+}
+
+StreamClass makeClass(std::string_view name, const SymbolStream& stream, std::size_t blockSymbols, bool dynamic)
+{
+	deflate::BitWriter writer;
+	writeBlocks(writer, stream.symbols, blockSymbols, dynamic);
+
+	return { name, std::move(writer.data), stream.data };
+}
+
+// Literals skewed towards small values, about 7 bits of entropy each and no match anywhere
+std::uint8_t skewedLiteral(std::mt19937& random)
+{
+	return std::uint8_t(random() % 64 + (random() % 4 == 0 ? random() % 192 : 0));
+}
+
+std::vector<StreamClass> makeClasses()
+{
+	std::vector<StreamClass> classes;
+	std::mt19937 random(6);
+
+	{
+		SymbolStream stream;
+		while (stream.data.size() < DataSize)
+		{
+			stream.literal(skewedLiteral(random));
+		}
+
+		classes.push_back(makeClass("literals", stream, deflate::Deflater::BlockSymbols, true));
+	}
+
+	// Runs of a byte as literal then maximal matches at distance 1, which decode to memset
+	{
+		SymbolStream stream;
+		while (stream.data.size() < DataSize)
+		{
+			stream.literal(std::uint8_t(random()));
+
+			for (auto run = 1000 + random() % 9000; run >= deflate::Deflater::MinMatch; run -= std::min<std::size_t>(run, deflate::Deflater::MaxMatch))
+			{
+				stream.match(std::min<std::size_t>(run, deflate::Deflater::MaxMatch), 1);
+			}
+		}
+
+		classes.push_back(makeClass("rle", stream, deflate::Deflater::BlockSymbols, true));
+	}
+
+	// Short matches overlapping their source, copied byte by byte
+	{
+		SymbolStream stream;
+		while (stream.data.size() < DataSize)
+		{
+			for (auto literals = 1 + random() % 4; literals > 0; literals--)
+			{
+				stream.literal(skewedLiteral(random));
+			}
+
+			stream.match(3 + random() % 14, std::min<std::size_t>(stream.data.size(), 1 + random() % 16));
+		}
+
+		classes.push_back(makeClass("short", stream, deflate::Deflater::BlockSymbols, true));
+	}
+
+	// Longer matches far back, copied in the widest chunks
+	{
+		SymbolStream stream;
+		while (stream.data.size() < deflate::Deflater::WindowSize)
+		{
+			stream.literal(std::uint8_t(random()));
+		}
+
+		while (stream.data.size() < DataSize)
+		{
+			stream.literal(std::uint8_t(random()));
+			stream.match(16 + random() % 113, 1024 + random() % (deflate::Deflater::WindowSize - 1024));
+		}
+
+		classes.push_back(makeClass("far", stream, deflate::Deflater::BlockSymbols, true));
+	}
+
+	{
+		deflate::BitWriter writer;
+		auto noise = corpus::makeNoise(DataSize);
+		deflate::writeStoredBlocks(writer, noise, true);
+
+		classes.push_back({ "stored", std::move(writer.data), std::move(noise) });
+	}
+
+	// Text with short matches, as fixed blocks, then as dynamic blocks of 256 symbols whose literals
+	// shift from block to block, so no two headers match and the table cache can't skip a rebuild
+	{
+		const auto text = corpus::makeText(DataSize);
+
+		SymbolStream stream;
+		while (stream.data.size() < DataSize)
+		{
+			for (auto literals = 1 + random() % 8; literals > 0; literals--)
+			{
+				stream.literal(text[stream.data.size() % text.size()]);
+			}
+
+			stream.match(3 + random() % 30, std::min<std::size_t>(stream.data.size(), 1 + random() % 4096));
+		}
+
+		classes.push_back(makeClass("fixed", stream, deflate::Deflater::BlockSymbols, false));
+
+		constexpr std::size_t SmallBlockSymbols = 256;
+
+		SymbolStream small;
+		std::uint8_t shift{};
+		while (small.data.size() < DataSize)
+		{
+			if (small.symbols.size() % SmallBlockSymbols == 0)
+			{
+				shift = std::uint8_t(random());
+			}
+
+			if (random() % 3 == 0 && small.data.size() >= 64)
+			{
+				small.match(3 + random() % 30, 1 + random() % 64);
+			}
+			else
+			{
+				small.literal(std::uint8_t(skewedLiteral(random) + shift));
+			}
+		}
+
+		classes.push_back(makeClass("small dynamic", small, SmallBlockSymbols, true));
+	}
+
+	return classes;
+}
+
+// Reads count bit fields of 1 to 15 bits
+std::uint32_t readBitFields(std::span<const std::uint8_t> data, std::size_t count)
+{
+	deflate::BitStream<> stream{ data };
+
+	std::uint32_t sum{};
+	for (std::size_t x = 0; x < count; x++)
+	{
+		sum += stream.readBits<std::uint32_t>(std::uint8_t(1 + x % 15));
+	}
+
+	return sum;
+}
+
+// Decodes symbols until count literals came out
+std::uint32_t decodeLiterals(std::span<const std::uint8_t> data, const deflate::HuffmanTable& table, std::size_t count)
+{
+	deflate::BitStream<> stream{ data };
+
+	std::uint32_t sum{};
+	for (std::size_t decoded = 0; decoded < count; )
+	{
+		const auto code = stream.readHuffmanEntry(table);
+		sum += code.value;
+		decoded += code.literals == 2 ? 2 : 1;
+	}
+
+	return sum;
+}
+
+// Fills data after its first window with back to back matches of one length and distance
+template<cpu::Isa Isa>
+void copyMatchesKernel(std::span<std::uint8_t> data, std::size_t length, std::size_t distance)
+{
+	for (auto pos = deflate::Deflater::WindowSize; pos + length <= data.size(); pos += length)
+	{
+		deflate::copyMatchBytes<Isa>(data.data() + pos, length, distance);
+	}
+}
+
+CPU_KERNEL_VARIANTS(void, copyMatches, copyMatchesKernel<isa>, (std::span<std::uint8_t> data, std::size_t length, std::size_t distance), (data, length, distance))
+
+}
+
+int main()
+{
+	std::println("{:<16}{:>10}{:>14}{:>14}", "stream", "ratio", "input MB/s", "output MB/s");
+
+	deflate::Inflater inflater;
+
+	for (const auto& streamClass : makeClasses())
+	{
+		std::optional<std::vector<std::uint8_t>> output;
+		const auto seconds = corpus::bestSeconds([&]() { output = inflater.decompress(streamClass.compressed, deflate::Format::Raw, streamClass.data.size()); });
+
+		if (!output || *output != streamClass.data)
+		{
+			std::println("{:<16}  output mismatch", streamClass.name);
+			return 1;
+		}
+
+		std::println("{:<16}{:>10.3f}{:>14.1f}{:>14.1f}", streamClass.name, double(streamClass.compressed.size()) / streamClass.data.size(),
+			streamClass.compressed.size() / 1e6 / seconds, streamClass.data.size() / 1e6 / seconds);
+	}
+
+	const auto noise = corpus::makeNoise(DataSize);
+
+	std::println("");
+	std::println("{:<24}{:>14}", "part", "M items/s");
+
+	// Fields average 8 bits, so the reads stay within the data
+	constexpr std::size_t FieldCount = DataSize / 2;
+
+	std::uint32_t sink{};
+	const auto bitSeconds = corpus::bestSeconds([&]() { sink += readBitFields(noise, FieldCount); });
+	std::println("{:<24}{:>14.1f}", "bit fields", FieldCount / 1e6 / bitSeconds);
+
+	// Literals of the skewed distribution coded with their own Huffman code
+	{
+		std::mt19937 random(7);
+		std::vector<deflate::Symbol> symbols(DataSize / 2);
+		for (auto& symbol : symbols)
+		{
+			symbol = { skewedLiteral(random), 0 };
+		}
+
+		const deflate::BlockFrequencies frequencies(symbols);
+		std::array<std::uint8_t, deflate::Alphabet::LiteralCount> lengths{};
+		std::array<std::uint16_t, deflate::Alphabet::LiteralCount> codes{};
+		deflate::buildCodeLengths(frequencies.literals, deflate::MaxCodeLength, lengths);
+		deflate::buildCodes(lengths, codes);
+
+		deflate::BitWriter writer;
+		for (const auto symbol : symbols)
+		{
+			writer.writeBits(codes[symbol.literalLength], lengths[symbol.literalLength]);
+		}
+
+		writer.alignToByte();
+
+		deflate::HuffmanTable table;
+		table.build(lengths, 0);
+
+		const auto singleSeconds = corpus::bestSeconds([&]() { sink += decodeLiterals(writer.data, table, symbols.size()); });
+		std::println("{:<24}{:>14.1f}", "huffman literals", symbols.size() / 1e6 / singleSeconds);
+
+		table.pairLiterals();
+
+		const auto pairedSeconds = corpus::bestSeconds([&]() { sink += decodeLiterals(writer.data, table, symbols.size() - 1); });
+		std::println("{:<24}{:>14.1f}", "huffman literal pairs", symbols.size() / 1e6 / pairedSeconds);
+	}
+
+	std::println("");
+	std::println("{:<10}{:>10}{:>12}{:>12}{:>12}", "length", "distance", "generic", "bmi2", "avx512");
+
+	std::vector<std::uint8_t> buffer(noise.begin(), noise.end());
+
+	static constexpr std::pair<std::size_t, std::size_t> matches[]{ { 258, 1 }, { 16, 3 }, { 64, 8 }, { 64, 32 }, { 128, 64 }, { 258, 4096 } };
+	for (const auto& [length, distance] : matches)
+	{
+		std::print("{:<10}{:>10}", length, distance);
+
+		static constexpr void (*copies[])(std::span<std::uint8_t>, std::size_t, std::size_t){ copyMatchesGeneric, copyMatchesBmi2, copyMatchesAvx512 };
+
+		for (int isa = 0; isa < 3; isa++)
+		{
+			// Levels above the CPU's would fault
+			if (cpu::Isa(isa) <= cpu::activeIsa())
+			{
+				const auto seconds = corpus::bestSeconds([&]() { copies[isa](buffer, length, distance); });
+				std::print("{:>12.1f}", buffer.size() / 1e6 / seconds);
+			}
+			else
+			{
+				std::print("{:>12}", "-");
+			}
+		}
+
+		std::println("");
+	}
+
+	// Keeps the decode loops from being optimized out
+	return sink == 1 ? 2 : 0;
+}
@@ -0,0 +1,557 @@
+#include "../src/png.hpp"
+#include "corpus.hpp"
+
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <print>
+#include <random>
+#include <string>
+#include <string_view>
+
+// Writes deterministic large PNGs for scaling tests, which the 32 pixel PngSuite images can't be:
+//
+//   make-corpus <directory> [--sizes 1,16,256,1024] [--kinds photo,flat,gradient,palette,deep]
+//               [--interlace none|adam7|both] [--level 0-10] [--filter minsum|entropy|brute|0-4] [--fast] [--threads n]
+//
+// Sizes are in megapixels, 1024 making a gigapixel image. Every kind of content is written in the colour types
+// and depths it suits, together covering every combination PNG allows, with and without Adam7 interlacing.
+// Rows are generated, filtered and compressed one at a time, so memory stays small at any size. The default level
+// writes about 2 megapixels a second, --fast or --level 1 suit gigapixel images better.
+//
+// checksums.txt lists every image with two CRC-32s: of its samples at full depth, row after row without
+// the filter bytes and whatever the interlacing, and of the 8 bit RGBA pixels png::readPng decodes it to.
+// png::writePng only takes 8 bit RGBA and never interlaces, so the images go through png::RowEncoder
+namespace
+{
+
+enum class Kind
+{
+	Photo,		// Smooth gradients under per pixel noise, compressing poorly
+	Flat,		// Flat rectangles over a plain background, like user interfaces
+	Gradient,	// Noiseless gradients, banding at low depths
+	Palette,	// Tiles of small patterns, like pixel art
+	Deep,		// Gradients with noise below the top 8 bits, which only 16 bit samples keep
+};
+
+struct Format
+{
+	std::uint8_t colorType;
+	std::uint8_t depth;
+};
+
+struct KindInfo
+{
+	Kind kind;
+	std::string_view name;
+	std::vector<Format> formats;
+};
+
+const std::vector<KindInfo> kinds{
+	{ Kind::Photo, "photo", { { 2, 8 }, { 6, 8 }, { 0, 8 } } },
+	{ Kind::Flat, "flat", { { 6, 8 }, { 4, 8 }, { 2, 8 } } },
+	{ Kind::Gradient, "gradient", { { 0, 1 }, { 0, 2 }, { 0, 4 }, { 0, 8 }, { 2, 8 } } },
+	{ Kind::Palette, "palette", { { 3, 1 }, { 3, 2 }, { 3, 4 }, { 3, 8 } } },
+	{ Kind::Deep, "deep", { { 0, 16 }, { 4, 16 }, { 2, 16 }, { 6, 16 } } },
+};
+
+std::uint32_t hash(std::uint32_t x, std::uint32_t y, std::uint32_t seed)
+{
+	auto h = x * 0x9E3779B1u ^ (y + seed) * 0x85EBCA77u;
+	h ^= h >> 15;
+	h *= 0x2C1B3C6Du;
+	h ^= h >> 12;
+	h *= 0x297A2D39u;
+	h ^= h >> 15;
+
+	return h;
+}
+
+std::uint16_t clamp16(std::int64_t value)
+{
+	return std::uint16_t(std::clamp<std::int64_t>(value, 0, 0xFFFF));
+}
+
+// Generates the content of an image as 16 bit RGBA rows, which packRow then cuts to the written format.
+// Palette indices are the top bits of red
+struct Content
+{
+	struct Rectangle
+	{
+		std::uint32_t left;
+		std::uint32_t top;
+		std::uint32_t right;
+		std::uint32_t bottom;
+		std::array<std::uint16_t, 4> color;
+	};
+
+	Kind kind;
+	std::uint32_t width;
+	std::uint32_t height;
+	std::vector<Rectangle> rectangles;
+
+	Content(Kind kind, std::uint32_t width, std::uint32_t height)
+		: kind(kind), width(width), height(height)
+	{
+		if (kind != Kind::Flat)
+		{
+			return;
+		}
+
+		std::mt19937 random(5);
+		for (int rectangle = 0; rectangle < 200; rectangle++)
+		{
+			const auto left = std::uint32_t(random() % width);
+			const auto top = std::uint32_t(random() % height);
+			const auto right = std::min<std::uint32_t>(width, left + 1 + random() % (width / 4 + 1));
+			const auto bottom = std::min<std::uint32_t>(height, top + 1 + random() % (height / 4 + 1));
+			const auto alpha = rectangle % 4 == 3 ? 0x8080 : 0xFFFF;
+
+			rectangles.push_back({ left, top, right, bottom, { std::uint16_t(random() % 256 * 257), std::uint16_t(random() % 256 * 257), std::uint16_t(random() % 256 * 257), std::uint16_t(alpha) } });
+		}
+	}
+
+	void generateRow(std::uint32_t y, std::uint16_t* row) const
+	{
+		const auto w = std::int64_t(width);
+		const auto h = std::int64_t(height);
+
+		if (kind == Kind::Flat)
+		{
+			for (std::uint32_t x = 0; x < width; x++)
+			{
+				row[4 * x] = row[4 * x + 1] = row[4 * x + 2] = 0xF0F0;
+				row[4 * x + 3] = 0xFFFF;
+			}
+
+			for (const auto& rectangle : rectangles)
+			{
+				if (y < rectangle.top || y >= rectangle.bottom)
+				{
+					continue;
+				}
+
+				for (auto x = rectangle.left; x < rectangle.right; x++)
+				{
+					std::copy(rectangle.color.begin(), rectangle.color.end(), row + 4 * x);
+				}
+			}
+
+			return;
+		}
+
+		for (std::uint32_t x = 0; x < width; x++)
+		{
+			auto* pixel = row + 4 * x;
+			const auto random = hash(x, y, std::uint32_t(kind));
+
+			if (kind == Kind::Photo)
+			{
+				const auto noise = std::int64_t(random % 2305) - 1152;
+				pixel[0] = clamp16(x * 0xFFFF / w + noise);
+				pixel[1] = clamp16(y * 0xFFFF / h + noise);
+				pixel[2] = clamp16((x + y) * 0xFFFF / (w + h) - noise);
+				pixel[3] = clamp16(0x8000 + x * 0x7FFF / w + noise / 4);
+			}
+			else if (kind == Kind::Gradient)
+			{
+				const auto dx = std::int64_t(x) - w / 2;
+				const auto dy = std::int64_t(y) - h / 2;
+				const auto distance = std::sqrt(double(dx * dx + dy * dy)) / std::sqrt(double(w * w + h * h) / 4);
+
+				pixel[0] = clamp16(x * 0xFFFF / std::max<std::int64_t>(w - 1, 1));
+				pixel[1] = clamp16(y * 0xFFFF / std::max<std::int64_t>(h - 1, 1));
+				pixel[2] = clamp16(std::int64_t(distance * 0xFFFF));
+				pixel[3] = clamp16(0xFFFF - pixel[0] / 2);
+			}
+			else if (kind == Kind::Palette)
+			{
+				// Each 16 pixel tile draws a 4 colour pattern over colours of its own
+				const auto tile = hash(x / 16, y / 16, 7);
+				const auto pattern = ((x ^ y) >> 2) & 3;
+				pixel[0] = pixel[1] = pixel[2] = pixel[3] = std::uint16_t(tile ^ (pattern << 14));
+			}
+			else
+			{
+				const auto noise = std::int64_t(random % 129) - 64;
+				pixel[0] = clamp16(x * 0xFFFF / w + noise);
+				pixel[1] = clamp16(y * 0xFFFF / h - noise);
+				pixel[2] = clamp16(0xFFFF - x * 0xFFFF / w + noise);
+				pixel[3] = clamp16(0xFFFF - y * 0x7FFF / h + noise);
+			}
+		}
+	}
+};
+
+// The palette of the depth, every fourth colour translucent
+std::vector<std::array<std::uint8_t, 4>> makePalette(std::uint8_t depth)
+{
+	std::vector<std::array<std::uint8_t, 4>> palette(std::size_t(1) << depth);
+	for (std::uint32_t index = 0; index < palette.size(); index++)
+	{
+		const auto color = hash(index, depth, 11);
+		palette[index] = { std::uint8_t(color), std::uint8_t(color >> 8), std::uint8_t(color >> 16), std::uint8_t(index % 4 == 3 ? 128 : 255) };
+	}
+
+	return palette;
+}
+
+int channelCount(std::uint8_t colorType)
+{
+	return colorType == 0 || colorType == 3 ? 1 : colorType == 4 ? 2 : colorType == 2 ? 3 : 4;
+}
+
+std::size_t rowBytes(std::size_t width, Format format)
+{
+	return (width * channelCount(format.colorType) * format.depth + 7) / 8;
+}
+
+// Packs the pixels startX, startX + stepX... of a 16 bit RGBA row as samples of format, high bits first
+void packRow(const std::uint16_t* row, std::uint8_t* out, std::size_t width, Format format, std::size_t startX = 0, std::size_t stepX = 1)
+{
+	static constexpr int channelsOf[7][4]{ { 0 }, {}, { 0, 1, 2 }, { 0 }, { 0, 3 }, {}, { 0, 1, 2, 3 } };
+
+	const auto channels = channelCount(format.colorType);
+	const auto* used = channelsOf[format.colorType];
+
+	if (format.depth < 8)
+	{
+		std::memset(out, 0, rowBytes(width, format));
+
+		std::size_t bit{};
+		for (auto x = startX; x < width; x += stepX, bit += format.depth)
+		{
+			const auto sample = row[4 * x] >> (16 - format.depth);
+			out[bit / 8] |= std::uint8_t(sample << (8 - format.depth - bit % 8));
+		}
+	}
+	else
+	{
+		for (auto x = startX; x < width; x += stepX)
+		{
+			for (int channel = 0; channel < channels; channel++)
+			{
+				const auto sample = row[4 * x + used[channel]];
+				if (format.depth == 16)
+				{
+					*out++ = std::uint8_t(sample >> 8);
+				}
+
+				*out++ = std::uint8_t(format.depth == 16 ? sample : sample >> 8);
+			}
+		}
+	}
+}
+
+// The 8 bit RGBA pixels png::readPng decodes a packed row to: samples below 8 bits scaled up, 16 bit ones
+// cut to their high byte, gray spread to the colours and the palette looked up
+void viewRow(const std::uint16_t* row, std::uint8_t* out, std::size_t width, Format format, std::span<const std::array<std::uint8_t, 4>> palette)
+{
+	for (std::size_t x = 0; x < width; x++, out += 4)
+	{
+		const auto* pixel = row + 4 * x;
+
+		if (format.colorType == 3)
+		{
+			const auto& color = palette[pixel[0] >> (16 - format.depth)];
+			std::copy(color.begin(), color.end(), out);
+			continue;
+		}
+
+		const auto sample = [&](int channel)
+		{
+			const auto value = pixel[channel];
+			return format.depth < 8 ? std::uint8_t((value >> (16 - format.depth)) * (255 / ((1 << format.depth) - 1))) : std::uint8_t(value >> 8);
+		};
+
+		const bool gray = format.colorType == 0 || format.colorType == 4;
+		const bool alpha = format.colorType == 4 || format.colorType == 6;
+
+		out[0] = sample(0);
+		out[1] = gray ? out[0] : sample(1);
+		out[2] = gray ? out[0] : sample(2);
+		out[3] = alpha ? sample(3) : 255;
+	}
+}
+
+struct Checksums
+{
+	std::uint32_t samples{};
+	std::uint32_t pixels{};
+};
+
+// Writes one image to sink and returns its checksums
+Checksums writeImage(const png::Sink& sink, const Content& content, Format format, bool interlace, const png::WriteOptions& options)
+{
+	const auto width = content.width;
+	const auto height = content.height;
+	const auto palette = format.colorType == 3 ? makePalette(format.depth) : std::vector<std::array<std::uint8_t, 4>>{};
+
+	png::PixelFormat pixelFormat;
+	pixelFormat.colorType = format.colorType;
+	pixelFormat.depth = format.depth;
+
+	for (const auto& color : palette)
+	{
+		pixelFormat.palette.colors.push_back(color[0] | (color[1] << 8) | (color[2] << 16) | (std::uint32_t(color[3]) << 24));
+	}
+
+	png::RowEncoder encoder(width, height, sink, options, pixelFormat, interlace);
+	Checksums checksums;
+
+	std::vector<std::uint16_t> row(std::size_t(width) * 4);
+	std::vector<std::uint8_t> packed(rowBytes(width, format));
+	std::vector<std::uint8_t> view(std::size_t(width) * 4);
+
+	const auto addChecksums = [&]()
+	{
+		checksums.samples = deflate::crc32(packed, checksums.samples);
+
+		viewRow(row.data(), view.data(), width, format, palette);
+		checksums.pixels = deflate::crc32(view, checksums.pixels);
+	};
+
+	if (!interlace)
+	{
+		for (std::uint32_t y = 0; y < height; y++)
+		{
+			content.generateRow(y, row.data());
+			packRow(row.data(), packed.data(), width, format);
+
+			encoder.writeRow(packed);
+			addChecksums();
+		}
+	}
+	else
+	{
+		for (int pass = 0; pass < 7; pass++)
+		{
+			if (width <= png::adam7StartX[pass] || height <= png::adam7StartY[pass])
+			{
+				continue;
+			}
+
+			const auto passWidth = (width - png::adam7StartX[pass] + png::adam7StepX[pass] - 1) / png::adam7StepX[pass];
+
+			for (auto y = png::adam7StartY[pass]; y < height; y += png::adam7StepY[pass])
+			{
+				content.generateRow(y, row.data());
+				packRow(row.data(), packed.data(), width, format, png::adam7StartX[pass], png::adam7StepX[pass]);
+
+				encoder.writeRow(std::span(packed).first(rowBytes(passWidth, format)));
+			}
+		}
+
+		// The checksums follow the rows in order, whatever the interlacing
+		for (std::uint32_t y = 0; y < height; y++)
+		{
+			content.generateRow(y, row.data());
+			packRow(row.data(), packed.data(), width, format);
+			addChecksums();
+		}
+	}
+
+	encoder.finish();
+
+	return checksums;
+}
+
+std::vector<std::string_view> splitList(std::string_view list)
+{
+	std::vector<std::string_view> items;
+
+	while (!list.empty())
+	{
+		const auto comma = std::min(list.find(','), list.size());
+		items.push_back(list.substr(0, comma));
+		list.remove_prefix(std::min(comma + 1, list.size()));
+	}
+
+	return items;
+}
+
+template<typename T>
+bool parseNumber(std::string_view text, T& value)
+{
+	const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+	return error == std::errc{} && end == text.data() + text.size();
+}
+
+int usage()
+{
+	std::println("usage: make-corpus <directory> [--sizes 1,16,256,1024] [--kinds photo,flat,gradient,palette,deep]");
+	std::println("                   [--interlace none|adam7|both] [--level 0-10] [--filter minsum|entropy|brute|0-4] [--fast] [--threads n]");
+	return 1;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2 || std::string_view(argv[1]).starts_with("--"))
+	{
+		return usage();
+	}
+
+	const std::filesystem::path directory = argv[1];
+
+	std::vector<double> sizes{ 1 };
+	std::vector<const KindInfo*> selectedKinds;
+	std::vector<bool> interlaceModes{ false, true };
+	png::WriteOptions options;
+
+	for (int x = 2; x < argc; x++)
+	{
+		const std::string_view option = argv[x];
+
+		if (option == "--fast")
+		{
+			options.fast = true;
+			continue;
+		}
+
+		if (x + 1 == argc)
+		{
+			return usage();
+		}
+
+		const std::string_view value = argv[++x];
+
+		if (option == "--sizes")
+		{
+			sizes.clear();
+			for (const auto item : splitList(value))
+			{
+				double megapixels{};
+				if (!parseNumber(item, megapixels) || megapixels <= 0 || megapixels > 2048)
+				{
+					std::println("Invalid size {}", item);
+					return 1;
+				}
+
+				sizes.push_back(megapixels);
+			}
+		}
+		else if (option == "--kinds")
+		{
+			for (const auto item : splitList(value))
+			{
+				const auto kind = std::ranges::find(kinds, item, &KindInfo::name);
+				if (kind == kinds.end())
+				{
+					std::println("Unknown kind {}", item);
+					return 1;
+				}
+
+				selectedKinds.push_back(&*kind);
+			}
+		}
+		else if (option == "--interlace")
+		{
+			if (value == "none" || value == "adam7" || value == "both")
+			{
+				interlaceModes = value == "none" ? std::vector{ false } : value == "adam7" ? std::vector{ true } : std::vector{ false, true };
+			}
+			else
+			{
+				return usage();
+			}
+		}
+		else if (option == "--level")
+		{
+			if (!parseNumber(value, options.level) || options.level < 0 || options.level > deflate::Deflater::OptimalLevel)
+			{
+				return usage();
+			}
+		}
+		else if (option == "--filter")
+		{
+			if (value == "minsum")
+			{
+				options.filterStrategy = png::FilterStrategy::MinimumSum;
+			}
+			else if (value == "entropy")
+			{
+				options.filterStrategy = png::FilterStrategy::Entropy;
+			}
+			else if (value == "brute")
+			{
+				options.filterStrategy = png::FilterStrategy::BruteForce;
+			}
+			else if (parseNumber(value, options.filter) && options.filter <= 4)
+			{
+				options.filterStrategy = png::FilterStrategy::Fixed;
+			}
+			else
+			{
+				return usage();
+			}
+		}
+		else if (option == "--threads")
+		{
+			if (!parseNumber(value, options.threadCount))
+			{
+				return usage();
+			}
+		}
+		else
+		{
+			return usage();
+		}
+	}
+
+	if (selectedKinds.empty())
+	{
+		for (const auto& kind : kinds)
+		{
+			selectedKinds.push_back(&kind);
+		}
+	}
+
+	std::filesystem::create_directories(directory);
+	std::ofstream manifest(directory / "checksums.txt");
+	std::println(manifest, "# file width height colortype depth interlace samples-crc32 rgba8-crc32");
+
+	for (const auto megapixels : sizes)
+	{
+		// A megapixel is 1024 * 1024 pixels. Rows are 3 pixels longer than the image is high, so they don't end on whole bytes
+		const auto side = std::max<std::uint32_t>(8, std::uint32_t(std::sqrt(megapixels) * 1024));
+		const auto width = side + 3;
+		const auto height = side;
+
+		for (const auto* kind : selectedKinds)
+		{
+			const Content content(kind->kind, width, height);
+
+			for (const auto format : kind->formats)
+			{
+				for (const bool interlace : interlaceModes)
+				{
+					const auto name = std::format("{}-{}{}{}-{}mp.png", kind->name, corpus::colorTypeName(format.colorType), int(format.depth), interlace ? "-adam7" : "", megapixels);
+
+					const auto start = std::chrono::steady_clock::now();
+
+					std::ofstream file(directory / name, std::ios::binary);
+					const auto checksums = writeImage([&](std::span<const std::uint8_t> data) { file.write((const char*)data.data(), data.size()); }, content, format, interlace, options);
+
+					if (!file)
+					{
+						std::println("Failed to write {}", name);
+						return 1;
+					}
+
+					const auto bytes = std::size_t(file.tellp());
+					const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+					std::println(manifest, "{} {} {} {} {} {} {:08x} {:08x}", name, width, height, int(format.colorType), int(format.depth), int(interlace), checksums.samples, checksums.pixels);
+					std::println("{:<40}{:>8} x {:<8}{:>12.1f} MB{:>10.1f} s", name, width, height, bytes / 1e6, seconds);
+				}
+			}
+		}
+	}
+
+	return manifest ? 0 : 1;
+}
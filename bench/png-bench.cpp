@@ -0,0 +1,165 @@
+#include "../src/png.hpp"
+#include "corpus.hpp"
+
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <map>
+#include <print>
+#include <spanstream>
+#include <string>
+#include <string_view>
+#include <tuple>
+
+// Decode throughput of png::readPng over the PNG files of the directories given on the command line,
+// PngSuite and a few large synthetic images by default, grouped by colour type, bit depth and interlacing.
+// Each group reports the whole decode and then every stage on its own, as megapixels per second of that stage,
+// so a regression shows in the stage that caused it
+namespace
+{
+
+struct Sample
+{
+	std::vector<std::uint8_t> file;
+	png::PngInfo info;
+};
+
+struct Group
+{
+	std::size_t files{};
+	std::size_t fileBytes{};
+	std::size_t pixels{};
+	std::chrono::nanoseconds total{};
+	png::StageTimes stages;
+};
+
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<std::filesystem::path> directories(argv + 1, argv + argc);
+	if (directories.empty())
+	{
+		directories.push_back(TEST_FILES_DIR);
+	}
+
+	std::vector<Sample> samples;
+
+	if (argc == 1)
+	{
+		samples.push_back({ corpus::encode({ corpus::ImageSize, corpus::ImageSize, corpus::makePhoto(corpus::ImageSize, corpus::ImageSize) }) });
+		samples.push_back({ corpus::encode({ corpus::ImageSize, corpus::ImageSize, corpus::makeFlat(corpus::ImageSize, corpus::ImageSize) }) });
+	}
+
+	for (const auto& directory : directories)
+	{
+		for (const auto& entry : std::filesystem::directory_iterator(directory))
+		{
+			if (entry.path().extension() != ".png")
+			{
+				continue;
+			}
+
+			std::ifstream stream(entry.path(), std::ios::binary);
+			samples.push_back({ { std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() } });
+		}
+	}
+
+	// Files readPng rejects, like the broken ones of PngSuite, are left out quietly
+	std::erase_if(samples, [](Sample& sample)
+	{
+		std::cerr.setstate(std::ios::failbit);
+
+		std::ispanstream stream(std::span((const char*)sample.file.data(), sample.file.size()));
+		const auto chunks = png::readChunks(sample.file);
+		const auto info = chunks ? png::readHeaderChunk(chunks->front()) : std::nullopt;
+		const bool valid = info && png::readPng(stream);
+
+		std::cerr.clear();
+
+		if (valid)
+		{
+			sample.info = *info;
+		}
+
+		return !valid;
+	});
+
+	std::map<std::tuple<std::uint8_t, std::uint8_t, std::uint8_t>, Group> groups;
+	Group all;
+
+	deflate::Inflater inflater;
+
+	for (const auto& sample : samples)
+	{
+		const auto pixels = std::size_t(sample.info.width) * sample.info.height;
+		const auto repeats = std::clamp<std::size_t>(corpus::DecodeBytes / (pixels * 4), 3, 1000);
+
+		auto& group = groups[{ sample.info.colorType, sample.info.depth, sample.info.interlace }];
+
+		for (auto* sum : { &group, &all })
+		{
+			sum->files++;
+			sum->fileBytes += sample.file.size() * repeats;
+			sum->pixels += pixels * repeats;
+		}
+
+		for (std::size_t repeat = 0; repeat < repeats; repeat++)
+		{
+			png::StageTimes stages;
+
+			const auto start = std::chrono::steady_clock::now();
+			std::ispanstream stream(std::span((const char*)sample.file.data(), sample.file.size()));
+			png::readPng(stream, inflater, &stages);
+			const auto end = std::chrono::steady_clock::now();
+
+			for (auto* sum : { &group, &all })
+			{
+				sum->total += end - start;
+
+				for (std::size_t stage = 0; stage < stages.durations.size(); stage++)
+				{
+					sum->stages.durations[stage] += stages.durations[stage];
+				}
+			}
+		}
+	}
+
+	std::print("{:<30}{:>7}{:>10}{:>9}", "type", "files", "MB/s", "MP/s");
+	for (const auto name : png::stageNames)
+	{
+		std::print("{:>10}", name);
+	}
+
+	std::println("");
+
+	const auto printGroup = [](std::string_view name, const Group& group)
+	{
+		const auto megapixels = group.pixels / 1e6;
+		const auto seconds = std::chrono::duration<double>(group.total).count();
+
+		std::print("{:<30}{:>7}{:>10.1f}{:>9.1f}", name, group.files, group.fileBytes / 1e6 / seconds, megapixels / seconds);
+
+		for (const auto duration : group.stages.durations)
+		{
+			if (duration.count() == 0)
+			{
+				std::print("{:>10}", "-");
+			}
+			else
+			{
+				std::print("{:>10.1f}", megapixels / std::chrono::duration<double>(duration).count());
+			}
+		}
+
+		std::println("");
+	};
+
+	for (const auto& [key, group] : groups)
+	{
+		const auto [colorType, depth, interlace] = key;
+		printGroup(std::format("{} {} bit{}", corpus::colorTypeName(colorType), int(depth), interlace ? " interlaced" : ""), group);
+	}
+
+	printGroup("all", all);
+}
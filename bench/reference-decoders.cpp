@@ -0,0 +1,172 @@
+#include "reference-decoders.hpp"
+
+#include <cstring>
+
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+
+#ifdef HAVE_SPNG
+#include <spng.h>
+#endif
+
+#ifdef HAVE_STB_IMAGE
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#include <stb_image.h>
+#endif
+
+namespace referenceDecoders
+{
+
+#ifdef HAVE_LIBPNG
+
+struct LibpngInput
+{
+	std::span<const std::uint8_t> file;
+	std::size_t offset{};
+};
+
+static void libpngRead(png_structp png, png_bytep data, png_size_t length)
+{
+	auto& input = *(LibpngInput*)png_get_io_ptr(png);
+
+	if (length > input.file.size() - input.offset)
+	{
+		png_error(png, "read past the end of the file");
+	}
+
+	std::memcpy(data, input.file.data() + input.offset, length);
+	input.offset += length;
+}
+
+// Rejected files are counted, not reported
+static void libpngError(png_structp png, png_const_charp)
+{
+	png_longjmp(png, 1);
+}
+
+static void libpngWarning(png_structp, png_const_charp)
+{
+}
+
+static bool decodeLibpng(std::span<const std::uint8_t> file, std::vector<std::uint8_t>& rgba, std::uint32_t& width, std::uint32_t& height)
+{
+	auto png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, libpngError, libpngWarning);
+	auto info = png_create_info_struct(png);
+
+	LibpngInput input{ file };
+
+	// Nothing with a destructor may be created past this point, png_error jumps back here
+	if (setjmp(png_jmpbuf(png)))
+	{
+		png_destroy_read_struct(&png, &info, nullptr);
+		return false;
+	}
+
+	png_set_read_fn(png, &input, libpngRead);
+	png_read_info(png, info);
+
+	width = png_get_image_width(png, info);
+	height = png_get_image_height(png, info);
+
+	png_set_expand(png);
+	png_set_strip_16(png);
+	png_set_gray_to_rgb(png);
+	png_set_add_alpha(png, 0xFF, PNG_FILLER_AFTER);
+	const auto passes = png_set_interlace_handling(png);
+	png_read_update_info(png, info);
+
+	rgba.resize(std::size_t(width) * height * 4);
+
+	for (int pass = 0; pass < passes; pass++)
+	{
+		for (std::uint32_t y = 0; y < height; y++)
+		{
+			png_read_row(png, rgba.data() + std::size_t(y) * width * 4, nullptr);
+		}
+	}
+
+	png_read_end(png, nullptr);
+	png_destroy_read_struct(&png, &info, nullptr);
+
+	return true;
+}
+
+#endif
+
+#ifdef HAVE_SPNG
+
+static bool decodeSpng(std::span<const std::uint8_t> file, std::vector<std::uint8_t>& rgba, std::uint32_t& width, std::uint32_t& height)
+{
+	auto context = spng_ctx_new(0);
+
+	spng_ihdr header{};
+	std::size_t size{};
+
+	bool decoded = spng_set_png_buffer(context, file.data(), file.size()) == 0
+		&& spng_get_ihdr(context, &header) == 0
+		&& spng_decoded_image_size(context, SPNG_FMT_RGBA8, &size) == 0;
+
+	if (decoded)
+	{
+		rgba.resize(size);
+		decoded = spng_decode_image(context, rgba.data(), size, SPNG_FMT_RGBA8, SPNG_DECODE_TRNS) == 0;
+	}
+
+	spng_ctx_free(context);
+
+	width = header.width;
+	height = header.height;
+
+	return decoded;
+}
+
+#endif
+
+#ifdef HAVE_STB_IMAGE
+
+static bool decodeStbImage(std::span<const std::uint8_t> file, std::vector<std::uint8_t>& rgba, std::uint32_t& width, std::uint32_t& height)
+{
+	int imageWidth{};
+	int imageHeight{};
+	int channels{};
+
+	auto* pixels = stbi_load_from_memory(file.data(), int(file.size()), &imageWidth, &imageHeight, &channels, 4);
+	if (!pixels)
+	{
+		return false;
+	}
+
+	width = std::uint32_t(imageWidth);
+	height = std::uint32_t(imageHeight);
+
+	// stb_image only returns memory of its own, the copy is part of its cost here
+	rgba.assign(pixels, pixels + std::size_t(width) * height * 4);
+	stbi_image_free(pixels);
+
+	return true;
+}
+
+#endif
+
+std::vector<Decoder> available()
+{
+	std::vector<Decoder> decoders;
+
+#ifdef HAVE_LIBPNG
+	decoders.push_back({ "libpng", decodeLibpng });
+#endif
+
+#ifdef HAVE_SPNG
+	decoders.push_back({ "spng", decodeSpng });
+#endif
+
+#ifdef HAVE_STB_IMAGE
+	decoders.push_back({ "stb_image", decodeStbImage });
+#endif
+
+	return decoders;
+}
+
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+// png.h pulls in zlib.h, so like zlibReference the other PNG decoders live behind these wrappers in a separate file.
+// Each is compiled in only when its library was found: HAVE_LIBPNG, HAVE_SPNG and HAVE_STB_IMAGE
+namespace referenceDecoders
+{
+
+// Decodes a PNG file to 8 bit RGBA, the format png::readPng produces: palettes and tRNS applied, 16 bit samples
+// cut to their high byte and no gamma correction. Returns false if the library rejects the file
+using Decode = bool (*)(std::span<const std::uint8_t> file, std::vector<std::uint8_t>& rgba, std::uint32_t& width, std::uint32_t& height);
+
+struct Decoder
+{
+	std::string_view name;
+	Decode decode;
+};
+
+std::vector<Decoder> available();
+
+}
@@ -0,0 +1,59 @@
+#include "zlib-reference.hpp"
+
+#include <zlib.h>
+
+namespace zlibReference
+{
+
+static int windowBits(Framing framing)
+{
+	switch (framing)
+	{
+	case Framing::Raw:
+		return -MAX_WBITS;
+	case Framing::Gzip:
+		return MAX_WBITS + 16;
+	default:
+		return MAX_WBITS;
+	}
+}
+
+std::vector<std::uint8_t> compress(std::span<const std::uint8_t> data, int level, Framing framing)
+{
+	z_stream stream{};
+	deflateInit2(&stream, level, Z_DEFLATED, windowBits(framing), 8, Z_DEFAULT_STRATEGY);
+
+	std::vector<std::uint8_t> output(deflateBound(&stream, data.size()) + 32);
+
+	stream.next_in = const_cast<Bytef*>(data.data());
+	stream.avail_in = uInt(data.size());
+	stream.next_out = output.data();
+	stream.avail_out = uInt(output.size());
+
+	::deflate(&stream, Z_FINISH);
+
+	output.resize(stream.total_out);
+	deflateEnd(&stream);
+
+	return output;
+}
+
+bool decompress(std::span<const std::uint8_t> data, std::span<std::uint8_t> output, Framing framing)
+{
+	z_stream stream{};
+	inflateInit2(&stream, windowBits(framing));
+
+	stream.next_in = const_cast<Bytef*>(data.data());
+	stream.avail_in = uInt(data.size());
+	stream.next_out = output.data();
+	stream.avail_out = uInt(output.size());
+
+	const auto result = ::inflate(&stream, Z_FINISH);
+	const bool complete = result == Z_STREAM_END && stream.total_out == output.size();
+
+	inflateEnd(&stream);
+
+	return complete;
+}
+
+}
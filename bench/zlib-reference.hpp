@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// zlib.h declares a deflate function that collides with the deflate namespace, so the
+// reference implementation is only reachable through these wrappers from a separate file
+namespace zlibReference
+{
+
+enum class Framing
+{
+	Raw,
+	Zlib,
+	Gzip,
+};
+
+std::vector<std::uint8_t> compress(std::span<const std::uint8_t> data, int level, Framing framing);
+
+// Returns false if zlib rejects the data or it doesn't decompress to exactly output.size() bytes
+bool decompress(std::span<const std::uint8_t> data, std::span<std::uint8_t> output, Framing framing);
+
+}
@@ -3,6 +3,7 @@
 #include "src/png.hpp"
 
 #include <fstream>
+#include <spanstream>
 #include <string>
 #include <string_view>
 #include <print>
@@ -76,6 +77,19 @@ int main()
 
 			break;
 		}
+
+		// Written back with the default settings, the image must read as the same pixels
+		std::vector<char> encoded;
+		png::writePng(*imageOpt, [&](std::span<const std::uint8_t> data) { encoded.insert(encoded.end(), data.begin(), data.end()); });
+
+		std::ispanstream encodedStream(encoded);
+		const auto roundTrip = png::readPng(encodedStream);
+
+		if (!roundTrip || roundTrip->width != imageOpt->width || roundTrip->height != imageOpt->height || roundTrip->data != imageOpt->data)
+		{
+			std::cout << "ROUND TRIP FAILED" << std::endl;
+			break;
+		}
 	}
 
 	if (texture.getSize().x == 0)
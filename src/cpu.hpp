@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#include <optional>
+#include <string_view>
+#include <algorithm>
+#include <utility>
+
+// Hot kernels are compiled once per instruction set level and the best one the CPU supports is picked
+// at first use. The extra levels only exist for x86-64 Linux builds with GCC or Clang, elsewhere
+// every level runs the generic code.
+// The levels list features instead of using arch= so default target code can still be inlined into them,
+// and flatten pulls the whole kernel body into the specialized copy.
+#if defined(__x86_64__) && defined(__linux__) && (defined(__GNUC__) || defined(__clang__))
+#define CPU_DISPATCH 1
+#define CPU_TARGET_BMI2 __attribute__((target("popcnt,lzcnt,bmi,bmi2,avx,avx2,fma"), flatten))
+#define CPU_TARGET_AVX512 __attribute__((target("popcnt,lzcnt,bmi,bmi2,avx,avx2,fma,avx512f,avx512bw,avx512dq,avx512vl"), flatten))
+#else
+#define CPU_DISPATCH 0
+#define CPU_TARGET_BMI2
+#define CPU_TARGET_AVX512
+#endif
+
+#if CPU_DISPATCH
+#include <immintrin.h>
+#endif
+
+namespace cpu
+{
+
+enum class Isa : std::uint8_t
+{
+	Generic,
+	Bmi2,	// x86-64-v3: AVX2, BMI1, BMI2, LZCNT
+	Avx512,	// x86-64-v4: x86-64-v3 and AVX-512 F, BW, DQ, VL
+};
+
+inline std::optional<Isa> parseIsa(std::string_view name)
+{
+	if (name == "generic")
+	{
+		return Isa::Generic;
+	}
+	else if (name == "bmi2")
+	{
+		return Isa::Bmi2;
+	}
+	else if (name == "avx512")
+	{
+		return Isa::Avx512;
+	}
+
+	return std::nullopt;
+}
+
+inline Isa detectIsa()
+{
+#if CPU_DISPATCH
+	__builtin_cpu_init();
+
+	const bool v3 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("fma");
+	const bool v4 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl");
+
+	if (v3 && v4)
+	{
+		return Isa::Avx512;
+	}
+	else if (v3)
+	{
+		return Isa::Bmi2;
+	}
+#endif
+
+	return Isa::Generic;
+}
+
+// Highest level the kernels may use, Avx512 meaning no limit
+inline std::atomic<Isa>& isaLimit()
+{
+	static std::atomic<Isa> limit = []()
+	{
+		// PNG_PARSER_ISA=generic|bmi2|avx512 caps the level for the whole process
+		const char* name = std::getenv("PNG_PARSER_ISA");
+		return name ? parseIsa(name).value_or(Isa::Avx512) : Isa::Avx512;
+	}();
+
+	return limit;
+}
+
+// Forces kernels down to a lower level, mainly so tests can cover every variant on one machine.
+// Levels the CPU can't run are never selected, whatever the limit
+inline void forceIsa(Isa isa)
+{
+	isaLimit().store(isa, std::memory_order_relaxed);
+}
+
+inline Isa activeIsa()
+{
+	static const Isa detected = detectIsa();
+
+	return std::min(detected, isaLimit().load(std::memory_order_relaxed));
+}
+
+inline std::uint64_t extractBitsGeneric(std::uint64_t value, unsigned start, unsigned count)
+{
+	return (value >> start) & ((std::uint64_t(1) << count) - 1);
+}
+
+#if CPU_DISPATCH
+// shrx and bzhi, neither the mask nor the shift count goes through extra registers or flags
+__attribute__((target("bmi2"))) inline std::uint64_t extractBitsBmi2(std::uint64_t value, unsigned start, unsigned count)
+{
+	return _bzhi_u64(value >> start, count);
+}
+#endif
+
+// The count bits of value from bit start, count below 64. Only inlined into a kernel variant of Level
+// or above, the BMI2 form can't run anywhere else
+template<Isa Level>
+inline std::uint64_t extractBits(std::uint64_t value, unsigned start, unsigned count)
+{
+#if CPU_DISPATCH
+	if constexpr (Level >= Isa::Bmi2)
+	{
+		return extractBitsBmi2(value, start, count);
+	}
+#endif
+
+	return extractBitsGeneric(value, start, count);
+}
+
+// Calls the variant of a kernel matching the active level
+template<auto Generic, auto Bmi2, auto Avx512, typename... Args>
+decltype(auto) dispatch(Args&&... args)
+{
+	switch (activeIsa())
+	{
+	case Isa::Avx512:
+		return Avx512(std::forward<Args>(args)...);
+	case Isa::Bmi2:
+		return Bmi2(std::forward<Args>(args)...);
+	default:
+		return Generic(std::forward<Args>(args)...);
+	}
+}
+
+}
+
+// Compiles the call kernel arguments once per level, as name##Generic, name##Bmi2 and name##Avx512 taking
+// parameters, both lists given in parentheses. The constant isa holds the level, for kernels templated on it
+#define CPU_KERNEL_VARIANTS(Return, name, kernel, parameters, arguments) \
+	inline Return name##Generic parameters { [[maybe_unused]] constexpr auto isa = cpu::Isa::Generic; return kernel arguments; } \
+	CPU_TARGET_BMI2 inline Return name##Bmi2 parameters { [[maybe_unused]] constexpr auto isa = cpu::Isa::Bmi2; return kernel arguments; } \
+	CPU_TARGET_AVX512 inline Return name##Avx512 parameters { [[maybe_unused]] constexpr auto isa = cpu::Isa::Avx512; return kernel arguments; }
+
+// cpu::dispatch over the variants CPU_KERNEL_VARIANTS defined for name
+#define CPU_DISPATCH_VARIANTS(name) cpu::dispatch<name##Generic, name##Bmi2, name##Avx512>
+
+// The variants of CPU_KERNEL_VARIANTS and name itself, calling the one matching the active level
+#define CPU_DISPATCHED_KERNEL(Return, name, kernel, parameters, arguments) \
+	CPU_KERNEL_VARIANTS(Return, name, kernel, parameters, arguments) \
+	inline Return name parameters { return CPU_DISPATCH_VARIANTS(name) arguments; }
@@ -1,11 +1,22 @@
 #pragma once
 
+#include "cpu.hpp"
+#include "parallel.hpp"
+
 #include <string_view>
 #include <vector>
 #include <span>
 #include <array>
 #include <optional>
+#include <algorithm>
+#include <cstring>
+#include <bit>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
 #include <iostream>
+#include <cmath>
+#include <limits>
 
 namespace deflate
 {
@@ -14,105 +25,135 @@ struct HuffmanCode
 {
 	uint16_t value{};
 	uint8_t bits{};
+	uint8_t literals{}; // 2 when value holds two literals, the first one in the low byte
 };
 
-struct HuffmanTable : public std::vector<HuffmanCode>
+static constexpr auto MaxCodeLength = 15;
+
+constexpr std::uint16_t reverseBits(std::uint16_t v)
 {
-	uint8_t maxBits{};
+	v = ((v & 0x5555) << 1) | ((v >> 1) & 0x5555);
+	v = ((v & 0x3333) << 2) | ((v >> 2) & 0x3333);
+	v = ((v & 0x0F0F) << 4) | ((v >> 4) & 0x0F0F);
+	return (v << 8) | (v >> 8);
+}
 
-	using std::vector<HuffmanCode>::vector;
+constexpr std::uint16_t reverseBits(std::uint16_t v, uint8_t maxBits)
+{
+	return reverseBits(v) >> (16 - maxBits);
+}
 
-	static HuffmanTable makeTable(std::span<const uint8_t> lengths)
+// Fills a decode table indexed by the next maxBits bits of the stream in the order they are read,
+// so every code is written at its bit reversed position and repeated every (1 << length) entries.
+// Entries left unreachable by an incomplete code decode to unusedSymbol.
+// Returns false if the lengths describe more codes than fit in maxBits
+constexpr bool fillTable(std::span<HuffmanCode> table, std::span<const uint8_t> lengths, uint8_t maxBits, uint16_t unusedSymbol)
+{
+	std::array<uint16_t, MaxCodeLength + 1> lengthCount{};
+	for (auto l : lengths)
 	{
-		const auto maxLength = std::ranges::max(lengths);
+		lengthCount[l]++;
+	}
+	lengthCount[0] = 0;
 
-		std::vector<uint16_t> lengthCount(maxLength + 1);
-		for (auto l : lengths)
+	std::array<uint16_t, MaxCodeLength + 1> nextCode{};
+	std::size_t usedEntries{};
+	uint16_t code{};
+	for (uint16_t bits = 1; bits <= maxBits; bits++)
+	{
+		code = (code + lengthCount[bits - 1]) << 1;
+		nextCode[bits] = code;
+		usedEntries += std::size_t(lengthCount[bits]) << (maxBits - bits);
+	}
+
+	if (usedEntries > table.size())
+	{
+		return false;
+	}
+
+	if (usedEntries < table.size())
+	{
+		std::fill(table.begin(), table.end(), HuffmanCode{ unusedSymbol, maxBits });
+	}
+
+	for (uint16_t x = 0; x < lengths.size(); x++)
+	{
+		const auto len = lengths[x];
+		if (len == 0)
 		{
-			lengthCount[l]++;
+			continue;
 		}
-		lengthCount[0] = 0;
 
-		std::vector<uint16_t> nextCode(maxLength + 1);
-		uint16_t code{};
-		for (uint16_t bits = 1; bits <= maxLength; bits++)
+		const std::size_t stride = std::size_t(1) << len;
+		for (std::size_t i = reverseBits(nextCode[len]++, len); i < table.size(); i += stride)
 		{
-			code = (code + lengthCount[bits - 1]) << 1;
-			nextCode[bits] = code;
+			table[i] = { x, len };
 		}
+	}
 
-		HuffmanTable decodeTable(1 << maxLength);
-		decodeTable.maxBits = maxLength;
+	return true;
+}
 
-		for (uint16_t x = 0; x < lengths.size(); x++)
-		{
-			const auto len = lengths[x];
-			if (len == 0)
-			{
-				continue;
+struct HuffmanTable : public std::vector<HuffmanCode>
+{
+	uint8_t maxBits{};
 
-			}
+	using std::vector<HuffmanCode>::vector;
 
-			const auto code = nextCode[len]++;
+	// Rebuilds the table in place so the storage is reused from one block to the next
+	bool build(std::span<const uint8_t> lengths, uint16_t unusedSymbol)
+	{
+		maxBits = std::ranges::max(lengths);
+		resize(std::size_t(1) << maxBits);
 
-			decodeTable[code << (maxLength - len)] = { x, len };
-		}
+		return fillTable(*this, lengths, maxBits, unusedSymbol);
+	}
 
-		auto lastCode = decodeTable[0];
-		for (auto& code : decodeTable)
+	// Merges each literal with the literal following it whenever both codes fit in maxBits,
+	// so runs of literals decode two at a time
+	void pairLiterals()
+	{
+		// Going down keeps the entry of the second literal untouched, since x >> bits < x
+		for (auto x = size(); x-- > 0;)
 		{
-			if (code.bits == 0)
+			auto& first = (*this)[x];
+			if (first.value > 255)
 			{
-				code = lastCode;
+				continue;
 			}
-			else
+
+			const auto second = (*this)[x >> first.bits];
+			if (second.value > 255 || first.bits + second.bits > maxBits)
 			{
-				lastCode = code;
+				continue;
 			}
-		}
 
-		return decodeTable;
-	};
-};
-
-template<typename T>
-T reverseBits(T v)
-{
-	T r = v; // r will be reversed bits of v; first get LSB of v
-	auto s = sizeof(v) * CHAR_BIT - 1; // extra shift needed at end
-
-	for (v >>= 1; v; v >>= 1)
-	{
-		r <<= 1;
-		r |= v & 1;
-		s--;
+			first = { uint16_t(first.value | (second.value << 8)), uint8_t(first.bits + second.bits), 2 };
+		}
 	}
-	r <<= s; // shift when v's highest bits are zero
-
-	return r;
-}
-
-template<typename T>
-T reverseBits(T v, uint8_t maxBits)
-{
-	return reverseBits(v) >> ((sizeof(T) * 8) - maxBits);
-}
+};
 
-template<typename T>
-HuffmanCode decodeCode(const HuffmanTable& table, T bits)
+template<typename Table, typename T>
+HuffmanCode decodeCode(const Table& table, T bits)
 {
 	return table[bits & (T(-1) >> (sizeof(T) * 8 - table.maxBits))];
 }
 
-HuffmanTable invertTableBits(const HuffmanTable& table)
+// Same layout as HuffmanTable, but with a size known at compile time
+// so the fixed huffman tables can be built as constants
+template<std::uint8_t MaxBits>
+struct StaticHuffmanTable : public std::array<HuffmanCode, 1 << MaxBits>
 {
-	HuffmanTable newTable = table;
-	for (uint16_t x = 0; x < table.size(); x++)
+	static constexpr uint8_t maxBits = MaxBits;
+
+	static constexpr StaticHuffmanTable makeTable(std::span<const uint8_t> lengths)
 	{
-		newTable[reverseBits(x, table.maxBits)] = table[x];
+		StaticHuffmanTable table{};
+		fillTable(table, lengths, MaxBits, 0);
+
+		return table;
 	}
-	return newTable;
-}
+};
 
 template<typename T = std::uint8_t>
 struct BitStream
@@ -123,7 +164,7 @@ struct BitStream
 		std::uint8_t bitOffset{};
 	};
 
-	std::span<std::uint8_t> data{};
+	std::span<const std::uint8_t> data{};
 	Offset offset{};
 
 	void checkPosition() const
@@ -143,71 +184,67 @@ struct BitStream
 		}
 	}
 
-	template<typename I = std::uint8_t>
-	I readBits(std::uint8_t count)
+	// Up to 57 bits from the current position. Away from the end of the data they come from a single
+	// 8 bytes load, near it they're gathered byte by byte and any bit past the end reads as zero.
+	// Level picks the bit extraction, kernels pass the level they're compiled for
+	template<cpu::Isa Level = cpu::Isa::Generic>
+	std::uint64_t window(std::uint8_t count) const
 	{
-		if (count > sizeof(I) * 8)
-		{
-			throw std::runtime_error("invalid count for the size");
-		}
-
-		I out{};
-
-		uint8_t shift{};
-
-		if (offset.byteOffset >= data.size())
-		{
-			return out;
-		}
+		std::uint64_t bits{};
 
-		if (offset.bitOffset != 0)
+		if (offset.byteOffset + sizeof(bits) <= data.size())
 		{
-			const std::uint8_t byte = data[offset.byteOffset] >> offset.bitOffset;
-
-			const std::uint8_t available = 8 - offset.bitOffset;
-			const std::uint8_t toRead = std::min(available, count);
-
-			out |= (byte & (0xFF >> (8 - toRead)));
-			count -= toRead;
-
-			offset.bitOffset += toRead;
-			shift += toRead;
+			std::memcpy(&bits, data.data() + offset.byteOffset, sizeof(bits));
 
-			if (offset.bitOffset > 8)
-			{
-				throw std::runtime_error("Logic error");
-			}
-			else if (offset.bitOffset == 8)
+			if constexpr (std::endian::native == std::endian::big)
 			{
-				offset.bitOffset = 0;
-				offset.byteOffset++;
+				bits = std::byteswap(bits);
 			}
 		}
-
-		while (count >= 8)
+		else
 		{
-			if (offset.byteOffset >= data.size())
+			for (std::size_t x = 0; offset.byteOffset + x < data.size(); x++)
 			{
-				return out;
+				bits |= std::uint64_t(data[offset.byteOffset + x]) << (x * 8);
 			}
-
-			out |= (I(data[offset.byteOffset++]) << shift);
-			shift += 8;
-			count -= 8;
 		}
 
-		if (count > 0 && offset.byteOffset < data.size())
-		{
-			I byte = data[offset.byteOffset];
-
-			out |= (byte & (0xFF >> (8 - count))) << shift;
+		return cpu::extractBits<Level>(bits, offset.bitOffset, count);
+	}
 
-			offset.bitOffset = count;
+	// Reading past the end of the data still moves the position, which overrun then reports
+	template<typename I = std::uint8_t, cpu::Isa Level = cpu::Isa::Generic>
+	I readBits(std::uint8_t count)
+	{
+		if (count > sizeof(I) * 8 || count > 32)
+		{
+			throw std::runtime_error("invalid count for the size");
 		}
 
+		const auto out = I(window<Level>(count));
+		skipBits(count);
+
 		return out;
 	}
 	
+	template<typename I = std::uint8_t, cpu::Isa Level = cpu::Isa::Generic>
+	I peekBits(std::uint8_t count) const
+	{
+		return I(window<Level>(count));
+	}
+
+	void skipBits(std::uint8_t count)
+	{
+		offset.bitOffset += count;
+		offset.byteOffset += offset.bitOffset / 8;
+		offset.bitOffset %= 8;
+	}
+
+	bool overrun() const
+	{
+		return offset.byteOffset > data.size() || (offset.byteOffset == data.size() && offset.bitOffset > 0);
+	}
+
 	template<typename I = std::uint8_t>
 	I readBitsReversed(std::uint8_t count)
 	{
@@ -259,24 +296,19 @@ struct BitStream
 		return out;
 	}
 
-	uint16_t readHuffmanCode(const HuffmanTable& table)
+	template<cpu::Isa Level = cpu::Isa::Generic, typename Table>
+	HuffmanCode readHuffmanEntry(const Table& table)
 	{
-		const auto originalOffset = offset;
-
-		const auto bits = readBits<uint16_t>(table.maxBits);
+		const auto code = decodeCode(table, peekBits<uint16_t, Level>(table.maxBits));
+		skipBits(code.bits);
 
-		const auto code = decodeCode(table, bits);
-
-		offset = originalOffset;
-		offset.bitOffset += code.bits;
-
-		while (offset.bitOffset >= 8)
-		{
-			offset.bitOffset -= 8;
-			offset.byteOffset++;
-		}
+		return code;
+	}
 
-		return code.value;
+	template<cpu::Isa Level = cpu::Isa::Generic, typename Table>
+	uint16_t readHuffmanCode(const Table& table)
+	{
+		return readHuffmanEntry<Level>(table).value;
 	}
 };
 
@@ -355,200 +387,3021 @@ namespace Alphabet
 		Entry{13, 16385},
 		Entry{13, 24577},
 	};
+
+	// Length and distance symbols decoded through a single table, both padded to
+	// the 32 symbols a code can describe so any decoded symbol is a valid index.
+	// Length symbol s is at [s - LengthOffest], distance symbol d at [DistanceOffset + d]
+	static constexpr auto DistanceOffset = 32;
+	static constexpr auto InvalidSymbol = std::uint8_t(0xFF);
+	static constexpr std::array<Entry, 64> LengthDistance = []()
+	{
+		std::array<Entry, 64> table{};
+		std::fill(table.begin(), table.end(), Entry{ InvalidSymbol, 0 });
+		std::copy(Length.begin(), Length.end(), table.begin());
+		std::copy(Distance.begin(), Distance.end(), table.begin() + DistanceOffset);
+		return table;
+	}();
 }
 
-static const HuffmanTable staticLengthTable = []()
+static constexpr auto staticLengthTable = StaticHuffmanTable<9>::makeTable([]()
+{
+	std::array<std::uint8_t, 288> lengths{};
+	std::fill(lengths.begin() + 0, lengths.begin() + 144, 8);
+	std::fill(lengths.begin() + 144, lengths.begin() + 256, 9);
+	std::fill(lengths.begin() + 256, lengths.begin() + 280, 7);
+	std::fill(lengths.begin() + 280, lengths.begin() + 288, 8);
+	return lengths;
+}());
+
+// Fixed huffman codes are 7 to 9 bits long, so one 9 bits lookup resolves any of them,
+// with length symbols already mapped to their base length and extra bits
+struct FixedLengthCode
+{
+	static constexpr std::uint8_t Literal = 0xFD;
+	static constexpr std::uint8_t EndOfBlock = 0xFE;
+
+	uint16_t value{};
+	uint8_t bits{};
+	uint8_t extraBits{};
+};
+
+static constexpr auto fixedLengthCodes = []()
 {
-	std::vector<std::uint8_t> lengths;
-	lengths.insert(lengths.end(), 144, 8);
-	lengths.insert(lengths.end(), 112, 9);
-	lengths.insert(lengths.end(), 24, 7);
-	lengths.insert(lengths.end(), 8, 8);
-	return invertTableBits(HuffmanTable::makeTable(lengths));
+	std::array<FixedLengthCode, staticLengthTable.size()> table{};
+	for (std::size_t x = 0; x < table.size(); x++)
+	{
+		const auto code = staticLengthTable[x];
+		if (code.value < 256)
+		{
+			table[x] = { code.value, code.bits, FixedLengthCode::Literal };
+		}
+		else if (code.value == 256)
+		{
+			table[x] = { 0, code.bits, FixedLengthCode::EndOfBlock };
+		}
+		else
+		{
+			const auto entry = Alphabet::LengthDistance[code.value - Alphabet::LengthOffest];
+			table[x] = { entry.baseLength, code.bits, entry.extraBits };
+		}
+	}
+	return table;
 }();
 
-static const HuffmanTable staticDistanceTable = []()
+// Fixed distance codes are all 5 bits long, indexed by the bits as read from the stream
+static constexpr auto fixedDistanceCodes = []()
 {
-	std::vector<std::uint8_t> lengths;
-	lengths.insert(lengths.end(), 32, 5);
-	return invertTableBits(HuffmanTable::makeTable(lengths));
+	std::array<Alphabet::Entry, 32> table{};
+	for (std::uint16_t x = 0; x < table.size(); x++)
+	{
+		table[x] = Alphabet::LengthDistance[Alphabet::DistanceOffset + reverseBits(x, 5)];
+	}
+	return table;
 }();
 
-std::optional<std::vector<std::uint8_t>> inflate(std::span<std::uint8_t> input)
+// Plain and weighted sums over blocks of 32 bytes, a form compilers vectorize for every level
+std::uint32_t adler32Kernel(std::span<const std::uint8_t> data, std::uint32_t adler)
 {
-	BitStream<std::uint8_t> stream{ input };
+	constexpr std::uint32_t Base = 65521;
 
-	const auto CM = stream.readBits(4);
-	const auto CINFO = stream.readBits(4);
+	// Most bytes that can be summed before s2 could overflow 32 bits
+	constexpr std::size_t MaxRun = 5552;
 
-	const auto CMF = CINFO << 4 | CM;
+	std::uint32_t s1 = adler & 0xFFFF;
+	std::uint32_t s2 = adler >> 16;
 
-	if (CM != 8)
-	{
-		std::cerr << "Unsupported compression method" << std::endl;
-		return std::nullopt;
-	}
+	auto* bytes = data.data();
+	auto remaining = data.size();
 
-	if (CINFO > 7)
+	while (remaining > 0)
 	{
-		std::cerr << "Invalid window size" << std::endl;
-		return std::nullopt;
+		auto run = std::min(remaining, MaxRun);
+		remaining -= run;
+
+		for (; run >= 32; run -= 32, bytes += 32)
+		{
+			std::uint32_t sum{};
+			std::uint32_t weightedSum{};
+			for (std::uint32_t x = 0; x < 32; x++)
+			{
+				sum += bytes[x];
+				weightedSum += (32 - x) * bytes[x];
+			}
+
+			s2 += 32 * s1 + weightedSum;
+			s1 += sum;
+		}
+
+		for (; run > 0; run--)
+		{
+			s1 += *(bytes++);
+			s2 += s1;
+		}
+
+		s1 %= Base;
+		s2 %= Base;
 	}
 
-	const auto FCHECK = stream.readBits(5);
-	const auto FDICT = stream.readBits(1);
-	const auto FLEVEL = stream.readBits(2);
+	return (s2 << 16) | s1;
+}
 
-	const auto FLG = (FLEVEL << 6) | (FDICT << 5) | FCHECK;
+CPU_DISPATCHED_KERNEL(std::uint32_t, adler32, adler32Kernel, (std::span<const std::uint8_t> data, std::uint32_t adler = 1), (data, adler))
 
-	if (FDICT)
+// Adler-32 of two pieces of data joined, from the checksum of each and the size of the second,
+// so pieces checksummed separately, on different threads for instance, need no second pass
+std::uint32_t adler32Combine(std::uint32_t first, std::uint32_t second, std::size_t secondSize)
+{
+	constexpr std::uint64_t Base = 65521;
+
+	// Every byte of the second piece adds the first piece's plain sum once more to the weighted sum
+	const auto remainder = secondSize % Base;
+
+	const auto s1 = ((first & 0xFFFF) + (second & 0xFFFF) + Base - 1) % Base;
+	const auto s2 = (remainder * (first & 0xFFFF) + (first >> 16) + (second >> 16) + Base - remainder) % Base;
+
+	return std::uint32_t(s2 << 16 | s1);
+}
+
+// Slice by 8 tables for the reflected polynomial shared by gzip and PNG
+static constexpr auto crc32Tables = []()
+{
+	std::array<std::array<std::uint32_t, 256>, 8> tables{};
+	for (std::uint32_t x = 0; x < 256; x++)
 	{
-		std::cerr << "Dictionaries not supported" << std::endl;
-		return std::nullopt;
-	}
+		std::uint32_t crc = x;
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ (0xEDB88320 & (0u - (crc & 1)));
+		}
 
-	const auto checkValue = ((std::uint16_t)CMF << 8) + FLG;
+		tables[0][x] = crc;
+	}
 
-	if (checkValue % 31 != 0)
+	for (std::size_t table = 1; table < tables.size(); table++)
 	{
-		std::cerr << "FCHECK fail" << std::endl;
-		return std::nullopt;
+		for (std::size_t x = 0; x < 256; x++)
+		{
+			tables[table][x] = (tables[table - 1][x] >> 8) ^ tables[0][tables[table - 1][x] & 0xFF];
+		}
 	}
 
-	std::vector<uint8_t> outputData;
+	return tables;
+}();
 
-	// read blocks
-	while (true)
+std::uint32_t crc32Kernel(std::span<const std::uint8_t> data, std::uint32_t crc)
+{
+	const auto& tables = crc32Tables;
+
+	crc = ~crc;
+
+	auto* bytes = data.data();
+	auto remaining = data.size();
+
+	for (; remaining >= 8; remaining -= 8, bytes += 8)
 	{
-		const auto BFINAL = stream.readBits(1);
-		const auto BTYPE = stream.readBits(2);
+		std::uint32_t low;
+		std::uint32_t high;
+		std::memcpy(&low, bytes, sizeof(low));
+		std::memcpy(&high, bytes + 4, sizeof(high));
 
-		// Raw data
-		if(BTYPE == 0)
+		if constexpr (std::endian::native == std::endian::big)
 		{
-			stream.roundPosition();
-			const auto LEN = stream.readBits<uint16_t>(16);
-			const auto NLEN = stream.readBits<uint16_t>(16);
+			low = std::byteswap(low);
+			high = std::byteswap(high);
+		}
 
-			if (LEN != (uint16_t)~NLEN)
-			{
-				std::cerr << "invalid raw block length" << std::endl;
-				return std::nullopt;
-			}
+		low ^= crc;
 
-			outputData.append_range(stream.data.subspan(stream.offset.byteOffset, LEN));
-			stream.offset.byteOffset += LEN;
-		}
-		else
-		{
-			const HuffmanTable* lengthTable = &staticLengthTable;
-			const HuffmanTable* distanceTable = &staticDistanceTable;
+		crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF] ^ tables[5][(low >> 16) & 0xFF] ^ tables[4][low >> 24] ^
+			tables[3][high & 0xFF] ^ tables[2][(high >> 8) & 0xFF] ^ tables[1][(high >> 16) & 0xFF] ^ tables[0][high >> 24];
+	}
 
-			HuffmanTable dynamicLengthTable;
-			HuffmanTable dynamicDistanceTable;
+	for (; remaining > 0; remaining--)
+	{
+		crc = (crc >> 8) ^ tables[0][(crc ^ *(bytes++)) & 0xFF];
+	}
 
-			// Dynamic huffman
-			if (BTYPE == 2)
-			{
-				const auto HLIT = stream.readBits(5) + 257u;
-				const auto HDIST = stream.readBits(5) + 1u;
-				const auto HCLEN = stream.readBits(4) + 4u;
+	return ~crc;
+}
 
-				constexpr static std::array<uint8_t, 19> permutations{ 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+CPU_DISPATCHED_KERNEL(std::uint32_t, crc32, crc32Kernel, (std::span<const std::uint8_t> data, std::uint32_t crc = 0), (data, crc))
 
-				std::vector<std::uint8_t> codeLenght(19);
-				for (int x = 0; x < HCLEN; x++)
-				{
-					codeLenght[permutations[x]] = stream.readBits(3);
-				}
+template<std::size_t ChunkSize>
+void copyChunks(std::uint8_t*& dst, const std::uint8_t*& src, std::size_t& length)
+{
+	for (; length >= ChunkSize; length -= ChunkSize, dst += ChunkSize, src += ChunkSize)
+	{
+		std::memcpy(dst, src, ChunkSize);
+	}
+}
 
-				auto codeTable = HuffmanTable::makeTable(codeLenght);
-				codeTable = invertTableBits(codeTable);
+// Copies a match in the widest chunks the level has registers for. Chunks never overlap
+// as long as they're no larger than the distance, shorter distances fall back to bytes
+template<cpu::Isa Isa>
+void copyMatchBytes(std::uint8_t* dst, std::size_t length, std::size_t distance)
+{
+	const std::uint8_t* src = dst - distance;
 
-				const auto codeDecode = [&](auto count)
-				{
-					std::vector<std::uint8_t> vector;
-					vector.reserve(count);
+	if (distance == 1)
+	{
+		std::memset(dst, *src, length);
+		return;
+	}
 
-					while (vector.size() < count)
-					{
-						const auto code = stream.readHuffmanCode(codeTable);
-						if (code >= 0 && code <= 15)
-						{
-							vector.push_back(code);
-						}
-						else if (code == 16)
-						{
-							const auto repeatLength = stream.readBits<uint8_t>(2) + 3;
-							vector.insert(vector.end(), repeatLength, vector.back());
-						}
-						else if (code == 17)
-						{
-							const auto repeatLength = stream.readBits<uint8_t>(3) + 3;
-							vector.insert(vector.end(), repeatLength, 0);
-						}
-						else if (code == 18)
-						{
-							const auto repeatLength = stream.readBits<uint8_t>(7) + 11;
-							vector.insert(vector.end(), repeatLength, 0);
-						}
-					}
+	if constexpr (Isa >= cpu::Isa::Avx512)
+	{
+		if (distance >= 64)
+		{
+			copyChunks<64>(dst, src, length);
+		}
+	}
 
-					return vector;
-				};
+	if constexpr (Isa >= cpu::Isa::Bmi2)
+	{
+		if (distance >= 32)
+		{
+			copyChunks<32>(dst, src, length);
+		}
+	}
 
-				const auto lengths = codeDecode(HLIT + HDIST);
+	if (distance >= 8)
+	{
+		copyChunks<8>(dst, src, length);
+	}
+
+	while (length--)
+	{
+		*(dst++) = *(src++);
+	}
+}
 
-				dynamicLengthTable = HuffmanTable::makeTable({ lengths.begin(), HLIT });
-				dynamicDistanceTable = HuffmanTable::makeTable({ lengths.begin() + HLIT, HDIST });
+// Content of a zlib stream made only of stored blocks, and where its Adler-32 trailer starts
+struct StoredBlocks
+{
+	std::vector<std::span<const std::uint8_t>> blocks;
+	std::size_t trailerOffset{};
+};
 
-				dynamicLengthTable = invertTableBits(dynamicLengthTable);
-				dynamicDistanceTable = invertTableBits(dynamicDistanceTable);
+// Returns views of the content of every block when the stream is only made of stored blocks,
+// so level 0 streams can be consumed straight from the input without being inflated.
+// The trailer is only known to be there, checking it against the blocks is up to the caller
+std::optional<StoredBlocks> storedBlocks(std::span<const std::uint8_t> input)
+{
+	if (input.size() < 2 || (input[0] & 0x0F) != 8 || (input[1] & 0x20) || ((input[0] << 8) | input[1]) % 31 != 0)
+	{
+		return std::nullopt;
+	}
 
-				lengthTable = &dynamicLengthTable;
-				distanceTable = &dynamicDistanceTable;
-			}
+	std::vector<std::span<const std::uint8_t>> blocks;
 
-			while (true)
-			{
-				const auto code = stream.readHuffmanCode(*lengthTable);
-				if (code >= 0 && code <= 255)
-				{
-					outputData.push_back(code);
-				}
-				else if (code == 256)
-				{
-					break;
-				}
-				else
-				{
-					const auto lengthEntry = Alphabet::Length[code - Alphabet::LengthOffest];
-					const auto length = lengthEntry.baseLength + stream.readBits<std::uint16_t>(lengthEntry.extraBits);
+	// Stored blocks end on a byte boundary, so every block header after the zlib header is byte aligned
+	std::size_t offset = 2;
+	while (true)
+	{
+		if (offset + 5 > input.size())
+		{
+			return std::nullopt;
+		}
 
-					const auto distanceCode = stream.readHuffmanCode(*distanceTable);
-					const auto distanceEntry = Alphabet::Distance[distanceCode];
-					const auto distance = distanceEntry.baseLength + stream.readBits<std::uint16_t>(distanceEntry.extraBits);
+		const auto BFINAL = input[offset] & 1;
+		const auto BTYPE = (input[offset] >> 1) & 0b11;
 
-					outputData.resize(outputData.size() + length);
+		const std::uint16_t LEN = input[offset + 1] | (input[offset + 2] << 8);
+		const std::uint16_t NLEN = input[offset + 3] | (input[offset + 4] << 8);
 
-					auto dst = outputData.data() + outputData.size() - length;
-					auto src = dst - distance;
+		offset += 5;
 
-					for (int x = 0; x < length; x++)
-					{
-						*(dst++) = *(src++); 
-					}
-				}
-			}
-		}
-	
-		if (BFINAL)
+		if (BTYPE != 0 || LEN != (uint16_t)~NLEN || offset + LEN > input.size())
 		{
-			break;
+			return std::nullopt;
 		}
-	}
 
-	return outputData;
-} 
+		blocks.push_back(input.subspan(offset, LEN));
+		offset += LEN;
 
-}
+		if (BFINAL)
+		{
+			if (offset + 4 > input.size())
+			{
+				return std::nullopt;
+			}
+
+			return StoredBlocks{ std::move(blocks), offset };
+		}
+	}
+}
+
+// Tables of the most recent dynamic blocks, found again by their code lengths
+// since encoders often emit many blocks sharing the same codes
+struct DynamicTableCache
+{
+	struct Entry
+	{
+		std::uint64_t hash{};
+		std::uint16_t literalCount{};
+		std::vector<std::uint8_t> lengths;
+		std::uint64_t lastUse{};
+
+		HuffmanTable lengthTable;
+		HuffmanTable distanceTable;
+	};
+
+	std::array<Entry, 8> entries;
+	std::uint64_t useCount{};
+
+	static std::uint64_t hashLengths(std::span<const uint8_t> lengths)
+	{
+		std::uint64_t hash = 0xcbf29ce484222325;
+		for (auto l : lengths)
+		{
+			hash ^= l;
+			hash *= 0x100000001b3;
+		}
+
+		return hash;
+	}
+
+	Entry* find(std::span<const uint8_t> lengths, std::uint16_t literalCount, std::uint64_t hash)
+	{
+		for (auto& entry : entries)
+		{
+			if (entry.hash == hash && entry.literalCount == literalCount && std::ranges::equal(entry.lengths, lengths))
+			{
+				entry.lastUse = ++useCount;
+				return &entry;
+			}
+		}
+
+		return nullptr;
+	}
+
+	// Evicts the least recently used entry, which can't be found until store is called on it
+	Entry& evict()
+	{
+		auto& entry = *std::ranges::min_element(entries, {}, &Entry::lastUse);
+		entry.lengths.clear();
+		entry.literalCount = 0;
+
+		return entry;
+	}
+
+	void store(Entry& entry, std::span<const uint8_t> lengths, std::uint16_t literalCount, std::uint64_t hash)
+	{
+		entry.hash = hash;
+		entry.literalCount = literalCount;
+		entry.lengths.assign(lengths.begin(), lengths.end());
+		entry.lastUse = ++useCount;
+	}
+};
+
+enum class Format
+{
+	Raw,	// Bare deflate blocks
+	Zlib,	// RFC 1950, as found in PNG
+	Gzip,	// RFC 1952, several members decompress to the concatenation of their content
+};
+
+enum class Status
+{
+	Ok,
+	NeedInput,
+	Error,
+};
+
+// Preset dictionaries for zlib streams with FDICT set, found through the DICTID of the header,
+// which is the Adler-32 of the whole dictionary. Only the last 32KiB can be referred to, so only
+// those are kept. Registering happens once, decoding only looks the window up
+struct DictionaryRegistry
+{
+	static constexpr std::size_t MaxSize = 32768;
+
+	std::unordered_map<std::uint32_t, std::vector<std::uint8_t>> dictionaries;
+
+	// Returns the DICTID streams compressed against the dictionary carry
+	std::uint32_t add(std::span<const std::uint8_t> dictionary)
+	{
+		const auto id = adler32(dictionary);
+		const auto window = dictionary.last(std::min(dictionary.size(), MaxSize));
+
+		dictionaries[id].assign(window.begin(), window.end());
+
+		return id;
+	}
+
+	const std::vector<std::uint8_t>* find(std::uint32_t id) const
+	{
+		const auto found = dictionaries.find(id);
+		return found != dictionaries.end() ? &found->second : nullptr;
+	}
+};
+
+Status readZlibHeader(BitStream<>& stream, std::optional<std::uint32_t>& dictionaryId, bool quiet = false)
+{
+	const auto fail = [&](const char* message)
+	{
+		if (!quiet)
+		{
+			std::cerr << message << std::endl;
+		}
+
+		return Status::Error;
+	};
+
+	if (stream.offset.byteOffset + 2 > stream.data.size())
+	{
+		return Status::NeedInput;
+	}
+
+	const auto CM = stream.readBits(4);
+	const auto CINFO = stream.readBits(4);
+
+	const auto CMF = CINFO << 4 | CM;
+
+	if (CM != 8)
+	{
+		return fail("Unsupported compression method");
+	}
+
+	if (CINFO > 7)
+	{
+		return fail("Invalid window size");
+	}
+
+	const auto FCHECK = stream.readBits(5);
+	const auto FDICT = stream.readBits(1);
+	const auto FLEVEL = stream.readBits(2);
+
+	const auto FLG = (FLEVEL << 6) | (FDICT << 5) | FCHECK;
+
+	const auto checkValue = ((std::uint16_t)CMF << 8) + FLG;
+
+	if (checkValue % 31 != 0)
+	{
+		return fail("FCHECK fail");
+	}
+
+	dictionaryId.reset();
+	if (FDICT)
+	{
+		if (stream.offset.byteOffset + 4 > stream.data.size())
+		{
+			return Status::NeedInput;
+		}
+
+		dictionaryId = stream.readBits<std::uint32_t>(32);
+		dictionaryId = std::byteswap(*dictionaryId);
+	}
+
+	return Status::Ok;
+}
+
+Status readGzipHeader(BitStream<>& stream, bool quiet = false)
+{
+	const auto fail = [&](const char* message)
+	{
+		if (!quiet)
+		{
+			std::cerr << message << std::endl;
+		}
+
+		return Status::Error;
+	};
+
+	constexpr std::uint8_t FHCRC = 1 << 1;
+	constexpr std::uint8_t FEXTRA = 1 << 2;
+	constexpr std::uint8_t FNAME = 1 << 3;
+	constexpr std::uint8_t FCOMMENT = 1 << 4;
+
+	const auto header = stream.data.subspan(std::min(stream.offset.byteOffset, stream.data.size()));
+	if (header.size() < 10)
+	{
+		return Status::NeedInput;
+	}
+
+	if (header[0] != 0x1F || header[1] != 0x8B)
+	{
+		return fail("Not a gzip member");
+	}
+
+	if (header[2] != 8)
+	{
+		return fail("Unsupported compression method");
+	}
+
+	const auto FLG = header[3];
+	if (FLG & 0xE0)
+	{
+		return fail("Reserved gzip flags set");
+	}
+
+	// MTIME, XFL and OS are skipped
+	std::size_t headerSize = 10;
+
+	if (FLG & FEXTRA)
+	{
+		if (header.size() < headerSize + 2)
+		{
+			return Status::NeedInput;
+		}
+
+		headerSize += 2 + (header[headerSize] | (header[headerSize + 1] << 8));
+	}
+
+	for (const auto flag : { FNAME, FCOMMENT })
+	{
+		if (FLG & flag)
+		{
+			const auto terminator = std::find(header.begin() + std::min(headerSize, header.size()), header.end(), 0);
+			if (terminator == header.end())
+			{
+				return Status::NeedInput;
+			}
+
+			headerSize = terminator - header.begin() + 1;
+		}
+	}
+
+	if (FLG & FHCRC)
+	{
+		if (header.size() < headerSize + 2)
+		{
+			return Status::NeedInput;
+		}
+
+		const std::uint16_t CRC16 = header[headerSize] | (header[headerSize + 1] << 8);
+		if ((crc32(header.first(headerSize)) & 0xFFFF) != CRC16)
+		{
+			return fail("gzip header checksum mismatch");
+		}
+
+		headerSize += 2;
+	}
+
+	if (header.size() < headerSize)
+	{
+		return Status::NeedInput;
+	}
+
+	stream.offset.byteOffset += headerSize;
+
+	return Status::Ok;
+}
+
+// quiet only returns errors, for data that may not be a stream at all
+Status readHeader(BitStream<>& stream, Format format, std::optional<std::uint32_t>& dictionaryId, bool quiet = false)
+{
+	dictionaryId.reset();
+
+	if (format == Format::Zlib)
+	{
+		return readZlibHeader(stream, dictionaryId, quiet);
+	}
+	else if (format == Format::Gzip)
+	{
+		return readGzipHeader(stream, quiet);
+	}
+
+	return Status::Ok;
+}
+
+std::uint32_t initialChecksum(Format format)
+{
+	return format == Format::Zlib ? 1 : 0;
+}
+
+std::uint32_t updateChecksum(Format format, std::uint32_t checksum, std::span<const std::uint8_t> data)
+{
+	if (format == Format::Zlib)
+	{
+		return adler32(data, checksum);
+	}
+	else if (format == Format::Gzip)
+	{
+		return crc32(data, checksum);
+	}
+
+	return checksum;
+}
+
+// Checks the trailer following the last block against the checksum and size of the output, quiet as for readHeader
+Status readTrailer(BitStream<>& stream, Format format, std::uint32_t checksum, std::uint32_t size, bool quiet = false)
+{
+	const auto fail = [&](const char* message)
+	{
+		if (!quiet)
+		{
+			std::cerr << message << std::endl;
+		}
+
+		return Status::Error;
+	};
+
+	stream.roundPosition();
+
+	if (format == Format::Raw)
+	{
+		return Status::Ok;
+	}
+
+	const std::size_t trailerSize = format == Format::Zlib ? 4 : 8;
+	if (stream.offset.byteOffset + trailerSize > stream.data.size())
+	{
+		return Status::NeedInput;
+	}
+
+	const auto* trailer = stream.data.data() + stream.offset.byteOffset;
+	const auto readLittleEndian = [&](std::size_t offset)
+	{
+		return std::uint32_t(trailer[offset] | (trailer[offset + 1] << 8) | (trailer[offset + 2] << 16) | (trailer[offset + 3] << 24));
+	};
+
+	if (format == Format::Zlib)
+	{
+		const std::uint32_t expectedAdler = (trailer[0] << 24) | (trailer[1] << 16) | (trailer[2] << 8) | trailer[3];
+		if (checksum != expectedAdler)
+		{
+			return fail("Adler-32 checksum mismatch");
+		}
+	}
+	else
+	{
+		if (checksum != readLittleEndian(0))
+		{
+			return fail("CRC-32 checksum mismatch");
+		}
+
+		if (size != readLittleEndian(4))
+		{
+			return fail("gzip size mismatch");
+		}
+	}
+
+	stream.offset.byteOffset += trailerSize;
+
+	return Status::Ok;
+}
+
+// Observers take the events they have a member function for. Decoders check for it at compile time and
+// don't even build the others, so NoObserver, taking none, costs nothing
+struct NoObserver
+{
+};
+
+// A block Inflater::decompress decoded, reported once it ended. png::readPng reads image data made only of
+// stored blocks without inflating it, so such images report no blocks
+struct BlockEvent
+{
+	std::chrono::steady_clock::time_point time;	// When the block started
+	std::uint8_t type{};						// 0 stored, 1 fixed codes, 2 dynamic codes
+	bool last{};
+	std::size_t inputBytes{};					// Compressed size, counting the bytes it started and ended in
+	std::size_t outputBytes{};
+};
+
+template<typename Events>
+concept ObservesBlocks = requires(Events& observer, const BlockEvent& event) { observer.blockInflated(event); };
+
+// Hands out a region of a larger buffer for the first allocation that fits in it, and heap memory for
+// any other. A vector reserving the region's size then decodes straight into it, as long as the data
+// isn't larger than announced, in which case it moves to the heap like any vector outgrowing its capacity
+template<typename T>
+struct RegionAllocator
+{
+	using value_type = T;
+
+	T* region = nullptr;
+	std::size_t regionSize{};
+	bool regionUsed = false;
+
+	RegionAllocator(T* region, std::size_t regionSize)
+		: region(region), regionSize(regionSize)
+	{
+	}
+
+	template<typename U>
+	RegionAllocator(const RegionAllocator<U>&)
+	{
+	}
+
+	T* allocate(std::size_t count)
+	{
+		if (!regionUsed && count <= regionSize)
+		{
+			regionUsed = true;
+			return region;
+		}
+
+		return std::allocator<T>{}.allocate(count);
+	}
+
+	void deallocate(T* pointer, std::size_t count)
+	{
+		if (pointer != region)
+		{
+			std::allocator<T>{}.deallocate(pointer, count);
+		}
+	}
+
+	bool operator==(const RegionAllocator& other) const
+	{
+		return region == other.region;
+	}
+};
+
+using RegionVector = std::vector<std::uint8_t, RegionAllocator<std::uint8_t>>;
+
+// Keeps the tables built while inflating, reusing them across blocks and across streams
+// when the same inflater is used for several of them
+struct Inflater
+{
+	HuffmanTable codeTable;
+	DynamicTableCache tableCache;
+
+	// Dictionaries zlib streams with FDICT set may use, shared and left untouched by inflaters
+	const DictionaryRegistry* dictionaries = nullptr;
+
+	// Errors are only returned, not printed, for data that may not be a stream at all
+	bool quiet = false;
+
+	// Where the stream being decoded starts in the outputData given to inflateBlock. Matches reaching
+	// before it continue into the preset dictionary of the stream, if it has one
+	std::size_t outputStart{};
+	std::span<const std::uint8_t> presetDictionary{};
+
+	// observer gets a BlockEvent for every block, if it takes them
+	template<typename Events = NoObserver>
+	std::optional<std::vector<std::uint8_t>> inflate(std::span<const std::uint8_t> input, std::size_t expectedSize = 0, Events&& observer = {});
+
+	template<typename Events = NoObserver>
+	std::optional<std::vector<std::uint8_t>> decompress(std::span<const std::uint8_t> input, Format format, std::size_t expectedSize = 0, Events&& observer = {});
+
+	// The dictionary the header asked for, empty if none
+	Status findDictionary(std::optional<std::uint32_t> dictionaryId, std::span<const std::uint8_t>& dictionary) const;
+
+	// Appends the dictionary the header asked for, if any, to the output matches can refer to
+	Status preloadDictionary(std::optional<std::uint32_t> dictionaryId, std::vector<std::uint8_t>& window) const;
+
+	// Decodes a whole stream, or a single gzip member, from header to trailer, appending it to outputData,
+	// a std::vector<std::uint8_t> or a RegionVector
+	template<typename Output, typename Events = NoObserver>
+	Status decompressMember(BitStream<>& stream, Format format, Output& outputData, Events&& observer = {});
+
+	// Decodes the next block, appending its content to outputData which must hold the previous output
+	// matches can refer to from outputStart on. Returns NeedInput, with outputData and stream left in an undefined state,
+	// when the block doesn't end before the data does
+	Status inflateBlock(BitStream<>& stream, std::vector<std::uint8_t>& outputData, bool& lastBlock);
+	Status inflateBlock(BitStream<>& stream, RegionVector& outputData, bool& lastBlock);
+
+	template<cpu::Isa Isa, typename Output>
+	Status inflateBlockWith(BitStream<>& stream, Output& outputData, bool& lastBlock);
+};
+
+template<cpu::Isa Isa, typename Output>
+Status Inflater::inflateBlockWith(BitStream<>& stream, Output& outputData, bool& lastBlock)
+{
+	// Anything read past the end of the data is zeros, so errors found there only mean the block is incomplete
+	const auto fail = [&](const char* message)
+	{
+		if (stream.overrun())
+		{
+			return Status::NeedInput;
+		}
+
+		if (!quiet)
+		{
+			std::cerr << message << std::endl;
+		}
+
+		return Status::Error;
+	};
+
+	const auto copyMatch = [&](std::size_t length, std::size_t distance)
+	{
+		if (distance > outputData.size() - outputStart)
+		{
+			const auto reach = distance - (outputData.size() - outputStart);
+			if (reach > presetDictionary.size())
+			{
+				return fail("distance too far back");
+			}
+
+			// Once the dictionary part is copied the rest of the match lies within the output
+			const auto fromDictionary = presetDictionary.subspan(presetDictionary.size() - reach, std::min(length, reach));
+			outputData.insert(outputData.end(), fromDictionary.begin(), fromDictionary.end());
+
+			length -= fromDictionary.size();
+			if (length == 0)
+			{
+				return Status::Ok;
+			}
+		}
+
+		outputData.resize(outputData.size() + length);
+		copyMatchBytes<Isa>(outputData.data() + outputData.size() - length, length, distance);
+
+		return Status::Ok;
+	};
+
+	const auto decodeBlock = [&](const auto& lengthTable, const auto& distanceTable)
+	{
+		while (!stream.overrun())
+		{
+			const auto entry = stream.readHuffmanEntry<Isa>(lengthTable);
+			if (entry.literals == 2)
+			{
+				outputData.push_back(entry.value & 0xFF);
+				outputData.push_back(entry.value >> 8);
+				continue;
+			}
+
+			const auto code = entry.value;
+			if (code <= 255)
+			{
+				outputData.push_back(code);
+			}
+			else if (code == 256)
+			{
+				return Status::Ok;
+			}
+			else
+			{
+				const auto lengthEntry = Alphabet::LengthDistance[code - Alphabet::LengthOffest];
+				if (lengthEntry.extraBits == Alphabet::InvalidSymbol)
+				{
+					return fail("invalid length code");
+				}
+
+				const auto length = lengthEntry.baseLength + stream.readBits<std::uint16_t, Isa>(lengthEntry.extraBits);
+
+				const auto distanceCode = stream.readHuffmanCode<Isa>(distanceTable);
+				const auto distanceEntry = Alphabet::LengthDistance[Alphabet::DistanceOffset + distanceCode];
+				if (distanceEntry.extraBits == Alphabet::InvalidSymbol)
+				{
+					return fail("invalid distance code");
+				}
+
+				const auto distance = distanceEntry.baseLength + stream.readBits<std::uint16_t, Isa>(distanceEntry.extraBits);
+				if (const auto status = copyMatch(length, distance); status != Status::Ok)
+				{
+					return status;
+				}
+			}
+		}
+
+		return Status::NeedInput;
+	};
+
+	const auto decodeFixedBlock = [&]()
+	{
+		while (!stream.overrun())
+		{
+			const auto code = fixedLengthCodes[stream.peekBits<std::uint16_t, Isa>(9)];
+			stream.skipBits(code.bits);
+
+			if (code.extraBits == FixedLengthCode::Literal)
+			{
+				outputData.push_back(code.value);
+			}
+			else if (code.extraBits == FixedLengthCode::EndOfBlock)
+			{
+				return Status::Ok;
+			}
+			else if (code.extraBits == Alphabet::InvalidSymbol)
+			{
+				return fail("invalid length code");
+			}
+			else
+			{
+				const auto length = code.value + stream.readBits<std::uint16_t, Isa>(code.extraBits);
+
+				const auto distanceEntry = fixedDistanceCodes[stream.readBits<std::uint8_t, Isa>(5)];
+				if (distanceEntry.extraBits == Alphabet::InvalidSymbol)
+				{
+					return fail("invalid distance code");
+				}
+
+				const auto distance = distanceEntry.baseLength + stream.readBits<std::uint16_t, Isa>(distanceEntry.extraBits);
+				if (const auto status = copyMatch(length, distance); status != Status::Ok)
+				{
+					return status;
+				}
+			}
+		}
+
+		return Status::NeedInput;
+	};
+
+	const auto BFINAL = stream.readBits(1);
+	const auto BTYPE = stream.readBits(2);
+
+	lastBlock = BFINAL;
+
+	auto status = Status::Ok;
+
+	// Raw data
+	if (BTYPE == 0)
+	{
+		stream.roundPosition();
+		const auto LEN = stream.readBits<uint16_t>(16);
+		const auto NLEN = stream.readBits<uint16_t>(16);
+
+		if (LEN != (uint16_t)~NLEN)
+		{
+			return fail("invalid raw block length");
+		}
+
+		if (stream.offset.byteOffset + LEN > stream.data.size())
+		{
+			return Status::NeedInput;
+		}
+
+		const auto outputSize = outputData.size();
+		outputData.resize(outputSize + LEN);
+		std::memcpy(outputData.data() + outputSize, stream.data.data() + stream.offset.byteOffset, LEN);
+		stream.offset.byteOffset += LEN;
+	}
+	else if (BTYPE == 1)
+	{
+		status = decodeFixedBlock();
+	}
+	else if (BTYPE == 2)
+	{
+		const auto HLIT = stream.readBits(5) + 257u;
+		const auto HDIST = stream.readBits(5) + 1u;
+		const auto HCLEN = stream.readBits(4) + 4u;
+
+		constexpr static std::array<uint8_t, 19> permutations{ 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+		std::array<std::uint8_t, 19> codeLenght{};
+		for (std::size_t x = 0; x < HCLEN; x++)
+		{
+			codeLenght[permutations[x]] = stream.readBits(3);
+		}
+
+		// 19 is not a code length symbol
+		if (!codeTable.build(codeLenght, 19))
+		{
+			return fail("invalid code length code");
+		}
+
+		std::array<std::uint8_t, 288 + 32> lengths{};
+		const auto lengthsCount = HLIT + HDIST;
+
+		std::size_t decodedLengths{};
+		while (decodedLengths < lengthsCount)
+		{
+			const auto code = stream.readHuffmanCode(codeTable);
+
+			std::uint8_t length{};
+			std::size_t repeatLength = 1;
+
+			if (code <= 15)
+			{
+				length = code;
+			}
+			else if (code == 16)
+			{
+				if (decodedLengths == 0)
+				{
+					return fail("repeated length without a previous length");
+				}
+
+				length = lengths[decodedLengths - 1];
+				repeatLength = stream.readBits<uint8_t>(2) + 3;
+			}
+			else if (code == 17)
+			{
+				repeatLength = stream.readBits<uint8_t>(3) + 3;
+			}
+			else if (code == 18)
+			{
+				repeatLength = stream.readBits<uint8_t>(7) + 11;
+			}
+			else
+			{
+				return fail("invalid code length code");
+			}
+
+			if (decodedLengths + repeatLength > lengthsCount)
+			{
+				return fail("too many code lengths");
+			}
+
+			std::fill_n(lengths.begin() + decodedLengths, repeatLength, length);
+			decodedLengths += repeatLength;
+		}
+
+		const std::span<const std::uint8_t> blockLengths{ lengths.data(), lengthsCount };
+		const auto hash = DynamicTableCache::hashLengths(blockLengths);
+
+		auto* tables = tableCache.find(blockLengths, HLIT, hash);
+		if (!tables)
+		{
+			tables = &tableCache.evict();
+
+			// 287 and 31 are valid codes in neither alphabet
+			if (!tables->lengthTable.build({ lengths.data(), HLIT }, 287) ||
+				!tables->distanceTable.build({ lengths.data() + HLIT, HDIST }, 31))
+			{
+				return fail("invalid code lengths");
+			}
+
+			tables->lengthTable.pairLiterals();
+
+			tableCache.store(*tables, blockLengths, HLIT, hash);
+		}
+
+		status = decodeBlock(tables->lengthTable, tables->distanceTable);
+	}
+	else
+	{
+		return fail("invalid block type");
+	}
+
+	// The end of block code itself may have been made of bits past the end of the data
+	if (status == Status::Ok && stream.overrun())
+	{
+		return Status::NeedInput;
+	}
+
+	return status;
+}
+
+CPU_KERNEL_VARIANTS(Status, inflateBlock, inflater.inflateBlockWith<isa>, (Inflater& inflater, BitStream<>& stream, std::vector<std::uint8_t>& outputData, bool& lastBlock), (stream, outputData, lastBlock))
+CPU_KERNEL_VARIANTS(Status, inflateRegionBlock, inflater.inflateBlockWith<isa>, (Inflater& inflater, BitStream<>& stream, RegionVector& outputData, bool& lastBlock), (stream, outputData, lastBlock))
+
+Status Inflater::inflateBlock(BitStream<>& stream, std::vector<std::uint8_t>& outputData, bool& lastBlock)
+{
+	return CPU_DISPATCH_VARIANTS(inflateBlock)(*this, stream, outputData, lastBlock);
+}
+
+Status Inflater::inflateBlock(BitStream<>& stream, RegionVector& outputData, bool& lastBlock)
+{
+	return CPU_DISPATCH_VARIANTS(inflateRegionBlock)(*this, stream, outputData, lastBlock);
+}
+
+Status Inflater::findDictionary(std::optional<std::uint32_t> dictionaryId, std::span<const std::uint8_t>& dictionary) const
+{
+	dictionary = {};
+
+	if (!dictionaryId)
+	{
+		return Status::Ok;
+	}
+
+	const auto* found = dictionaries ? dictionaries->find(*dictionaryId) : nullptr;
+	if (!found)
+	{
+		if (!quiet)
+		{
+			std::cerr << "Unknown preset dictionary" << std::endl;
+		}
+
+		return Status::Error;
+	}
+
+	dictionary = *found;
+
+	return Status::Ok;
+}
+
+Status Inflater::preloadDictionary(std::optional<std::uint32_t> dictionaryId, std::vector<std::uint8_t>& window) const
+{
+	std::span<const std::uint8_t> dictionary;
+	if (const auto status = findDictionary(dictionaryId, dictionary); status != Status::Ok)
+	{
+		return status;
+	}
+
+	window.insert(window.end(), dictionary.begin(), dictionary.end());
+
+	return Status::Ok;
+}
+
+template<typename Output, typename Events>
+Status Inflater::decompressMember(BitStream<>& stream, Format format, Output& outputData, Events&& observer)
+{
+	std::optional<std::uint32_t> dictionaryId;
+	if (const auto status = readHeader(stream, format, dictionaryId, quiet); status != Status::Ok)
+	{
+		return status;
+	}
+
+	// The dictionary stays where the registry keeps it, the output is never shifted to make room for it
+	if (const auto status = findDictionary(dictionaryId, presetDictionary); status != Status::Ok)
+	{
+		return status;
+	}
+
+	const auto memberStart = outputData.size();
+	auto checksum = initialChecksum(format);
+
+	// Earlier members are out of reach, like the data before any stream
+	outputStart = memberStart;
+
+	auto status = Status::Ok;
+	bool lastBlock = false;
+	while (!lastBlock)
+	{
+		const auto blockStart = outputData.size();
+		const auto blockOffset = stream.offset;
+
+		std::chrono::steady_clock::time_point startTime;
+		if constexpr (ObservesBlocks<Events>)
+		{
+			startTime = std::chrono::steady_clock::now();
+		}
+
+		status = inflateBlock(stream, outputData, lastBlock);
+		if (status != Status::Ok)
+		{
+			break;
+		}
+
+		if constexpr (ObservesBlocks<Events>)
+		{
+			const BitStream<> header{ stream.data, blockOffset };
+			const auto inputBytes = stream.offset.byteOffset + (stream.offset.bitOffset > 0) - blockOffset.byteOffset;
+
+			observer.blockInflated(BlockEvent{ startTime, std::uint8_t(header.peekBits(3) >> 1), lastBlock, inputBytes, outputData.size() - blockStart });
+		}
+
+		checksum = updateChecksum(format, checksum, std::span(outputData).subspan(blockStart));
+	}
+
+	outputStart = 0;
+	presetDictionary = {};
+
+	if (status != Status::Ok)
+	{
+		return status;
+	}
+
+	return readTrailer(stream, format, checksum, std::uint32_t(outputData.size() - memberStart), quiet);
+}
+
+bool isGzipMagic(std::span<const std::uint8_t> data, std::size_t offset)
+{
+	return offset + 2 <= data.size() && data[offset] == 0x1F && data[offset + 1] == 0x8B;
+}
+
+template<typename Events>
+std::optional<std::vector<std::uint8_t>> Inflater::decompress(std::span<const std::uint8_t> input, Format format, std::size_t expectedSize, Events&& observer)
+{
+	BitStream<> stream{ input };
+
+	std::vector<uint8_t> outputData;
+	outputData.reserve(expectedSize);
+
+	do
+	{
+		const auto status = decompressMember(stream, format, outputData, observer);
+		if (status == Status::NeedInput && !quiet)
+		{
+			std::cerr << "unexpected end of data" << std::endl;
+		}
+
+		if (status != Status::Ok)
+		{
+			return std::nullopt;
+		}
+	}
+	while (format == Format::Gzip && isGzipMagic(input, stream.offset.byteOffset));
+
+	return outputData;
+}
+
+template<typename Events>
+std::optional<std::vector<std::uint8_t>> Inflater::inflate(std::span<const std::uint8_t> input, std::size_t expectedSize, Events&& observer)
+{
+	return decompress(input, Format::Zlib, expectedSize, observer);
+}
+
+// Decompresses input handed over in pieces of any size. The content of each block goes to the sink
+// as soon as the block is complete, and only the last 32KiB later blocks can refer to are kept.
+// A block that turns out to be incomplete is decoded again from its start once enough input arrived,
+// so at most about one block of input is buffered
+struct InflateStream
+{
+	using Sink = std::function<void(std::span<const std::uint8_t>)>;
+
+	enum class State
+	{
+		Header,
+		Blocks,
+		Trailer,
+		Done,
+		Failed,
+	};
+
+	static constexpr std::size_t WindowSize = 32768;
+
+	Format format;
+	Sink sink;
+	Inflater inflater;
+
+	State state = State::Header;
+
+	std::vector<std::uint8_t> input;
+	BitStream<>::Offset offset{};
+	std::size_t retrySize{};
+
+	std::vector<std::uint8_t> window;
+	std::uint32_t checksum{};
+	std::uint32_t memberSize{};
+	std::size_t memberCount{};
+
+	InflateStream(Format format, Sink sink) : format(format), sink(std::move(sink))
+	{
+	}
+
+	// Returns false as soon as the data is known to be invalid
+	bool write(std::span<const std::uint8_t> data)
+	{
+		if (state == State::Failed)
+		{
+			return false;
+		}
+		else if (state == State::Done)
+		{
+			return true;
+		}
+
+		input.insert(input.end(), data.begin(), data.end());
+
+		// Retrying an incomplete block only once the pending input doubled keeps the total work linear
+		if (input.size() < retrySize)
+		{
+			return true;
+		}
+
+		return process();
+	}
+
+	// Returns true if the input written formed complete streams
+	bool finish()
+	{
+		if (state == State::Failed || !process())
+		{
+			return false;
+		}
+
+		const bool betweenMembers = format == Format::Gzip && state == State::Header && memberCount > 0 && input.size() < 2;
+		if (state != State::Done && !betweenMembers)
+		{
+			std::cerr << "unexpected end of data" << std::endl;
+			return false;
+		}
+
+		return true;
+	}
+
+	bool process()
+	{
+		auto status = Status::Ok;
+
+		while (status == Status::Ok && state != State::Done)
+		{
+			BitStream<> stream{ input, offset };
+
+			if (state == State::Header)
+			{
+				if (memberCount > 0)
+				{
+					const auto remaining = std::span<const std::uint8_t>(input).subspan(offset.byteOffset);
+					if (remaining.size() < 2)
+					{
+						status = Status::NeedInput;
+						break;
+					}
+
+					// Like gzip, whatever follows the last member is ignored
+					if (remaining[0] != 0x1F || remaining[1] != 0x8B)
+					{
+						offset.byteOffset = input.size();
+						state = State::Done;
+						break;
+					}
+				}
+
+				std::optional<std::uint32_t> dictionaryId;
+				status = readHeader(stream, format, dictionaryId);
+				if (status == Status::Ok)
+				{
+					status = inflater.preloadDictionary(dictionaryId, window);
+				}
+
+				if (status == Status::Ok)
+				{
+					checksum = initialChecksum(format);
+					memberSize = 0;
+					state = State::Blocks;
+				}
+			}
+			else if (state == State::Blocks)
+			{
+				const auto blockStart = window.size();
+
+				bool lastBlock = false;
+				status = inflater.inflateBlock(stream, window, lastBlock);
+
+				if (status == Status::Ok)
+				{
+					const auto blockData = std::span<const std::uint8_t>(window).subspan(blockStart);
+					checksum = updateChecksum(format, checksum, blockData);
+					memberSize += std::uint32_t(blockData.size());
+					sink(blockData);
+
+					if (window.size() > 2 * WindowSize)
+					{
+						window.erase(window.begin(), window.end() - WindowSize);
+					}
+
+					if (lastBlock)
+					{
+						state = State::Trailer;
+					}
+				}
+				else
+				{
+					window.resize(blockStart);
+				}
+			}
+			else if (state == State::Trailer)
+			{
+				status = readTrailer(stream, format, checksum, memberSize);
+				if (status == Status::Ok)
+				{
+					memberCount++;
+					window.clear();
+					state = format == Format::Gzip ? State::Header : State::Done;
+				}
+			}
+
+			if (status == Status::Ok)
+			{
+				offset = stream.offset;
+			}
+		}
+
+		if (status == Status::Error)
+		{
+			state = State::Failed;
+			return false;
+		}
+
+		input.erase(input.begin(), input.begin() + std::min(offset.byteOffset, input.size()));
+		offset.byteOffset = 0;
+
+		retrySize = status == Status::NeedInput ? input.size() * 2 : 0;
+
+		return true;
+	}
+};
+
+std::optional<std::vector<std::uint8_t>> inflate(std::span<const std::uint8_t> input, std::size_t expectedSize = 0)
+{
+	Inflater inflater;
+	return inflater.inflate(input, expectedSize);
+}
+
+std::optional<std::vector<std::uint8_t>> decompress(std::span<const std::uint8_t> input, Format format, std::size_t expectedSize = 0)
+{
+	Inflater inflater;
+	return inflater.decompress(input, format, expectedSize);
+}
+
+// Uncompressed size of a BGZF member at most
+constexpr std::size_t BgzfMaxOutput = 65536;
+
+// Size of a BGZF member, read from the BC subfield bgzip stores in the extra field of every header
+std::optional<std::size_t> bgzfMemberSize(std::span<const std::uint8_t> input, std::size_t offset)
+{
+	constexpr std::uint8_t FEXTRA = 1 << 2;
+
+	if (offset + 12 > input.size() || !isGzipMagic(input, offset) || input[offset + 2] != 8 || !(input[offset + 3] & FEXTRA))
+	{
+		return std::nullopt;
+	}
+
+	const std::size_t XLEN = input[offset + 10] | (input[offset + 11] << 8);
+
+	const auto extraEnd = offset + 12 + XLEN;
+	if (extraEnd > input.size())
+	{
+		return std::nullopt;
+	}
+
+	for (auto field = offset + 12; field + 4 <= extraEnd;)
+	{
+		const std::size_t SLEN = input[field + 2] | (input[field + 3] << 8);
+		if (input[field] == 'B' && input[field + 1] == 'C' && SLEN == 2 && field + 6 <= extraEnd)
+		{
+			// BSIZE is the member size minus one
+			return std::size_t(input[field + 4] | (input[field + 5] << 8)) + 1;
+		}
+
+		field += 4 + SLEN;
+	}
+
+	return std::nullopt;
+}
+
+// Whether a gzip header could start at offset, checking the fixed fields writers fill predictably
+bool isPlausibleGzipMember(std::span<const std::uint8_t> input, std::size_t offset)
+{
+	if (offset + 10 > input.size() || !isGzipMagic(input, offset))
+	{
+		return false;
+	}
+
+	const auto CM = input[offset + 2];
+	const auto FLG = input[offset + 3];
+	const auto XFL = input[offset + 8];
+	const auto OS = input[offset + 9];
+
+	return CM == 8 && !(FLG & 0xE0) && (XFL == 0 || XFL == 2 || XFL == 4) && (OS <= 13 || OS == 255);
+}
+
+// Offsets of the members of a gzip file. BGZF files are walked exactly through their block sizes,
+// anything else is scanned for plausible headers, which may find a few that are really compressed data
+std::vector<std::size_t> gzipMembers(std::span<const std::uint8_t> input)
+{
+	std::vector<std::size_t> offsets;
+
+	std::size_t offset{};
+	while (offset < input.size())
+	{
+		const auto size = bgzfMemberSize(input, offset);
+		if (!size || offset + *size > input.size())
+		{
+			break;
+		}
+
+		offsets.push_back(offset);
+		offset += *size;
+	}
+
+	if (!offsets.empty() && offset == input.size())
+	{
+		return offsets;
+	}
+
+	offsets.clear();
+
+	const auto* data = input.data();
+	for (offset = 0; offset < input.size(); offset++)
+	{
+		const auto* next = static_cast<const std::uint8_t*>(std::memchr(data + offset, 0x1F, input.size() - offset));
+		if (!next)
+		{
+			break;
+		}
+
+		offset = next - data;
+		if (isPlausibleGzipMember(input, offset))
+		{
+			offsets.push_back(offset);
+		}
+	}
+
+	return offsets;
+}
+
+// Decompresses a file made only of BGZF members, found at offsets, each straight into its place in the output:
+// their ISIZE fields give every member's output offset before any is decoded. Returns nothing when a member
+// doesn't decode to the size and end its header and trailer announce, leaving the file to the sequential decoder
+std::optional<std::vector<std::uint8_t>> decompressBgzf(std::span<const std::uint8_t> input, std::span<const std::size_t> offsets, unsigned threadCount)
+{
+	std::vector<std::size_t> outputOffsets;
+	std::size_t outputSize{};
+
+	for (std::size_t index = 0; index < offsets.size(); index++)
+	{
+		const auto end = index + 1 < offsets.size() ? offsets[index + 1] : input.size();
+		if (end - offsets[index] < 18)
+		{
+			return std::nullopt;
+		}
+
+		const auto* ISIZE = input.data() + end - 4;
+		const std::size_t size = ISIZE[0] | (ISIZE[1] << 8) | (ISIZE[2] << 16) | (std::size_t(ISIZE[3]) << 24);
+		if (size > BgzfMaxOutput)
+		{
+			return std::nullopt;
+		}
+
+		outputOffsets.push_back(outputSize);
+		outputSize += size;
+	}
+
+	std::vector<std::uint8_t> outputData(outputSize);
+	std::vector<std::uint8_t> decoded(offsets.size());
+	std::vector<Inflater> inflaters(parallel::workerCount(offsets.size(), threadCount));
+
+	for (auto& inflater : inflaters)
+	{
+		inflater.quiet = true;
+	}
+
+	parallel::forEach(offsets.size(), threadCount, [&](std::size_t index, unsigned worker)
+	{
+		const auto end = index + 1 < offsets.size() ? offsets[index + 1] : input.size();
+		const auto size = (index + 1 < offsets.size() ? outputOffsets[index + 1] : outputSize) - outputOffsets[index];
+		auto* region = outputData.data() + outputOffsets[index];
+
+		RegionVector member{ RegionAllocator<std::uint8_t>(region, size) };
+		member.reserve(size);
+
+		BitStream<> stream{ input, { offsets[index], 0 } };
+		const auto status = inflaters[worker].decompressMember(stream, Format::Gzip, member);
+
+		// The trailer checked the size against ISIZE, so the member filled its region unless it moved out of it
+		decoded[index] = status == Status::Ok && stream.offset.byteOffset == end && (size == 0 || member.data() == region);
+	});
+
+	if (!std::ranges::all_of(decoded, [](std::uint8_t ok) { return ok != 0; }))
+	{
+		return std::nullopt;
+	}
+
+	return outputData;
+}
+
+// Decompresses a gzip file made of several members, as written by bgzip or by concatenating gzip files,
+// decoding the members on up to threadCount threads, 0 meaning one per hardware thread.
+// BGZF files go through decompressBgzf. Elsewhere scanned member offsets that turn out to be inside another
+// member are decoded quietly for nothing and then ignored, and the members found are copied together once
+// decoded. Members are independent, so the output always matches decompress(input, Format::Gzip)
+std::optional<std::vector<std::uint8_t>> decompressParallel(std::span<const std::uint8_t> input, unsigned threadCount = 0)
+{
+	const auto offsets = gzipMembers(input);
+	if (offsets.size() < 2 || offsets.front() != 0)
+	{
+		return decompress(input, Format::Gzip);
+	}
+
+	// Whether gzipMembers walked the file through BGZF block sizes rather than scanning it
+	bool bgzf = true;
+	for (std::size_t index = 0; index < offsets.size() && bgzf; index++)
+	{
+		const auto end = index + 1 < offsets.size() ? offsets[index + 1] : input.size();
+		bgzf = bgzfMemberSize(input, offsets[index]) == end - offsets[index];
+	}
+
+	if (bgzf)
+	{
+		auto outputData = decompressBgzf(input, offsets, threadCount);
+		return outputData ? std::move(outputData) : decompress(input, Format::Gzip);
+	}
+
+	struct Member
+	{
+		Status status = Status::Error;
+		std::size_t end{};
+		std::vector<std::uint8_t> data;
+	};
+
+	std::vector<Member> members(offsets.size());
+	std::vector<Inflater> inflaters(parallel::workerCount(offsets.size(), threadCount));
+
+	for (auto& inflater : inflaters)
+	{
+		inflater.quiet = true;
+	}
+
+	parallel::forEach(offsets.size(), threadCount, [&](std::size_t index, unsigned worker)
+	{
+		const auto start = offsets[index];
+		const auto end = index + 1 < offsets.size() ? offsets[index + 1] : input.size();
+
+		auto& member = members[index];
+
+		// Only BGZF says where a member ends, so that ISIZE is really there. Its blocks hold at most 64KiB,
+		// and no member holds more than the best deflate ratio allows
+		if (bgzfMemberSize(input, start) == end - start && end - start >= 18)
+		{
+			const auto* ISIZE = input.data() + end - 4;
+			const std::size_t size = ISIZE[0] | (ISIZE[1] << 8) | (ISIZE[2] << 16) | (std::size_t(ISIZE[3]) << 24);
+			member.data.reserve(std::min({ size, BgzfMaxOutput, (end - start) * 1032 }));
+		}
+
+		BitStream<> stream{ input, { start, 0 } };
+		member.status = inflaters[worker].decompressMember(stream, Format::Gzip, member.data);
+		member.end = stream.offset.byteOffset;
+	});
+
+	// Follows the members from the start of the file, like the sequential decoder would
+	std::vector<const Member*> chain;
+	std::size_t offset{};
+	do
+	{
+		const auto found = std::ranges::lower_bound(offsets, offset);
+		if (found == offsets.end() || *found != offset)
+		{
+			break;
+		}
+
+		// The sequential decoder below decodes a failed member again, reporting why
+		const auto& member = members[found - offsets.begin()];
+		if (member.status != Status::Ok)
+		{
+			break;
+		}
+
+		chain.push_back(&member);
+		offset = member.end;
+	}
+	while (isGzipMagic(input, offset));
+
+	// A member the scan didn't consider plausible, or that failed, is left to the sequential decoder
+	std::vector<std::uint8_t> rest;
+	if (isGzipMagic(input, offset))
+	{
+		auto restOpt = decompress(input.subspan(offset), Format::Gzip);
+		if (!restOpt)
+		{
+			return std::nullopt;
+		}
+
+		rest = std::move(*restOpt);
+	}
+
+	std::vector<std::size_t> outputOffsets;
+	std::size_t outputSize{};
+	for (const auto* member : chain)
+	{
+		outputOffsets.push_back(outputSize);
+		outputSize += member->data.size();
+	}
+
+	std::vector<std::uint8_t> outputData(outputSize + rest.size());
+
+	parallel::forEach(chain.size(), threadCount, [&](std::size_t index, unsigned)
+	{
+		std::ranges::copy(chain[index]->data, outputData.begin() + outputOffsets[index]);
+	});
+
+	std::ranges::copy(rest, outputData.begin() + outputSize);
+
+	return outputData;
+}
+
+// Writes bits in the order deflate packs them, least significant first
+struct BitWriter
+{
+	std::vector<std::uint8_t> data;
+	std::uint64_t bits{};
+	std::uint8_t count{};
+
+	// value must not have bits set above bitCount, which is at most 32
+	void writeBits(std::uint32_t value, std::uint8_t bitCount)
+	{
+		bits |= std::uint64_t(value) << count;
+		count += bitCount;
+
+		if (count >= 32)
+		{
+			auto word = std::uint32_t(bits);
+			if constexpr (std::endian::native == std::endian::big)
+			{
+				word = std::byteswap(word);
+			}
+
+			const auto size = data.size();
+			data.resize(size + sizeof(word));
+			std::memcpy(data.data() + size, &word, sizeof(word));
+
+			bits >>= 32;
+			count -= 32;
+		}
+	}
+
+	// Pads with zeros up to the next byte boundary and moves every pending bit to data
+	void alignToByte()
+	{
+		for (; count > 0; count = count > 8 ? count - 8 : 0)
+		{
+			data.push_back(std::uint8_t(bits));
+			bits >>= 8;
+		}
+
+		bits = 0;
+	}
+
+	void writeBytes(std::span<const std::uint8_t> bytes)
+	{
+		alignToByte();
+		data.insert(data.end(), bytes.begin(), bytes.end());
+	}
+};
+
+// Code lengths minimizing the size of symbols with the given frequencies, none longer than maxBits.
+// Codes too long are shortened the way zlib does, moving leaves up until the lengths fit again.
+// A lone used symbol gets a sibling so the code is always complete
+void buildCodeLengths(std::span<const std::uint32_t> frequencies, std::uint8_t maxBits, std::span<std::uint8_t> lengths)
+{
+	std::ranges::fill(lengths, 0);
+
+	std::vector<std::pair<std::uint32_t, std::uint16_t>> leaves;
+	for (std::size_t x = 0; x < frequencies.size(); x++)
+	{
+		if (frequencies[x])
+		{
+			leaves.emplace_back(frequencies[x], std::uint16_t(x));
+		}
+	}
+
+	if (leaves.empty())
+	{
+		return;
+	}
+
+	if (leaves.size() == 1)
+	{
+		lengths[leaves.front().second] = 1;
+		lengths[leaves.front().second == 0 ? 1 : 0] = 1;
+		return;
+	}
+
+	std::ranges::sort(leaves);
+
+	// Two queue Huffman construction: leaves are taken in order, and so are the nodes made from them
+	const auto leafCount = leaves.size();
+	std::vector<std::uint64_t> weights(2 * leafCount - 1);
+	std::vector<std::uint32_t> parents(2 * leafCount - 1);
+
+	for (std::size_t x = 0; x < leafCount; x++)
+	{
+		weights[x] = leaves[x].first;
+	}
+
+	std::size_t nextLeaf{};
+	std::size_t nextNode = leafCount;
+	const auto takeSmallest = [&](std::size_t end)
+	{
+		if (nextLeaf < leafCount && (nextNode >= end || weights[nextLeaf] <= weights[nextNode]))
+		{
+			return nextLeaf++;
+		}
+
+		return nextNode++;
+	};
+
+	for (auto node = leafCount; node < weights.size(); node++)
+	{
+		const auto first = takeSmallest(node);
+		const auto second = takeSmallest(node);
+
+		weights[node] = weights[first] + weights[second];
+		parents[first] = std::uint32_t(node);
+		parents[second] = std::uint32_t(node);
+	}
+
+	// Parents always come after their children, so depths resolve walking back from the root
+	std::vector<std::uint16_t> depths(weights.size());
+	std::vector<std::uint32_t> lengthCounts(leafCount + 1);
+	for (auto node = weights.size() - 1; node-- > 0;)
+	{
+		depths[node] = depths[parents[node]] + 1;
+
+		if (node < leafCount)
+		{
+			lengthCounts[std::min<std::size_t>(depths[node], maxBits)]++;
+		}
+	}
+
+	std::uint64_t kraftSum{};
+	for (std::size_t length = 1; length <= maxBits && length < lengthCounts.size(); length++)
+	{
+		kraftSum += std::uint64_t(lengthCounts[length]) << (maxBits - length);
+	}
+
+	// Each step removes a maxBits leaf and splits a shorter one into two, one level deeper
+	for (; kraftSum > (std::uint64_t(1) << maxBits); kraftSum--)
+	{
+		lengthCounts[maxBits]--;
+
+		for (auto length = maxBits - 1; length > 0; length--)
+		{
+			if (lengthCounts[length])
+			{
+				lengthCounts[length]--;
+				lengthCounts[length + 1] += 2;
+				break;
+			}
+		}
+	}
+
+	// The rarest symbols get the longest codes
+	std::size_t leaf{};
+	for (std::size_t length = std::min<std::size_t>(maxBits, lengthCounts.size() - 1); length > 0; length--)
+	{
+		for (std::uint32_t x = 0; x < lengthCounts[length]; x++)
+		{
+			lengths[leaves[leaf++].second] = std::uint8_t(length);
+		}
+	}
+}
+
+// Canonical codes for the given lengths, bit reversed so they can be written least significant bit first
+constexpr void buildCodes(std::span<const std::uint8_t> lengths, std::span<std::uint16_t> codes)
+{
+	std::array<std::uint16_t, MaxCodeLength + 1> lengthCount{};
+	for (auto length : lengths)
+	{
+		lengthCount[length]++;
+	}
+
+	lengthCount[0] = 0;
+
+	std::array<std::uint16_t, MaxCodeLength + 1> nextCode{};
+	for (std::size_t length = 1; length <= MaxCodeLength; length++)
+	{
+		nextCode[length] = (nextCode[length - 1] + lengthCount[length - 1]) << 1;
+	}
+
+	for (std::size_t x = 0; x < lengths.size(); x++)
+	{
+		codes[x] = lengths[x] ? reverseBits(nextCode[lengths[x]]++, lengths[x]) : 0;
+	}
+}
+
+namespace Alphabet
+{
+	static constexpr auto LiteralCount = 286;
+	static constexpr auto DistanceCount = 30;
+	static constexpr auto EndOfBlock = 256;
+
+	// Index in Length of the symbol coding each match length from 3 to 258
+	static constexpr auto LengthSymbols = []()
+	{
+		std::array<std::uint8_t, 259> table{};
+		for (std::size_t length = 3; length < table.size(); length++)
+		{
+			std::uint8_t symbol = Length.size() - 1;
+			while (Length[symbol].baseLength > length)
+			{
+				symbol--;
+			}
+
+			table[length] = symbol;
+		}
+
+		return table;
+	}();
+
+	// Distance symbols, the first half indexed by distance - 1 up to 256,
+	// the second by (distance - 1) >> 7 since from there symbols cover multiples of 128
+	static constexpr auto DistanceSymbols = []()
+	{
+		std::array<std::uint8_t, 512> table{};
+		for (std::uint8_t symbol = 0; symbol < Distance.size(); symbol++)
+		{
+			const std::size_t first = Distance[symbol].baseLength;
+			const std::size_t last = first + (std::size_t(1) << Distance[symbol].extraBits) - 1;
+
+			for (auto distance = first; distance <= last; distance++)
+			{
+				if (distance <= 256)
+				{
+					table[distance - 1] = symbol;
+				}
+				else
+				{
+					table[256 + ((distance - 1) >> 7)] = symbol;
+				}
+			}
+		}
+
+		return table;
+	}();
+
+	constexpr std::uint8_t distanceSymbol(std::size_t distance)
+	{
+		return distance <= 256 ? DistanceSymbols[distance - 1] : DistanceSymbols[256 + ((distance - 1) >> 7)];
+	}
+
+	// Order the code length code lengths are stored in
+	static constexpr std::array<std::uint8_t, 19> CodeLengthOrder{ 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+}
+
+// A literal when distance is 0, otherwise a match of literalLength bytes
+struct Symbol
+{
+	std::uint16_t literalLength{};
+	std::uint16_t distance{};
+};
+
+struct FixedCodes
+{
+	std::array<std::uint8_t, 288> literalLengths{};
+	std::array<std::uint16_t, 288> literalCodes{};
+	std::array<std::uint8_t, 30> distanceLengths{};
+	std::array<std::uint16_t, 30> distanceCodes{};
+};
+
+static constexpr auto fixedCodes = []()
+{
+	FixedCodes codes;
+	std::fill(codes.literalLengths.begin() + 0, codes.literalLengths.begin() + 144, 8);
+	std::fill(codes.literalLengths.begin() + 144, codes.literalLengths.begin() + 256, 9);
+	std::fill(codes.literalLengths.begin() + 256, codes.literalLengths.begin() + 280, 7);
+	std::fill(codes.literalLengths.begin() + 280, codes.literalLengths.begin() + 288, 8);
+	std::ranges::fill(codes.distanceLengths, 5);
+
+	buildCodes(codes.literalLengths, codes.literalCodes);
+	buildCodes(codes.distanceLengths, codes.distanceCodes);
+
+	return codes;
+}();
+
+// Match finder settings per level, the values zlib uses
+struct LevelConfig
+{
+	std::uint16_t goodLength;	// Past this length the chain is searched a quarter as deep
+	std::uint16_t lazyLength;	// No lazy search past this length, or for greedy levels no hash insertion inside longer matches
+	std::uint16_t niceLength;	// Search stops at the first match this long
+	std::uint16_t chainLength;	// Candidates tried per position
+	bool lazy;
+};
+
+static constexpr std::array<LevelConfig, 10> levelConfigs
+{
+	LevelConfig{ 0, 0, 0, 0, false },
+	LevelConfig{ 4, 4, 8, 4, false },
+	LevelConfig{ 4, 5, 16, 8, false },
+	LevelConfig{ 4, 6, 32, 32, false },
+	LevelConfig{ 4, 4, 16, 16, true },
+	LevelConfig{ 8, 16, 32, 32, true },
+	LevelConfig{ 8, 16, 128, 128, true },
+	LevelConfig{ 8, 32, 128, 256, true },
+	LevelConfig{ 32, 128, 258, 1024, true },
+	LevelConfig{ 32, 258, 258, 4096, true },
+};
+
+// Number of bytes a and b have in common, up to maxLength
+std::size_t matchLength(const std::uint8_t* a, const std::uint8_t* b, std::size_t maxLength)
+{
+	std::size_t length{};
+	for (; length + 8 <= maxLength; length += 8)
+	{
+		std::uint64_t wordA;
+		std::uint64_t wordB;
+		std::memcpy(&wordA, a + length, sizeof(wordA));
+		std::memcpy(&wordB, b + length, sizeof(wordB));
+
+		if (const auto difference = wordA ^ wordB)
+		{
+			if constexpr (std::endian::native == std::endian::little)
+			{
+				return length + std::countr_zero(difference) / 8;
+			}
+			else
+			{
+				return length + std::countl_zero(difference) / 8;
+			}
+		}
+	}
+
+	while (length < maxLength && a[length] == b[length])
+	{
+		length++;
+	}
+
+	return length;
+}
+
+struct MatchCache;
+
+// LZ77 matching on hash chains followed by Huffman coding, keeping its tables between calls
+struct Deflater
+{
+	static constexpr std::size_t WindowSize = 32768;
+	static constexpr std::size_t HashBits = 15;
+	static constexpr std::size_t BlockSymbols = 1 << 14;
+	static constexpr std::size_t MaxStoredSize = 65535;
+	static constexpr std::size_t MinMatch = 3;
+	static constexpr std::size_t MaxMatch = 258;
+
+	// Position + 1 of the last occurrence of each hash, 0 meaning none
+	std::vector<std::uint32_t> head;
+	// Position + 1 of the previous occurrence of the same hash, indexed by position within the window
+	std::vector<std::uint32_t> previous;
+	std::vector<Symbol> symbols;
+
+	// Level 10 searches for the cheapest way to code the input instead of a good one, zopfli style:
+	// every match of every position is found once, then each block is parsed repeatedly by shortest path,
+	// pricing symbols with the code the previous pass produced. Blocks are split where their statistics
+	// change, and both the split search and the parses of the resulting blocks run on threadCount threads,
+	// 0 meaning one per hardware thread
+	static constexpr int OptimalLevel = 10;
+	static constexpr std::size_t OptimalSegmentSize = 1 << 20;
+	static constexpr std::size_t OptimalChainLength = 2048;
+	static constexpr int OptimalIterations = 10;
+
+	unsigned threadCount = 1;
+
+	// Appends deflate blocks coding data[start..] to writer, data[..start] being history matches may refer to.
+	// With final the last block ends the stream, otherwise the output ends on an empty stored block,
+	// byte aligned like a zlib sync flush, so more blocks can follow. Positions must fit in 32 bits
+	void compress(BitWriter& writer, std::span<const std::uint8_t> data, std::size_t start, int level, bool final);
+
+	void compressWith(BitWriter& writer, std::span<const std::uint8_t> data, std::size_t start, int level, bool final);
+
+	void compressOptimal(BitWriter& writer, std::span<const std::uint8_t> data, std::size_t start, bool final);
+
+	// Every match at each position of data[begin, end), matches reaching no further than end
+	void findMatches(std::span<const std::uint8_t> data, std::size_t begin, std::size_t end, MatchCache& cache);
+
+	std::vector<std::uint8_t> deflate(std::span<const std::uint8_t> input, int level = 6, Format format = Format::Zlib);
+
+	// Codes the pending symbols as one block, as whichever of stored, fixed or dynamic is smallest.
+	// raw is the input the symbols cover, which a stored block copies
+	void writeBlock(BitWriter& writer, std::span<const std::uint8_t> raw, bool final);
+};
+
+void writeStoredBlocks(BitWriter& writer, std::span<const std::uint8_t> raw, bool final)
+{
+	do
+	{
+		const auto size = std::min(raw.size(), Deflater::MaxStoredSize);
+		const bool last = size == raw.size();
+
+		writer.writeBits(final && last, 1);
+		writer.writeBits(0, 2);
+		writer.alignToByte();
+		writer.writeBits(std::uint32_t(size), 16);
+		writer.writeBits(std::uint32_t(~size & 0xFFFF), 16);
+		writer.writeBytes(raw.first(size));
+
+		raw = raw.subspan(size);
+	}
+	while (!raw.empty());
+}
+
+// The code lengths of a dynamic block, as they appear in its header
+struct DynamicHeader
+{
+	static constexpr std::array<std::uint8_t, 19> codeLengthExtraBits{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7 };
+
+	std::size_t literalCount{};
+	std::size_t distanceCount{};
+	std::size_t codeLengthCount{};
+
+	// Code length symbols, with the repeat count extra bits in the high byte
+	std::vector<std::uint16_t> lengthCodes;
+	std::array<std::uint32_t, 19> codeLengthFrequencies{};
+	std::array<std::uint8_t, 19> codeLengthLengths{};
+
+	// Trailing unused codes are left out, and runs are coded with symbols 16 to 18
+	DynamicHeader(std::span<const std::uint8_t> literalLengths, std::span<const std::uint8_t> distanceLengths)
+	{
+		literalCount = literalLengths.size();
+		while (literalCount > 257 && literalLengths[literalCount - 1] == 0)
+		{
+			literalCount--;
+		}
+
+		distanceCount = distanceLengths.size();
+		while (distanceCount > 1 && distanceLengths[distanceCount - 1] == 0)
+		{
+			distanceCount--;
+		}
+
+		// Runs may go from one alphabet to the other
+		std::array<std::uint8_t, Alphabet::LiteralCount + Alphabet::DistanceCount> allLengths{};
+		std::copy_n(literalLengths.begin(), literalCount, allLengths.begin());
+		std::copy_n(distanceLengths.begin(), distanceCount, allLengths.begin() + literalCount);
+		const auto lengthCount = literalCount + distanceCount;
+
+		for (std::size_t x = 0; x < lengthCount;)
+		{
+			const auto length = allLengths[x];
+
+			std::size_t run = 1;
+			while (x + run < lengthCount && allLengths[x + run] == length)
+			{
+				run++;
+			}
+
+			x += run;
+
+			if (length == 0)
+			{
+				while (run >= 11)
+				{
+					const auto count = std::min<std::size_t>(run, 138);
+					lengthCodes.push_back(18 | ((count - 11) << 8));
+					run -= count;
+				}
+
+				if (run >= 3)
+				{
+					lengthCodes.push_back(17 | ((run - 3) << 8));
+					run = 0;
+				}
+			}
+			else
+			{
+				lengthCodes.push_back(length);
+				run--;
+
+				while (run >= 3)
+				{
+					const auto count = std::min<std::size_t>(run, 6);
+					lengthCodes.push_back(16 | ((count - 3) << 8));
+					run -= count;
+				}
+			}
+
+			lengthCodes.insert(lengthCodes.end(), run, length);
+		}
+
+		for (const auto code : lengthCodes)
+		{
+			codeLengthFrequencies[code & 0xFF]++;
+		}
+
+		buildCodeLengths(codeLengthFrequencies, 7, codeLengthLengths);
+
+		codeLengthCount = 19;
+		while (codeLengthCount > 4 && codeLengthLengths[Alphabet::CodeLengthOrder[codeLengthCount - 1]] == 0)
+		{
+			codeLengthCount--;
+		}
+	}
+
+	// Size of the header, BFINAL and BTYPE included
+	std::size_t bits() const
+	{
+		std::size_t size = 3 + 5 + 5 + 4 + 3 * codeLengthCount;
+		for (std::size_t x = 0; x < 19; x++)
+		{
+			size += std::size_t(codeLengthFrequencies[x]) * (codeLengthLengths[x] + codeLengthExtraBits[x]);
+		}
+
+		return size;
+	}
+
+	void write(BitWriter& writer, bool final) const
+	{
+		writer.writeBits(final, 1);
+		writer.writeBits(2, 2);
+		writer.writeBits(std::uint32_t(literalCount - 257), 5);
+		writer.writeBits(std::uint32_t(distanceCount - 1), 5);
+		writer.writeBits(std::uint32_t(codeLengthCount - 4), 4);
+
+		for (std::size_t x = 0; x < codeLengthCount; x++)
+		{
+			writer.writeBits(codeLengthLengths[Alphabet::CodeLengthOrder[x]], 3);
+		}
+
+		std::array<std::uint16_t, 19> codeLengthCodes{};
+		buildCodes(codeLengthLengths, codeLengthCodes);
+
+		for (const auto code : lengthCodes)
+		{
+			const auto symbol = code & 0xFF;
+			writer.writeBits(codeLengthCodes[symbol], codeLengthLengths[symbol]);
+			writer.writeBits(code >> 8, codeLengthExtraBits[symbol]);
+		}
+	}
+};
+
+// Symbol counts of a block, end of block included, and the extra bits its matches need
+struct BlockFrequencies
+{
+	std::array<std::uint32_t, Alphabet::LiteralCount> literals{};
+	std::array<std::uint32_t, Alphabet::DistanceCount> distances{};
+	std::size_t extraBits{};
+
+	explicit BlockFrequencies(std::span<const Symbol> symbols)
+	{
+		for (const auto symbol : symbols)
+		{
+			if (symbol.distance == 0)
+			{
+				literals[symbol.literalLength]++;
+			}
+			else
+			{
+				const auto lengthSymbol = Alphabet::LengthSymbols[symbol.literalLength];
+				const auto distanceSymbol = Alphabet::distanceSymbol(symbol.distance);
+
+				literals[Alphabet::LengthOffest + lengthSymbol]++;
+				distances[distanceSymbol]++;
+				extraBits += Alphabet::Length[lengthSymbol].extraBits + Alphabet::Distance[distanceSymbol].extraBits;
+			}
+		}
+
+		literals[Alphabet::EndOfBlock]++;
+	}
+};
+
+// Size of symbols coded as a dynamic block, header included
+std::size_t dynamicBlockBits(std::span<const Symbol> symbols)
+{
+	const BlockFrequencies frequencies(symbols);
+
+	std::array<std::uint8_t, Alphabet::LiteralCount> literalLengths{};
+	std::array<std::uint8_t, Alphabet::DistanceCount> distanceLengths{};
+	buildCodeLengths(frequencies.literals, MaxCodeLength, literalLengths);
+	buildCodeLengths(frequencies.distances, MaxCodeLength, distanceLengths);
+
+	std::size_t bits = DynamicHeader(literalLengths, distanceLengths).bits() + frequencies.extraBits;
+
+	for (std::size_t x = 0; x < Alphabet::LiteralCount; x++)
+	{
+		bits += std::size_t(frequencies.literals[x]) * literalLengths[x];
+	}
+
+	for (std::size_t x = 0; x < Alphabet::DistanceCount; x++)
+	{
+		bits += std::size_t(frequencies.distances[x]) * distanceLengths[x];
+	}
+
+	return bits;
+}
+
+void Deflater::writeBlock(BitWriter& writer, std::span<const std::uint8_t> raw, bool final)
+{
+	const BlockFrequencies frequencies(symbols);
+	const auto& literalFrequencies = frequencies.literals;
+	const auto& distanceFrequencies = frequencies.distances;
+
+	std::array<std::uint8_t, Alphabet::LiteralCount> literalLengths{};
+	std::array<std::uint8_t, Alphabet::DistanceCount> distanceLengths{};
+	buildCodeLengths(literalFrequencies, MaxCodeLength, literalLengths);
+	buildCodeLengths(distanceFrequencies, MaxCodeLength, distanceLengths);
+
+	const DynamicHeader header(literalLengths, distanceLengths);
+
+	std::size_t dynamicBits = header.bits() + frequencies.extraBits;
+	std::size_t fixedBits = 3 + frequencies.extraBits;
+
+	for (std::size_t x = 0; x < Alphabet::LiteralCount; x++)
+	{
+		dynamicBits += std::size_t(literalFrequencies[x]) * literalLengths[x];
+		fixedBits += std::size_t(literalFrequencies[x]) * fixedCodes.literalLengths[x];
+	}
+
+	for (std::size_t x = 0; x < Alphabet::DistanceCount; x++)
+	{
+		dynamicBits += std::size_t(distanceFrequencies[x]) * distanceLengths[x];
+		fixedBits += std::size_t(distanceFrequencies[x]) * fixedCodes.distanceLengths[x];
+	}
+
+	const auto storedBlockCount = std::max<std::size_t>(1, (raw.size() + MaxStoredSize - 1) / MaxStoredSize);
+	const auto storedBits = (raw.size() + 5 * storedBlockCount) * 8 + 7;
+
+	if (storedBits <= std::min(dynamicBits, fixedBits))
+	{
+		writeStoredBlocks(writer, raw, final);
+		return;
+	}
+
+	const auto writeSymbols = [&](std::span<const std::uint8_t> literalLengths, std::span<const std::uint16_t> literalCodes,
+		std::span<const std::uint8_t> distanceLengths, std::span<const std::uint16_t> distanceCodes)
+	{
+		for (const auto symbol : symbols)
+		{
+			if (symbol.distance == 0)
+			{
+				writer.writeBits(literalCodes[symbol.literalLength], literalLengths[symbol.literalLength]);
+				continue;
+			}
+
+			const auto lengthSymbol = Alphabet::LengthSymbols[symbol.literalLength];
+			const auto lengthEntry = Alphabet::Length[lengthSymbol];
+			const auto literal = Alphabet::LengthOffest + lengthSymbol;
+
+			writer.writeBits(literalCodes[literal], literalLengths[literal]);
+			writer.writeBits(symbol.literalLength - lengthEntry.baseLength, lengthEntry.extraBits);
+
+			const auto distanceSymbol = Alphabet::distanceSymbol(symbol.distance);
+			const auto distanceEntry = Alphabet::Distance[distanceSymbol];
+
+			writer.writeBits(distanceCodes[distanceSymbol], distanceLengths[distanceSymbol]);
+			writer.writeBits(symbol.distance - distanceEntry.baseLength, distanceEntry.extraBits);
+		}
+
+		writer.writeBits(literalCodes[Alphabet::EndOfBlock], literalLengths[Alphabet::EndOfBlock]);
+	};
+
+	if (fixedBits <= dynamicBits)
+	{
+		writer.writeBits(final, 1);
+		writer.writeBits(1, 2);
+		writeSymbols(fixedCodes.literalLengths, fixedCodes.literalCodes, fixedCodes.distanceLengths, fixedCodes.distanceCodes);
+		return;
+	}
+
+	header.write(writer, final);
+
+	std::array<std::uint16_t, Alphabet::LiteralCount> literalCodes{};
+	std::array<std::uint16_t, Alphabet::DistanceCount> distanceCodes{};
+	buildCodes(literalLengths, literalCodes);
+	buildCodes(distanceLengths, distanceCodes);
+
+	writeSymbols(literalLengths, literalCodes, distanceLengths, distanceCodes);
+}
+
+void Deflater::compressWith(BitWriter& writer, std::span<const std::uint8_t> data, std::size_t start, int level, bool final)
+{
+	const auto& config = levelConfigs[level];
+	const auto size = data.size();
+	const auto* bytes = data.data();
+
+	head.assign(std::size_t(1) << HashBits, 0);
+	previous.assign(WindowSize, 0);
+	symbols.clear();
+	symbols.reserve(BlockSymbols);
+
+	// Returns the previous head of the chain pos joins
+	const auto insert = [&](std::size_t pos)
+	{
+		const std::uint32_t prefix = bytes[pos] | (bytes[pos + 1] << 8) | (bytes[pos + 2] << 16);
+		const auto hash = (prefix * 2654435761u) >> (32 - HashBits);
+
+		const auto chainHead = head[hash];
+		previous[pos & (WindowSize - 1)] = chainHead;
+		head[hash] = std::uint32_t(pos + 1);
+
+		return chainHead;
+	};
+
+	const auto load16 = [](const std::uint8_t* p)
+	{
+		std::uint16_t value;
+		std::memcpy(&value, p, sizeof(value));
+		return value;
+	};
+
+	// Longest match at pos that is longer than minLength, 0 if there is none
+	const auto findMatch = [&](std::size_t pos, std::uint32_t candidate, std::size_t minLength, std::size_t& distance)
+	{
+		const auto maxLength = std::min(MaxMatch, size - pos);
+		const auto limit = pos >= WindowSize ? pos - WindowSize + 1 : 0;
+
+		auto chainLength = minLength >= config.goodLength ? config.chainLength / 4u : config.chainLength;
+		auto bestLength = std::max(minLength, MinMatch - 1);
+		std::size_t foundLength{};
+
+		for (; candidate > limit && chainLength > 0 && bestLength < maxLength; chainLength--)
+		{
+			const auto match = candidate - 1;
+
+			// Only a match ending past the best one and starting like it can be longer
+			if (load16(bytes + match + bestLength - 1) == load16(bytes + pos + bestLength - 1) && load16(bytes + match) == load16(bytes + pos))
+			{
+				const auto length = matchLength(bytes + match, bytes + pos, maxLength);
+				if (length > bestLength)
+				{
+					bestLength = length;
+					foundLength = length;
+					distance = pos - match;
+
+					if (length >= config.niceLength)
+					{
+						break;
+					}
+				}
+			}
+
+			const auto next = previous[match & (WindowSize - 1)];
+			if (next >= candidate)
+			{
+				break;
+			}
+
+			candidate = next;
+		}
+
+		return foundLength;
+	};
+
+	std::size_t blockStart = start;
+	std::size_t covered = start;
+
+	const auto flushBlock = [&](bool finalBlock)
+	{
+		writeBlock(writer, data.subspan(blockStart, covered - blockStart), finalBlock);
+		blockStart = covered;
+		symbols.clear();
+	};
+
+	const auto emitLiteral = [&](std::uint8_t literal)
+	{
+		symbols.push_back({ literal, 0 });
+		covered++;
+
+		if (symbols.size() >= BlockSymbols)
+		{
+			flushBlock(false);
+		}
+	};
+
+	const auto emitMatch = [&](std::size_t length, std::size_t distance)
+	{
+		symbols.push_back({ std::uint16_t(length), std::uint16_t(distance) });
+		covered += length;
+
+		if (symbols.size() >= BlockSymbols)
+		{
+			flushBlock(false);
+		}
+	};
+
+	for (auto pos = start - std::min(start, WindowSize); pos < start && pos + MinMatch <= size; pos++)
+	{
+		insert(pos);
+	}
+
+	std::size_t pos = start;
+
+	if (!config.lazy)
+	{
+		while (pos < size)
+		{
+			std::size_t length{};
+			std::size_t distance{};
+
+			if (pos + MinMatch <= size)
+			{
+				length = findMatch(pos, insert(pos), 0, distance);
+			}
+
+			if (length == 0)
+			{
+				emitLiteral(bytes[pos++]);
+				continue;
+			}
+
+			emitMatch(length, distance);
+
+			// Long matches are skipped over without indexing them, which is most of the speed of low levels
+			if (length <= config.lazyLength)
+			{
+				for (auto end = pos + length, x = pos + 1; x < end && x + MinMatch <= size; x++)
+				{
+					insert(x);
+				}
+			}
+
+			pos += length;
+		}
+	}
+	else
+	{
+		// A match is only taken once the next position has no longer one, otherwise its first byte becomes a literal
+		std::size_t previousLength = MinMatch - 1;
+		std::size_t previousDistance{};
+		bool pending = false;
+
+		while (pos < size)
+		{
+			std::size_t length = MinMatch - 1;
+			std::size_t distance{};
+
+			if (pos + MinMatch <= size)
+			{
+				const auto chainHead = insert(pos);
+				if (previousLength < config.lazyLength)
+				{
+					length = std::max(findMatch(pos, chainHead, previousLength, distance), MinMatch - 1);
+
+					// Short far matches cost more than their literals
+					if (length == MinMatch && distance > 4096)
+					{
+						length = MinMatch - 1;
+					}
+				}
+			}
+
+			if (previousLength >= MinMatch && length <= previousLength)
+			{
+				emitMatch(previousLength, previousDistance);
+
+				const auto end = pos - 1 + previousLength;
+				for (auto x = pos + 1; x < end && x + MinMatch <= size; x++)
+				{
+					insert(x);
+				}
+
+				pos = end;
+				pending = false;
+				previousLength = MinMatch - 1;
+			}
+			else
+			{
+				if (pending)
+				{
+					emitLiteral(bytes[pos - 1]);
+				}
+
+				pending = true;
+				previousLength = length;
+				previousDistance = distance;
+				pos++;
+			}
+		}
+
+		if (pending && previousLength >= MinMatch)
+		{
+			emitMatch(previousLength, previousDistance);
+		}
+		else if (pending)
+		{
+			emitLiteral(bytes[pos - 1]);
+		}
+	}
+
+	if (final || !symbols.empty())
+	{
+		flushBlock(final);
+	}
+}
+
+CPU_KERNEL_VARIANTS(void, compress, deflater.compressWith, (Deflater& deflater, BitWriter& writer, std::span<const std::uint8_t> data, std::size_t start, int level, bool final), (writer, data, start, level, final))
+
+void Deflater::compress(BitWriter& writer, std::span<const std::uint8_t> data, std::size_t start, int level, bool final)
+{
+	level = std::clamp(level, 0, OptimalLevel);
+
+	if (level == 0)
+	{
+		if (final || start < data.size())
+		{
+			writeStoredBlocks(writer, data.subspan(start), final);
+		}
+	}
+	else if (level == OptimalLevel)
+	{
+		compressOptimal(writer, data, start, final);
+	}
+	else
+	{
+		CPU_DISPATCH_VARIANTS(compress)(*this, writer, data, start, level, final);
+	}
+
+	if (!final)
+	{
+		writeStoredBlocks(writer, {}, false);
+	}
+}
+
+// Matches found for a range of positions. The matches of a position come by increasing length and distance,
+// so the shortest distance for a length is that of the first match at least as long
+struct MatchCache
+{
+	std::size_t begin{};
+	std::vector<std::uint32_t> offsets;
+	std::vector<Symbol> matches;
+
+	std::span<const Symbol> at(std::size_t pos) const
+	{
+		return std::span(matches).subspan(offsets[pos - begin], offsets[pos - begin + 1] - offsets[pos - begin]);
+	}
+};
+
+void Deflater::findMatches(std::span<const std::uint8_t> data, std::size_t begin, std::size_t end, MatchCache& cache)
+{
+	const auto* bytes = data.data();
+
+	cache.begin = begin;
+	cache.offsets.clear();
+	cache.matches.clear();
+
+	for (auto pos = begin; pos < end; pos++)
+	{
+		cache.offsets.push_back(std::uint32_t(cache.matches.size()));
+
+		if (pos + MinMatch > data.size())
+		{
+			continue;
+		}
+
+		const std::uint32_t prefix = bytes[pos] | (bytes[pos + 1] << 8) | (bytes[pos + 2] << 16);
+		const auto hash = (prefix * 2654435761u) >> (32 - HashBits);
+
+		auto candidate = head[hash];
+		previous[pos & (WindowSize - 1)] = candidate;
+		head[hash] = std::uint32_t(pos + 1);
+
+		const auto maxLength = std::min(MaxMatch, end - pos);
+		if (maxLength < MinMatch)
+		{
+			continue;
+		}
+
+		const auto limit = pos >= WindowSize ? pos - WindowSize + 1 : 0;
+		auto bestLength = MinMatch - 1;
+
+		for (auto chainLength = OptimalChainLength; candidate > limit && chainLength > 0 && bestLength < maxLength; chainLength--)
+		{
+			const auto match = candidate - 1;
+
+			if (bytes[match + bestLength] == bytes[pos + bestLength])
+			{
+				if (const auto length = matchLength(bytes + match, bytes + pos, maxLength); length > bestLength)
+				{
+					bestLength = length;
+					cache.matches.push_back({ std::uint16_t(length), std::uint16_t(pos - match) });
+				}
+			}
+
+			const auto next = previous[match & (WindowSize - 1)];
+			if (next >= candidate)
+			{
+				break;
+			}
+
+			candidate = next;
+		}
+	}
+
+	cache.offsets.push_back(std::uint32_t(cache.matches.size()));
+}
+
+// Price in bits of every literal, match length and distance under some code, extra bits included
+struct SymbolCosts
+{
+	std::array<float, 256> literals{};
+	std::array<float, Deflater::MaxMatch + 1> lengths{};
+	std::array<float, Alphabet::DistanceCount> distances{};
+
+	static SymbolCosts fromLengths(std::span<const std::uint8_t> literalLengths, std::span<const std::uint8_t> distanceLengths)
+	{
+		SymbolCosts costs;
+		for (std::size_t literal = 0; literal < 256; literal++)
+		{
+			costs.literals[literal] = literalLengths[literal];
+		}
+
+		for (std::size_t length = Deflater::MinMatch; length <= Deflater::MaxMatch; length++)
+		{
+			const auto symbol = Alphabet::LengthSymbols[length];
+			costs.lengths[length] = float(literalLengths[Alphabet::LengthOffest + symbol] + Alphabet::Length[symbol].extraBits);
+		}
+
+		for (std::size_t symbol = 0; symbol < Alphabet::DistanceCount; symbol++)
+		{
+			costs.distances[symbol] = float(distanceLengths[symbol] + Alphabet::Distance[symbol].extraBits);
+		}
+
+		return costs;
+	}
+
+	// Entropy of each symbol in symbols, unused ones priced as slightly rarer than the rarest
+	static SymbolCosts fromSymbols(std::span<const Symbol> symbols)
+	{
+		const BlockFrequencies frequencies(symbols);
+
+		const auto entropies = [](std::span<const std::uint32_t> counts, std::span<float> bits)
+		{
+			std::uint64_t total{};
+			for (auto count : counts)
+			{
+				total += count;
+			}
+
+			const auto totalBits = std::log2(float(std::max<std::uint64_t>(total, 1)));
+			for (std::size_t x = 0; x < counts.size(); x++)
+			{
+				bits[x] = counts[x] ? totalBits - std::log2(float(counts[x])) : totalBits + 1;
+			}
+		};
+
+		std::array<float, Alphabet::LiteralCount> literalBits{};
+		std::array<float, Alphabet::DistanceCount> distanceBits{};
+		entropies(frequencies.literals, literalBits);
+		entropies(frequencies.distances, distanceBits);
+
+		SymbolCosts costs;
+		std::copy_n(literalBits.begin(), 256, costs.literals.begin());
+
+		for (std::size_t length = Deflater::MinMatch; length <= Deflater::MaxMatch; length++)
+		{
+			const auto symbol = Alphabet::LengthSymbols[length];
+			costs.lengths[length] = literalBits[Alphabet::LengthOffest + symbol] + Alphabet::Length[symbol].extraBits;
+		}
+
+		for (std::size_t symbol = 0; symbol < Alphabet::DistanceCount; symbol++)
+		{
+			costs.distances[symbol] = distanceBits[symbol] + Alphabet::Distance[symbol].extraBits;
+		}
+
+		return costs;
+	}
+};
+
+// Cheapest symbols for data[begin, end) under costs, by shortest path over every literal and cached match.
+// cost and step are scratch space
+void optimalParseKernel(std::span<const std::uint8_t> data, std::size_t begin, std::size_t end, const MatchCache& cache, const SymbolCosts& costs,
+	std::vector<Symbol>& symbols, std::vector<float>& cost, std::vector<Symbol>& step)
+{
+	const auto size = end - begin;
+
+	cost.assign(size + 1, std::numeric_limits<float>::infinity());
+	step.resize(size + 1);
+	cost[0] = 0;
+
+	for (std::size_t x = 0; x < size; x++)
+	{
+		const auto pos = begin + x;
+		const auto here = cost[x];
+
+		if (const auto literal = here + costs.literals[data[pos]]; literal < cost[x + 1])
+		{
+			cost[x + 1] = literal;
+			step[x + 1] = { data[pos], 0 };
+		}
+
+		const auto maxLength = std::min(Deflater::MaxMatch, end - pos);
+		auto length = Deflater::MinMatch;
+
+		for (const auto match : cache.at(pos))
+		{
+			const auto matchCost = here + costs.distances[Alphabet::distanceSymbol(match.distance)];
+			const auto longest = std::min<std::size_t>(match.literalLength, maxLength);
+
+			for (; length <= longest; length++)
+			{
+				if (const auto total = matchCost + costs.lengths[length]; total < cost[x + length])
+				{
+					cost[x + length] = total;
+					step[x + length] = { std::uint16_t(length), match.distance };
+				}
+			}
+		}
+	}
+
+	symbols.clear();
+	for (auto x = size; x > 0; )
+	{
+		const auto symbol = step[x];
+		symbols.push_back(symbol);
+		x -= symbol.distance ? symbol.literalLength : 1;
+	}
+
+	std::reverse(symbols.begin(), symbols.end());
+}
+
+CPU_DISPATCHED_KERNEL(void, optimalParse, optimalParseKernel, (std::span<const std::uint8_t> data, std::size_t begin, std::size_t end, const MatchCache& cache, const SymbolCosts& costs,
+	std::vector<Symbol>& symbols, std::vector<float>& cost, std::vector<Symbol>& step), (data, begin, end, cache, costs, symbols, cost, step))
+
+// Symbol indices where blocks of symbols start, splitting wherever coding both sides apart as dynamic blocks
+// is smaller. Each range is searched for its best split point coarse to fine, the candidates of a round
+// priced in parallel
+std::vector<std::size_t> splitBlocks(std::span<const Symbol> symbols, std::size_t maxBlocks, unsigned threadCount)
+{
+	constexpr std::size_t MinBlockSymbols = 512;
+	constexpr std::size_t Candidates = 9;
+
+	const auto blockBits = [&](std::size_t begin, std::size_t end)
+	{
+		return dynamicBlockBits(symbols.subspan(begin, end - begin));
+	};
+
+	std::vector<std::size_t> starts{ 0 };
+	std::vector<std::pair<std::size_t, std::size_t>> ranges{ { 0, symbols.size() } };
+
+	while (!ranges.empty() && starts.size() < maxBlocks)
+	{
+		const auto [begin, end] = ranges.back();
+		ranges.pop_back();
+
+		if (end - begin < 2 * MinBlockSymbols)
+		{
+			continue;
+		}
+
+		auto low = begin + MinBlockSymbols;
+		auto high = end - MinBlockSymbols;
+		std::size_t bestSplit{};
+		auto bestBits = std::numeric_limits<std::size_t>::max();
+
+		while (true)
+		{
+			const auto step = std::max<std::size_t>(1, (high - low) / (Candidates - 1));
+
+			std::vector<std::size_t> points;
+			for (auto point = low; point <= high; point += step)
+			{
+				points.push_back(point);
+			}
+
+			std::vector<std::size_t> bits(points.size());
+			parallel::forEach(points.size(), threadCount, [&](std::size_t index, unsigned)
+			{
+				bits[index] = blockBits(begin, points[index]) + blockBits(points[index], end);
+			});
+
+			const auto best = std::size_t(std::ranges::min_element(bits) - bits.begin());
+			if (bits[best] < bestBits)
+			{
+				bestBits = bits[best];
+				bestSplit = points[best];
+			}
+
+			if (step == 1)
+			{
+				break;
+			}
+
+			// Zoom in around the best point
+			low = points[best] - std::min(points[best] - low, step);
+			high = std::min(high, points[best] + step);
+		}
+
+		if (bestBits < blockBits(begin, end))
+		{
+			starts.push_back(bestSplit);
+			ranges.push_back({ begin, bestSplit });
+			ranges.push_back({ bestSplit, end });
+		}
+	}
+
+	std::ranges::sort(starts);
+
+	return starts;
+}
+
+void Deflater::compressOptimal(BitWriter& writer, std::span<const std::uint8_t> data, std::size_t start, bool final)
+{
+	constexpr std::size_t MaxBlocks = 15;
+
+	if (!final && start == data.size())
+	{
+		return;
+	}
+
+	head.assign(std::size_t(1) << HashBits, 0);
+	previous.assign(WindowSize, 0);
+
+	// Only the history is indexed up front, findMatches indexes each segment as it goes
+	for (auto pos = start - std::min(start, WindowSize); pos < start && pos + MinMatch <= data.size(); pos++)
+	{
+		const std::uint32_t prefix = data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16);
+		const auto hash = (prefix * 2654435761u) >> (32 - HashBits);
+
+		previous[pos & (WindowSize - 1)] = head[hash];
+		head[hash] = std::uint32_t(pos + 1);
+	}
+
+	MatchCache cache;
+	std::vector<float> cost;
+	std::vector<Symbol> step;
+
+	auto segmentBegin = start;
+	do
+	{
+		const auto segmentEnd = std::min(data.size(), segmentBegin + OptimalSegmentSize);
+		const bool lastSegment = segmentEnd == data.size();
+
+		findMatches(data, segmentBegin, segmentEnd, cache);
+
+		// Two passes over the whole segment, first with the fixed code then with its own statistics,
+		// give symbols representative enough to split blocks on
+		std::vector<Symbol> segmentSymbols;
+		optimalParse(data, segmentBegin, segmentEnd, cache, SymbolCosts::fromLengths(fixedCodes.literalLengths, fixedCodes.distanceLengths), segmentSymbols, cost, step);
+		optimalParse(data, segmentBegin, segmentEnd, cache, SymbolCosts::fromSymbols(segmentSymbols), segmentSymbols, cost, step);
+
+		const auto blockStarts = splitBlocks(segmentSymbols, MaxBlocks, threadCount);
+
+		// Byte range of each block
+		std::vector<std::size_t> boundaries;
+		auto pos = segmentBegin;
+		for (std::size_t symbol = 0, block = 0; symbol <= segmentSymbols.size(); symbol++)
+		{
+			if (block < blockStarts.size() && blockStarts[block] == symbol)
+			{
+				boundaries.push_back(pos);
+				block++;
+			}
+
+			if (symbol < segmentSymbols.size())
+			{
+				pos += segmentSymbols[symbol].distance ? segmentSymbols[symbol].literalLength : 1;
+			}
+		}
+
+		boundaries.push_back(segmentEnd);
+
+		// Blocks are refined independently, each from the statistics the segment parse gave it
+		std::vector<std::vector<Symbol>> blockSymbols(blockStarts.size());
+		parallel::forEach(blockStarts.size(), threadCount, [&](std::size_t block, unsigned)
+		{
+			const auto firstSymbol = blockStarts[block];
+			const auto lastSymbol = block + 1 < blockStarts.size() ? blockStarts[block + 1] : segmentSymbols.size();
+
+			auto& best = blockSymbols[block];
+			best.assign(segmentSymbols.begin() + firstSymbol, segmentSymbols.begin() + lastSymbol);
+			auto bestBits = dynamicBlockBits(best);
+
+			std::vector<Symbol> candidate;
+			std::vector<float> blockCost;
+			std::vector<Symbol> blockStep;
+
+			auto costs = SymbolCosts::fromSymbols(best);
+			for (int iteration = 0; iteration < OptimalIterations; iteration++)
+			{
+				optimalParse(data, boundaries[block], boundaries[block + 1], cache, costs, candidate, blockCost, blockStep);
+				costs = SymbolCosts::fromSymbols(candidate);
+
+				if (const auto bits = dynamicBlockBits(candidate); bits < bestBits)
+				{
+					bestBits = bits;
+					best = candidate;
+				}
+			}
+		});
+
+		for (std::size_t block = 0; block < blockSymbols.size(); block++)
+		{
+			symbols = std::move(blockSymbols[block]);
+
+			const bool lastBlock = lastSegment && block + 1 == blockSymbols.size();
+			writeBlock(writer, data.subspan(boundaries[block], boundaries[block + 1] - boundaries[block]), final && lastBlock);
+		}
+
+		segmentBegin = segmentEnd;
+	}
+	while (segmentBegin < data.size());
+
+	symbols.clear();
+}
+
+// 32KiB window, FLEVEL as zlib sets it for level, FCHECK making the header a multiple of 31
+std::array<std::uint8_t, 2> zlibHeader(int level)
+{
+	const std::uint8_t CMF = 0x78;
+	const std::uint8_t FLEVEL = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+	const std::uint8_t FLG = FLEVEL << 6;
+	const std::uint8_t FCHECK = (31 - (CMF << 8 | FLG) % 31) % 31;
+
+	return { CMF, std::uint8_t(FLG | FCHECK) };
+}
+
+std::array<std::uint8_t, 4> zlibTrailer(std::uint32_t adler)
+{
+	return { std::uint8_t(adler >> 24), std::uint8_t(adler >> 16), std::uint8_t(adler >> 8), std::uint8_t(adler) };
+}
+
+std::vector<std::uint8_t> Deflater::deflate(std::span<const std::uint8_t> input, int level, Format format)
+{
+	level = std::clamp(level, 0, OptimalLevel);
+
+	BitWriter writer;
+	writer.data.reserve(level == 0 ? input.size() + input.size() / MaxStoredSize * 5 + 32 : input.size() / 2 + 64);
+
+	if (format == Format::Zlib)
+	{
+		writer.writeBytes(zlibHeader(level));
+	}
+	else if (format == Format::Gzip)
+	{
+		// No name or time, XFL telling the slowest and fastest levels apart, unknown OS
+		const std::uint8_t XFL = level >= 9 ? 2 : level == 1 ? 4 : 0;
+		writer.writeBytes(std::array<std::uint8_t, 10>{ 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, XFL, 255 });
+	}
+
+	// Match positions are 32 bits, larger input goes through in pieces sharing their history
+	constexpr std::size_t PieceSize = std::size_t(1) << 30;
+
+	std::size_t begin{};
+	do
+	{
+		const auto end = std::min(input.size(), begin + PieceSize);
+		const auto history = std::min(begin, WindowSize);
+
+		compress(writer, input.subspan(begin - history, end - begin + history), history, level, end == input.size());
+		begin = end;
+	}
+	while (begin < input.size());
+
+	writer.alignToByte();
+
+	if (format == Format::Zlib)
+	{
+		writer.writeBytes(zlibTrailer(adler32(input)));
+	}
+	else if (format == Format::Gzip)
+	{
+		const auto crc = crc32(input);
+		const auto size = std::uint32_t(input.size());
+		writer.writeBytes(std::array<std::uint8_t, 8>{ std::uint8_t(crc), std::uint8_t(crc >> 8), std::uint8_t(crc >> 16), std::uint8_t(crc >> 24),
+			std::uint8_t(size), std::uint8_t(size >> 8), std::uint8_t(size >> 16), std::uint8_t(size >> 24) });
+	}
+
+	return std::move(writer.data);
+}
+
+std::vector<std::uint8_t> deflate(std::span<const std::uint8_t> input, int level = 6, Format format = Format::Zlib)
+{
+	Deflater deflater;
+	return deflater.deflate(input, level, format);
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+namespace parallel
+{
+
+inline unsigned defaultThreadCount()
+{
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls function(index, worker) once for every index in [0, count), handing indices out in order to
+// up to threadCount threads, 0 meaning one per hardware thread. worker is below the number of threads
+// used and identifies the calling thread, so per thread state can be kept in a vector of that size.
+// The first exception thrown is rethrown once every thread stopped
+template<typename F>
+void forEach(std::size_t count, unsigned threadCount, F&& function)
+{
+	if (threadCount == 0)
+	{
+		threadCount = defaultThreadCount();
+	}
+
+	const auto workerCount = unsigned(std::min<std::size_t>(threadCount, count));
+	if (workerCount <= 1)
+	{
+		for (std::size_t index = 0; index < count; index++)
+		{
+			function(index, 0u);
+		}
+
+		return;
+	}
+
+	std::atomic<std::size_t> nextIndex{};
+	std::exception_ptr error;
+	std::mutex errorMutex;
+
+	const auto work = [&](unsigned worker)
+	{
+		try
+		{
+			for (auto index = nextIndex++; index < count; index = nextIndex++)
+			{
+				function(index, worker);
+			}
+		}
+		catch (...)
+		{
+			// Stops the other threads at their next index
+			nextIndex = count;
+
+			std::lock_guard lock(errorMutex);
+			if (!error)
+			{
+				error = std::current_exception();
+			}
+		}
+	};
+
+	{
+		std::vector<std::jthread> threads;
+		for (unsigned worker = 1; worker < workerCount; worker++)
+		{
+			threads.emplace_back(work, worker);
+		}
+
+		work(0);
+	}
+
+	if (error)
+	{
+		std::rethrow_exception(error);
+	}
+}
+
+// Number of threads forEach uses for count indices
+inline unsigned workerCount(std::size_t count, unsigned threadCount)
+{
+	return unsigned(std::clamp<std::size_t>(count, 1, threadCount == 0 ? defaultThreadCount() : threadCount));
+}
+
+}
@@ -1,4 +1,8 @@
+#pragma once
+
+#include "cpu.hpp"
 #include "deflate.hpp"
+#include "parallel.hpp"
 
 #include <string>
 #include <string_view>
@@ -8,8 +12,12 @@
 #include <bit>
 #include <spanstream>
 #include <optional>
+#include <functional>
+#include <cmath>
+#include <mutex>
 #include <print>
 #include <iostream>
+#include <chrono>
 
 namespace png
 {
@@ -48,6 +56,8 @@ std::vector<std::uint8_t> readDynamicBytes(std::istream& stream, int32_t count)
 	return bytes;
 }
 
+static constexpr std::array<std::uint8_t, 8> pngSignature{0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+
 struct PngChunkType
 {
 	std::array<std::uint8_t, 4> bytes;
@@ -170,44 +180,256 @@ struct Image
 	std::vector<std::uint8_t> data;
 };
 
-std::optional<Image> readPng(std::istream& stream)
+// Steps of decoding a PNG, in the order readPng runs them. Unfilter and Unpack alternate per pass when interlaced
+enum class Stage : std::uint8_t
 {
-	constexpr static std::array<std::uint8_t, 8> pngSignature{0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+	Chunks,			// Reading the chunks and the header
+	Gather,			// Joining the IDAT chunks into one zlib stream
+	Inflate,
+	Unfilter,
+	Unpack,			// Spreading pixels of passes and low bit depths into bytes, dropping the low byte of 16 bit channels
+	Expand,			// Palette lookup or channel expansion to RGBA
+	Transparency,	// tRNS colour keys
+	Count
+};
 
-	const auto fileSignature = readStaticBytes<8>(stream);
+constexpr std::array<std::string_view, std::size_t(Stage::Count)> stageNames{ "chunks", "gather", "inflate", "unfilter", "unpack", "expand", "tRNS" };
 
-	if (fileSignature != pngSignature)
+// Time spent in each stage, summed over every decode given the same StageTimes
+struct StageTimes
+{
+	std::array<std::chrono::nanoseconds, std::size_t(Stage::Count)> durations{};
+
+	std::chrono::nanoseconds& operator[](Stage stage)
 	{
-		std::cerr << "Incorrect file header" << std::endl;
-		return std::nullopt;
+		return durations[std::size_t(stage)];
 	}
+};
 
-	std::vector<PngChunk> chunks;
+// What readPng reports to an observer, each event through the member function named with it when the observer
+// has one, as with deflate::NoObserver. Times come from std::chrono::steady_clock
 
-	while (stream)
+// chunkParsed, for every chunk read
+struct ChunkEvent
+{
+	std::chrono::steady_clock::time_point time;
+	PngChunkType type;
+	std::uint32_t length{};
+};
+
+// imageDataGathered, once the IDAT chunks form a single zlib stream
+struct ImageDataEvent
+{
+	std::chrono::steady_clock::time_point time;
+	std::size_t chunkCount{};
+	std::size_t bytes{};
+};
+
+// passFinished, once a pass is unfiltered and unpacked. Non interlaced images have a single pass 0
+struct PassEvent
+{
+	std::chrono::steady_clock::time_point time;
+	std::uint8_t pass{};
+	std::uint32_t width{};
+	std::uint32_t height{};
+	std::size_t bytes{};	// Unfiltered bytes of the pass
+};
+
+// stageFinished, at the end of every stage StageTimes would add to
+struct StageEvent
+{
+	std::chrono::steady_clock::time_point time;
+	Stage stage{};
+	std::chrono::nanoseconds duration{};
+};
+
+// allocated, for every buffer sized by the image
+struct AllocationEvent
+{
+	std::chrono::steady_clock::time_point time;
+	std::string_view buffer;
+	std::size_t bytes{};
+};
+
+template<typename Events>
+concept ObservesChunks = requires(Events& observer, const ChunkEvent& event) { observer.chunkParsed(event); };
+
+template<typename Events>
+concept ObservesImageData = requires(Events& observer, const ImageDataEvent& event) { observer.imageDataGathered(event); };
+
+template<typename Events>
+concept ObservesPasses = requires(Events& observer, const PassEvent& event) { observer.passFinished(event); };
+
+template<typename Events>
+concept ObservesStages = requires(Events& observer, const StageEvent& event) { observer.stageFinished(event); };
+
+template<typename Events>
+concept ObservesAllocations = requires(Events& observer, const AllocationEvent& event) { observer.allocated(event); };
+
+// Takes every event through virtual calls, for an observer picked at run time or built apart from the decoder,
+// like one exporting metrics. Whatever isn't overridden is ignored
+struct Observer
+{
+	virtual ~Observer() = default;
+
+	virtual void chunkParsed(const ChunkEvent&) {}
+	virtual void imageDataGathered(const ImageDataEvent&) {}
+	virtual void blockInflated(const deflate::BlockEvent&) {}
+	virtual void passFinished(const PassEvent&) {}
+	virtual void stageFinished(const StageEvent&) {}
+	virtual void allocated(const AllocationEvent&) {}
+};
+
+// Adds the time since the previous lap to the stage that just finished and tells the observer.
+// Without times or an observer of stages it reads no clock
+template<typename Events = deflate::NoObserver>
+struct StageClock
+{
+	StageTimes* times;
+	Events* observer = nullptr;
+	std::chrono::steady_clock::time_point last = times || ObservesStages<Events> ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+
+	void lap(Stage stage)
 	{
-		chunks.emplace_back(readChunk(stream));
+		if (times || ObservesStages<Events>)
+		{
+			const auto now = std::chrono::steady_clock::now();
 
-		auto& chunk = chunks.back();
+			if (times)
+			{
+				(*times)[stage] += now - last;
+			}
 
-		if (chunk.type == "IEND")
+			if constexpr (ObservesStages<Events>)
+			{
+				observer->stageFinished(StageEvent{ now, stage, now - last });
+			}
+
+			last = now;
+		}
+	}
+};
+
+// Predictions of the Average and Paeth filters from the bytes left, up and up left of the current one,
+// shared by the encoder and the decoder
+int averagePredictor(int left, int up)
+{
+	return (left + up) / 2;
+}
+
+int paethPredictor(int left, int up, int upLeft)
+{
+	const auto pa = std::abs(up - upLeft);
+	const auto pb = std::abs(left - upLeft);
+	const auto pc = std::abs(left + up - 2 * upLeft);
+
+	return (pa <= pb && pa <= pc) ? left : (pb <= pc ? up : upLeft);
+}
+
+// Reverses the filter of one row in place, previous being the unfiltered row above or null on the first row of a pass
+void unfilterRowKernel(std::uint8_t filter, std::uint8_t* row, const std::uint8_t* previous, std::size_t length, std::size_t bytePerPixel)
+{
+	if (filter == 1 || (filter == 4 && !previous))
+	{
+		for (std::size_t x = bytePerPixel; x < length; x++)
 		{
-			break;
+			row[x] += row[x - bytePerPixel];
 		}
 	}
+	else if (filter == 2 && previous)
+	{
+		for (std::size_t x = 0; x < length; x++)
+		{
+			row[x] += previous[x];
+		}
+	}
+	else if (filter == 3 && !previous)
+	{
+		for (std::size_t x = bytePerPixel; x < length; x++)
+		{
+			row[x] += row[x - bytePerPixel] / 2;
+		}
+	}
+	else if (filter == 3)
+	{
+		for (std::size_t x = 0; x < bytePerPixel; x++)
+		{
+			row[x] += previous[x] / 2;
+		}
 
-	if (chunks.size() <= 0)
+		for (std::size_t x = bytePerPixel; x < length; x++)
+		{
+			row[x] += averagePredictor(row[x - bytePerPixel], previous[x]);
+		}
+	}
+	else if (filter == 4)
 	{
-		std::cerr << "Empty file" << std::endl;
-		return std::nullopt;
+		for (std::size_t x = 0; x < bytePerPixel; x++)
+		{
+			row[x] += previous[x];
+		}
+
+		for (std::size_t x = bytePerPixel; x < length; x++)
+		{
+			row[x] += paethPredictor(row[x - bytePerPixel], previous[x], previous[x - bytePerPixel]);
+		}
 	}
+}
 
-	auto& firstChunk = chunks.front();
-	const auto pngInfo = readHeaderChunk(firstChunk);
-	if (!pngInfo)
+CPU_DISPATCHED_KERNEL(void, unfilterRow, unfilterRowKernel, (std::uint8_t filter, std::uint8_t* row, const std::uint8_t* previous, std::size_t length, std::size_t bytePerPixel), (filter, row, previous, length, bytePerPixel))
+
+// Widens 1 to 3 channel pixels to RGBA in place, walking backward since the output is larger than the input
+void expandChannelsKernel(std::uint8_t* data, std::size_t pixelCount, int channels)
+{
+	auto out = data + pixelCount * 4;
+	auto in = data + pixelCount * channels;
+
+	for (std::size_t x = 0; x < pixelCount; x++)
 	{
-		return std::nullopt;
+		out -= 4;
+		in -= channels;
+
+		if (channels == 1)
+		{
+			out[3] = 0xff;
+			out[2] = *in;
+			out[1] = *in;
+			out[0] = *in;
+		}
+		else if (channels == 2)
+		{
+			out[3] = in[1];
+			out[2] = in[0];
+			out[1] = in[0];
+			out[0] = in[0];
+		}
+		else if (channels == 3)
+		{
+			out[3] = 0xff;
+			out[2] = in[2];
+			out[1] = in[1];
+			out[0] = in[0];
+		}
 	}
+}
+
+CPU_DISPATCHED_KERNEL(void, expandChannels, expandChannelsKernel, (std::uint8_t* data, std::size_t pixelCount, int channels), (data, pixelCount, channels))
+
+// Decodes an image of the size and format of info from its zlib stream, split over compressedChunks,
+// taking the palette and transparency from the PLTE and tRNS chunks among chunks
+template<typename Events = deflate::NoObserver>
+std::optional<Image> decodeImage(const PngInfo& info, std::span<const PngChunk> chunks, std::span<const std::span<const std::uint8_t>> compressedChunks,
+	deflate::Inflater& inflater, StageTimes* times = nullptr, Events&& observer = {})
+{
+	StageClock clock{ times, &observer };
+
+	const auto allocated = [&](std::string_view buffer, std::size_t bytes)
+	{
+		if constexpr (ObservesAllocations<Events>)
+		{
+			observer.allocated(AllocationEvent{ std::chrono::steady_clock::now(), buffer, bytes });
+		}
+	};
 
 	std::array<uint8_t, 256> paletteR{};
 	std::array<uint8_t, 256> paletteG{};
@@ -219,14 +441,9 @@ std::optional<Image> readPng(std::istream& stream)
 	std::optional<std::uint16_t> transG;
 	std::optional<std::uint16_t> transB;
 
-	std::vector<std::uint8_t> compressedData;
-	for (const auto& chunk : chunks)
+	for (auto& chunk : chunks)
 	{
-		if (chunk.type == "IDAT")
-		{
-			compressedData.insert(compressedData.end(), chunk.data.begin(), chunk.data.end());
-		}
-		else if (chunk.type == "PLTE")
+		if (chunk.type == "PLTE")
 		{
 			for (int x = 0; x < chunk.length / 3; x++)
 			{
@@ -237,71 +454,85 @@ std::optional<Image> readPng(std::istream& stream)
 		}
 		else if (chunk.type == "tRNS")
 		{
-			if (pngInfo->colorType == 0)
+			if (info.colorType == 0)
 			{
 				transR = std::byteswap(*(std::uint16_t*)chunk.data.data());
 			}
-			else if (pngInfo->colorType == 2)
+			else if (info.colorType == 2)
 			{
 				transR = std::byteswap(*((std::uint16_t*)chunk.data.data() + 0));
 				transG = std::byteswap(*((std::uint16_t*)chunk.data.data() + 1));
 				transB = std::byteswap(*((std::uint16_t*)chunk.data.data() + 2));
 			}
-			else if (pngInfo->colorType == 3)
+			else if (info.colorType == 3)
 			{
 				std::copy(chunk.data.begin(), chunk.data.end(), paletteA.begin());
 			}
 		}
 	}
 
-	auto decompressedDataOpt = deflate::inflate(compressedData);
-	if (!decompressedDataOpt)
+	// A single chunk is inflated in place, several have to be joined into one zlib stream first
+	std::vector<std::uint8_t> joinedData;
+	std::span<const std::uint8_t> compressedData;
+	if (compressedChunks.size() == 1)
 	{
-		return std::nullopt;
+		compressedData = compressedChunks.front();
+	}
+	else
+	{
+		for (const auto& idat : compressedChunks)
+		{
+			joinedData.insert(joinedData.end(), idat.begin(), idat.end());
+		}
+
+		compressedData = joinedData;
+		allocated("joined IDAT", joinedData.size());
+	}
+
+	if constexpr (ObservesImageData<Events>)
+	{
+		observer.imageDataGathered(ImageDataEvent{ std::chrono::steady_clock::now(), compressedChunks.size(), compressedData.size() });
 	}
 
-	auto& decompressedData = *decompressedDataOpt;
+	clock.lap(Stage::Gather);
 
 	int channels = 1;
-	if (pngInfo->colorType == 2)
+	if (info.colorType == 2)
 	{
 		channels = 3;
 	}
-	else if (pngInfo->colorType == 4)
+	else if (info.colorType == 4)
 	{
 		channels = 2;
 	}
-	else if (pngInfo->colorType == 6)
+	else if (info.colorType == 6)
 	{
 		channels = 4;
 	}
 
-	const auto depth = pngInfo->depth;
+	const auto depth = info.depth;
 
 	const auto bytePerChannel = depth == 16 ? 2 : 1;
 	const auto bytePerPixel = channels * bytePerChannel;
-	const auto lineByteWidth = pngInfo->width * bytePerPixel;
+	// Sizes in std::size_t, a gigapixel image alone already overflows 32 bits
+	const auto pixelCount = std::size_t(info.width) * info.height;
+	const auto lineByteWidth = std::size_t(info.width) * bytePerPixel;
 
-	const auto outputByteLength = pngInfo->width * pngInfo->height * 4;
+	const auto outputByteLength = pixelCount * 4;
 
-	std::vector<uint8_t> imageData(std::max(outputByteLength, lineByteWidth * pngInfo->height));
+	std::vector<uint8_t> imageData(std::max(outputByteLength, lineByteWidth * info.height));
+	allocated("image", imageData.size());
 
 	static constexpr uint8_t scaleTable[]{ 0, 0xff, 0x55, 0, 0x11, 0, 0, 0, 0x01 };
-	const auto scale = pngInfo->colorType == 3 ? 1 : scaleTable[depth];
+	const auto scale = info.colorType == 3 ? 1 : scaleTable[depth];
 
-	int pos{};
-	const auto nextByte = [&]()
-	{
-		return decompressedData[pos++];
-	};
-	
-	const auto rawImageWidth = [&](int width) -> int
+	const auto rawImageWidth = [&](std::size_t width) -> std::size_t
 	{
 		if (depth < 8)
 		{
 			// return std::ceil((channels * depth * width) / 8.f);
 
-			std::uint16_t v = (channels * depth * width);
+			std::size_t v = (channels * depth * width);
 			bool b = v & 0b111;
 			v >>= 3;
 			v += b || (v == 0);
@@ -312,101 +543,153 @@ std::optional<Image> readPng(std::istream& stream)
 		return channels * width * bytePerChannel;
 	};
 
-	const auto unfilter = [&](auto& data, uint8_t filter, int x, int y, int lineWidth)
-	{
-		std::uint8_t byte = nextByte();
-
-		std::uint8_t a = 0;
-		std::uint8_t b = 0;
-		std::uint8_t c = 0;
+	static constexpr std::array<int, 7> startXTable = { 0, 0, 4, 0, 2, 0, 1 };
+	static constexpr std::array<int, 7> startYTable = { 0, 4, 0, 2, 0, 1, 0 };
+	static constexpr std::array<int, 7> strideYTable = { 8, 8, 8, 4, 4, 2, 2 };
+	static constexpr std::array<int, 7> strideXTable = { 8, 8, 4, 4, 2, 2, 1 };
 
-		if (x >= bytePerPixel)
+	std::size_t filteredSize{};
+	if (!info.interlace)
+	{
+		filteredSize = std::size_t(info.height) * (1 + rawImageWidth(info.width));
+	}
+	else
+	{
+		for (int pass{}; pass < 7; pass++)
 		{
-			a = data[x - bytePerPixel + y * lineWidth];
-		}
+			const auto passWidth = (info.width - startYTable[pass] + strideXTable[pass] - 1) / strideXTable[pass];
+			const auto passHeight = (info.height - startXTable[pass] + strideYTable[pass] - 1) / strideYTable[pass];
 
-		if (y >= 1)
-		{
-			b = data[x + (y - 1) * lineWidth];
+			if (passWidth && passHeight)
+			{
+				filteredSize += std::size_t(passHeight) * (1 + rawImageWidth(passWidth));
+			}
 		}
+	}
 
-		if (x >= bytePerPixel && y >= 1)
+	// Streams made only of stored blocks are unfiltered straight from the IDAT data
+	std::vector<std::uint8_t> decompressedData;
+	std::vector<std::span<const std::uint8_t>> filteredData;
+	if (auto storedBlocks = deflate::storedBlocks(compressedData))
+	{
+		std::uint32_t checksum = 1;
+		for (const auto& block : storedBlocks->blocks)
 		{
-			c = data[x - bytePerPixel + (y - 1) * lineWidth];
+			checksum = deflate::adler32(block, checksum);
 		}
 
-		if (filter == 1)
+		const auto* trailer = compressedData.data() + storedBlocks->trailerOffset;
+		if (checksum != ((std::uint32_t(trailer[0]) << 24) | (trailer[1] << 16) | (trailer[2] << 8) | trailer[3]))
 		{
-			byte += a;
+			std::cerr << "Adler-32 checksum mismatch" << std::endl;
+			return std::nullopt;
 		}
-		else if (filter == 2)
+
+		filteredData = std::move(storedBlocks->blocks);
+	}
+	else
+	{
+		auto decompressedDataOpt = inflater.inflate(compressedData, filteredSize, observer);
+		if (!decompressedDataOpt)
 		{
-			byte += b;
+			return std::nullopt;
 		}
-		else if (filter == 3)
+
+		decompressedData = std::move(*decompressedDataOpt);
+		allocated("inflated", decompressedData.capacity());
+		filteredData.push_back(decompressedData);
+	}
+
+	std::size_t availableSize{};
+	for (const auto& data : filteredData)
+	{
+		availableSize += data.size();
+	}
+
+	if (availableSize < filteredSize)
+	{
+		std::cerr << "Not enough image data" << std::endl;
+		return std::nullopt;
+	}
+
+	clock.lap(Stage::Inflate);
+
+	std::size_t segment{};
+	const std::uint8_t* filteredPos = filteredData[segment].data();
+	const std::uint8_t* filteredEnd = filteredPos + filteredData[segment].size();
+	const auto nextSegment = [&]()
+	{
+		while (filteredPos == filteredEnd)
 		{
-			byte += ((int)a + b) / 2;
+			segment++;
+			filteredPos = filteredData[segment].data();
+			filteredEnd = filteredPos + filteredData[segment].size();
 		}
-		else if (filter == 4)
+	};
+
+	const auto nextByte = [&]()
+	{
+		nextSegment();
+		return *(filteredPos++);
+	};
+
+	const auto readFilteredRow = [&](std::uint8_t* row, std::size_t length)
+	{
+		while (length > 0)
 		{
-			const auto p = (int)a + b - c;
-			const auto pa = std::abs(p - a);
-			const auto pb = std::abs(p - b);
-			const auto pc = std::abs(p - c);
+			nextSegment();
 
-			int v{};
-			if (pa <= pb && pa <= pc)
-			{
-				v = a;
-			}
-			else if (pb <= pc)
-			{
-				v = b;
-			}
-			else
-			{
-				v = c;
-			}
+			const auto available = std::min<std::size_t>(length, filteredEnd - filteredPos);
+			std::memcpy(row, filteredPos, available);
 
-			byte += v;
+			row += available;
+			filteredPos += available;
+			length -= available;
 		}
+	};
 
-		data[x + y * lineWidth] = byte;
+	const auto passFinished = [&](int pass, std::uint32_t width, std::uint32_t height, std::size_t bytes)
+	{
+		if constexpr (ObservesPasses<Events>)
+		{
+			observer.passFinished(PassEvent{ std::chrono::steady_clock::now(), std::uint8_t(pass), width, height, bytes });
+		}
 	};
 
-	const auto readRawImage = [&](auto& data, int width, int height, int startX, int startY, int strideX, int strideY)
+	const auto readRawImage = [&](auto& data, std::uint32_t width, std::uint32_t height, std::uint32_t startX, std::uint32_t startY, std::uint32_t strideX, std::uint32_t strideY)
 	{
 		const auto byteWidth = rawImageWidth(width);
 
-		for (int y = 0; y < height; y++)
+		for (std::uint32_t y = 0; y < height; y++)
 		{
 			const auto filter = nextByte();
 
-			for (int x = 0; x < byteWidth; x++)
-			{
-				unfilter(data, filter, x, y, byteWidth);
-			}
+			auto* row = data.data() + std::size_t(y) * byteWidth;
+			readFilteredRow(row, byteWidth);
+			unfilterRow(filter, row, y > 0 ? row - byteWidth : nullptr, byteWidth, bytePerPixel);
 		}
 
-		int i{};
+		clock.lap(Stage::Unfilter);
+
+		std::uint32_t i{};
 		auto* passByte = data.data();
-		const auto pixelPerByte = std::min(width, 8 / depth);
+		const auto pixelPerByte = std::min<std::uint32_t>(width, 8 / depth);
 
 		auto row = startY;
-		while (row < pngInfo->height)
+		while (row < info.height)
 		{
 			auto col = startX;
-			while (col < pngInfo->width)
+			while (col < info.width)
 			{
 				for (int x = 0; x < bytePerPixel; x++)
 				{
 					if (depth >= 8)
 					{
-						imageData[col * bytePerPixel + row * lineByteWidth + x] = *(passByte++);
+						imageData[std::size_t(col) * bytePerPixel + row * lineByteWidth + x] = *(passByte++);
 					}
 					else
 					{
-						imageData[col * bytePerPixel + row * lineByteWidth + x] = scale * (*passByte >> (8 - depth));
+						imageData[std::size_t(col) * bytePerPixel + row * lineByteWidth + x] = scale * (*passByte >> (8 - depth));
 
 						*passByte <<= depth;
 
@@ -429,20 +712,20 @@ std::optional<Image> readPng(std::istream& stream)
 
 			row += strideY;
 		}
+
+		clock.lap(Stage::Unpack);
 	};
 
-	if (!pngInfo->interlace)
+	if (!info.interlace)
 	{
-		auto tempData = imageData;
-		readRawImage(tempData, pngInfo->width, pngInfo->height, 0, 0, 1, 1);
+		std::vector<uint8_t> tempData(std::size_t(rawImageWidth(info.width)) * info.height);
+		allocated("pass", tempData.size());
+
+		readRawImage(tempData, info.width, info.height, 0, 0, 1, 1);
+		passFinished(0, info.width, info.height, tempData.size());
 	}
 	else
 	{
-		static constexpr std::array<int, 7> startXTable = { 0, 0, 4, 0, 2, 0, 1 };
-		static constexpr std::array<int, 7> startYTable = { 0, 4, 0, 2, 0, 1, 0 };
-		static constexpr std::array<int, 7> strideYTable = { 8, 8, 8, 4, 4, 2, 2 };
-		static constexpr std::array<int, 7> strideXTable = { 8, 8, 4, 4, 2, 2, 1 };
-
 		for (int pass{}; pass < 7; pass++)
 		{
 			const auto startX = startYTable[pass];
@@ -450,8 +733,8 @@ std::optional<Image> readPng(std::istream& stream)
 			const auto strideX = strideXTable[pass];
 			const auto strideY = strideYTable[pass];
 
-			const auto passWidth = (pngInfo->width - startX + strideX - 1) / strideX;
-			const auto passHeight = (pngInfo->height - startY + strideY - 1) / strideY;
+			const auto passWidth = (info.width - startX + strideX - 1) / strideX;
+			const auto passHeight = (info.height - startY + strideY - 1) / strideY;
 
 			if (!passWidth || !passHeight)
 			{
@@ -463,25 +746,29 @@ std::optional<Image> readPng(std::istream& stream)
 
 			std::vector<uint8_t> passData;
 			passData.resize(passSize);
+			allocated("pass", passData.size());
 
 			readRawImage(passData, passWidth, passHeight, startX, startY, strideX, strideY);
+			passFinished(pass, passWidth, passHeight, passData.size());
 		}
 	}
 
 	if (depth == 16)
 	{
-		for (int x = 0; x < pngInfo->width * pngInfo->height * channels; x++)
+		for (std::size_t x = 0; x < pixelCount * channels; x++)
 		{
 			imageData[x] = ((uint16_t*)imageData.data())[x] & 0xFF;
 		}
+
+		clock.lap(Stage::Unpack);
 	}
 
-	if (pngInfo->colorType == 3)
+	if (info.colorType == 3)
 	{
-		auto out = imageData.data() + pngInfo->width * pngInfo->height * 4;
-		auto in = imageData.data() + pngInfo->width * pngInfo->height;
+		auto out = imageData.data() + pixelCount * 4;
+		auto in = imageData.data() + pixelCount;
 
-		for (int x = 0; x < pngInfo->width * pngInfo->height; x++)
+		for (std::size_t x = 0; x < pixelCount; x++)
 		{
 			out -= 4;
 			in--;
@@ -494,38 +781,11 @@ std::optional<Image> readPng(std::istream& stream)
 	}
 	else if (channels < 4)
 	{
-		auto out = imageData.data() + pngInfo->width * pngInfo->height * 4;
-		auto in = imageData.data() + pngInfo->width * pngInfo->height * channels;
-
-		for (int x = 0; x < pngInfo->width * pngInfo->height; x++)
-		{
-			out -= 4;
-			in -= channels;
-
-			if (channels == 1)
-			{
-				out[3] = 0xff;
-				out[2] = *in;
-				out[1] = *in;
-				out[0] = *in;
-			}
-			else if (channels == 2)
-			{
-				out[3] = in[1];
-				out[2] = in[0];
-				out[1] = in[0];
-				out[0] = in[0];
-			}
-			else if (channels == 3)
-			{
-				out[3] = 0xff;
-				out[2] = in[2];
-				out[1] = in[1];
-				out[0] = in[0];
-			}
-		}
+		expandChannels(imageData.data(), pixelCount, channels);
 	}
 
+	clock.lap(Stage::Expand);
+
 	if (transR)
 	{
 		if (depth < 8)
@@ -549,10 +809,10 @@ std::optional<Image> readPng(std::istream& stream)
 			}
 		}
 
-		if (pngInfo->colorType == 0)
+		if (info.colorType == 0)
 		{
 			auto in = imageData.data();
-			for (int x = 0; x < pngInfo->width * pngInfo->height; x++)
+			for (std::size_t x = 0; x < pixelCount; x++)
 			{
 				if (in[0] == *transR)
 				{
@@ -563,10 +823,10 @@ std::optional<Image> readPng(std::istream& stream)
 			}
 			
 		}
-		else if (pngInfo->colorType == 2)
+		else if (info.colorType == 2)
 		{
 			auto in = imageData.data();
-			for (int x = 0; x < pngInfo->width * pngInfo->height; x++)
+			for (std::size_t x = 0; x < pixelCount; x++)
 			{
 				if (in[0] == *transR && in[1] == *transG && in[2] == *transB)
 				{
@@ -578,9 +838,2042 @@ std::optional<Image> readPng(std::istream& stream)
 		}
 	}
 
-	imageData.resize(pngInfo->width* pngInfo->height);
+	clock.lap(Stage::Transparency);
+
+	imageData.resize(outputByteLength);
+
+	return Image{ info.width, info.height, std::move(imageData) };
+}
+
+// The inflater keeps its tables between calls, which pays off when decoding many images from the same encoder.
+// With times, the time each stage took is added to it. The observer, a png::Observer or any type with some of
+// its member functions, gets the events it has a member function for. Without one nothing is reported or timed
+template<typename Events = deflate::NoObserver>
+std::optional<Image> readPng(std::istream& stream, deflate::Inflater& inflater, StageTimes* times = nullptr, Events&& observer = {})
+{
+	StageClock clock{ times, &observer };
+
+	const auto fileSignature = readStaticBytes<8>(stream);
+
+	if (fileSignature != pngSignature)
+	{
+		std::cerr << "Incorrect file header" << std::endl;
+		return std::nullopt;
+	}
+
+	std::vector<PngChunk> chunks;
+
+	while (stream)
+	{
+		chunks.emplace_back(readChunk(stream));
+
+		auto& chunk = chunks.back();
+
+		if constexpr (ObservesChunks<Events>)
+		{
+			observer.chunkParsed(ChunkEvent{ std::chrono::steady_clock::now(), chunk.type, std::uint32_t(chunk.length) });
+		}
+
+		if (chunk.type == "IEND")
+		{
+			break;
+		}
+	}
+
+	if (chunks.size() <= 0)
+	{
+		std::cerr << "Empty file" << std::endl;
+		return std::nullopt;
+	}
+
+	auto& firstChunk = chunks.front();
+	const auto pngInfo = readHeaderChunk(firstChunk);
+	if (!pngInfo)
+	{
+		return std::nullopt;
+	}
+
+	std::vector<std::span<const std::uint8_t>> idatChunks;
+	for (auto& chunk : chunks)
+	{
+		if (chunk.type == "IDAT")
+		{
+			idatChunks.push_back(chunk.data);
+		}
+	}
+
+	clock.lap(Stage::Chunks);
+
+	return decodeImage(*pngInfo, chunks, idatChunks, inflater, times, observer);
+}
+
+std::optional<Image> readPng(std::istream& stream)
+{
+	deflate::Inflater inflater;
+	return readPng(stream, inflater);
+}
+
+// Where an APNG frame goes on the canvas and how it is shown, from its fcTL chunk
+struct FrameControl
+{
+	std::uint32_t width{};
+	std::uint32_t height{};
+	std::uint32_t x{};
+	std::uint32_t y{};
+
+	// Delay before the next frame, in seconds as a fraction, 0 as denominator meaning 100
+	std::uint16_t delayNumerator{};
+	std::uint16_t delayDenominator{};
+
+	// What becomes of the frame area before the next frame: 0 kept, 1 cleared to transparent black,
+	// 2 restored to what it was before the frame
+	std::uint8_t dispose{};
+
+	// 0 replaces the frame area, 1 composites the frame over it
+	std::uint8_t blend{};
+};
+
+std::optional<FrameControl> readFrameControl(const PngChunk& chunk, const PngInfo& info)
+{
+	if (chunk.length != 26)
+	{
+		std::cerr << "Wrong frame control length" << std::endl;
+		return std::nullopt;
+	}
+
+	std::spanstream chunkStream(std::span<char>{(char*)chunk.data.data(), chunk.data.size()});
+
+	// Sequence number
+	readInt<uint32_t>(chunkStream);
+
+	FrameControl control;
+	control.width				= readInt<uint32_t>(chunkStream);
+	control.height				= readInt<uint32_t>(chunkStream);
+	control.x					= readInt<uint32_t>(chunkStream);
+	control.y					= readInt<uint32_t>(chunkStream);
+	control.delayNumerator		= readInt<uint16_t>(chunkStream);
+	control.delayDenominator	= readInt<uint16_t>(chunkStream);
+	control.dispose				= readInt<uint8_t>(chunkStream);
+	control.blend				= readInt<uint8_t>(chunkStream);
+
+	if (control.width == 0 || control.height == 0 || control.width > info.width || control.height > info.height
+		|| control.x > info.width - control.width || control.y > info.height - control.height)
+	{
+		std::cerr << "Frame outside the image" << std::endl;
+		return std::nullopt;
+	}
+
+	if (control.dispose > 2 || control.blend > 1)
+	{
+		std::cerr << "Invalid frame dispose or blend operation" << std::endl;
+		return std::nullopt;
+	}
+
+	return control;
+}
+
+// Composites pixelCount RGBA pixels of source over destination, both unpremultiplied
+void blendOver(const std::uint8_t* source, std::uint8_t* destination, std::size_t pixelCount)
+{
+	for (std::size_t x = 0; x < pixelCount; x++, source += 4, destination += 4)
+	{
+		const std::uint32_t alpha = source[3];
+		if (alpha == 255)
+		{
+			std::memcpy(destination, source, 4);
+		}
+		else if (alpha != 0)
+		{
+			// Weights of both colours times 255, summing to the result alpha times 255
+			const auto sourceWeight = alpha * 255;
+			const auto destinationWeight = (255 - alpha) * destination[3];
+			const auto total = sourceWeight + destinationWeight;
+
+			for (int channel = 0; channel < 3; channel++)
+			{
+				destination[channel] = std::uint8_t((source[channel] * sourceWeight + destination[channel] * destinationWeight) / total);
+			}
+
+			destination[3] = std::uint8_t(total / 255);
+		}
+	}
+}
+
+// Decodes the frames of an animated PNG one at a time, reading the stream only up to the end of the frame
+// asked for, so a single frame's data is in memory at once. Each frame is composited into canvas the way the
+// file says to show it, touching only the frame area. A PNG without acTL reads as a single frame.
+// Like readPng, frames keep 8 bits per channel
+struct ApngReader
+{
+	std::istream& stream;
+	deflate::Inflater inflater;
+
+	PngInfo info{};
+	std::uint32_t frameCount = 1;
+
+	// Times the animation plays, 0 meaning forever
+	std::uint32_t playCount{};
+
+	// The animation as shown after the last frame decoded, and that frame's control
+	Image canvas;
+	FrameControl frame;
+	std::uint32_t frameIndex{};
+
+	bool failed = false;
+
+	// Chunks every frame needs, PLTE and tRNS
+	std::vector<PngChunk> headerChunks;
+
+	// The chunk read past the end of the previous frame, that starts the next one
+	std::optional<PngChunk> pending;
+
+	// The frame area before the last frame, when it is restored after it
+	std::vector<std::uint8_t> savedArea;
+
+	bool animated = false;
+	bool ended = false;
+
+	explicit ApngReader(std::istream& stream)
+		: stream(stream)
+	{
+		if (readStaticBytes<8>(stream) != pngSignature)
+		{
+			std::cerr << "Incorrect file header" << std::endl;
+			failed = true;
+			return;
+		}
+
+		const auto header = readHeaderChunk(readChunk(stream));
+		if (!stream || !header)
+		{
+			failed = true;
+			return;
+		}
+
+		info = *header;
+		canvas = Image{ info.width, info.height, std::vector<std::uint8_t>(std::size_t(info.width) * info.height * 4) };
+
+		// Up to the first frame control or image data, which starts the first frame
+		while (true)
+		{
+			auto chunk = readChunk(stream);
+			if (!stream || chunk.length < 0)
+			{
+				std::cerr << "Truncated chunk" << std::endl;
+				failed = true;
+				return;
+			}
+
+			if (chunk.type == "acTL")
+			{
+				if (chunk.length != 8)
+				{
+					std::cerr << "Wrong animation control length" << std::endl;
+					failed = true;
+					return;
+				}
+
+				std::spanstream chunkStream(std::span<char>{(char*)chunk.data.data(), chunk.data.size()});
+				frameCount = readInt<uint32_t>(chunkStream);
+				playCount = readInt<uint32_t>(chunkStream);
+				animated = true;
+			}
+			else if (chunk.type == "PLTE" || chunk.type == "tRNS")
+			{
+				headerChunks.push_back(std::move(chunk));
+			}
+			else if (chunk.type == "fcTL" || chunk.type == "IDAT" || chunk.type == "IEND")
+			{
+				pending = std::move(chunk);
+				break;
+			}
+		}
+	}
+
+	// Decodes the next frame into canvas, returns false after the last frame or once the reader failed
+	bool nextFrame()
+	{
+		if (failed || frameIndex == frameCount)
+		{
+			return false;
+		}
+
+		// A still image is one frame covering it all
+		std::optional<FrameControl> control;
+		if (!animated)
+		{
+			control = FrameControl{ .width = info.width, .height = info.height };
+		}
+
+		// Frame data is IDAT when the frame control comes before it, the default image being the first frame,
+		// otherwise the payload of fdAT chunks after their sequence number
+		std::vector<PngChunk> dataChunks;
+		std::vector<std::span<const std::uint8_t>> compressedChunks;
+
+		while (!ended)
+		{
+			auto chunk = pending ? std::move(*pending) : readChunk(stream);
+			pending.reset();
+
+			if (!stream || chunk.length < 0)
+			{
+				std::cerr << "Truncated chunk" << std::endl;
+				failed = true;
+				return false;
+			}
+
+			if (chunk.type == "fcTL" && animated)
+			{
+				if (control)
+				{
+					pending = std::move(chunk);
+					break;
+				}
+
+				control = readFrameControl(chunk, info);
+				if (!control)
+				{
+					failed = true;
+					return false;
+				}
+
+				// The first frame starts the animation from a transparent canvas, so it has to cover all of it
+				if (frameIndex == 0 && (control->x != 0 || control->y != 0 || control->width != info.width || control->height != info.height))
+				{
+					std::cerr << "First frame not covering the image" << std::endl;
+					failed = true;
+					return false;
+				}
+			}
+			else if (chunk.type == "IDAT" && control)
+			{
+				dataChunks.push_back(std::move(chunk));
+				compressedChunks.push_back(dataChunks.back().data);
+			}
+			else if (chunk.type == "fdAT" && control)
+			{
+				if (chunk.length < 4)
+				{
+					std::cerr << "Wrong frame data length" << std::endl;
+					failed = true;
+					return false;
+				}
+
+				dataChunks.push_back(std::move(chunk));
+				compressedChunks.push_back(std::span<const std::uint8_t>(dataChunks.back().data).subspan(4));
+			}
+			else if (chunk.type == "IEND")
+			{
+				ended = true;
+			}
+		}
+
+		if (!control || compressedChunks.empty())
+		{
+			std::cerr << "Missing frame data" << std::endl;
+			failed = true;
+			return false;
+		}
+
+		auto frameInfo = info;
+		frameInfo.width = control->width;
+		frameInfo.height = control->height;
+
+		const auto image = decodeImage(frameInfo, headerChunks, compressedChunks, inflater);
+		if (!image)
+		{
+			failed = true;
+			return false;
+		}
+
+		const auto rowBytes = [](const FrameControl& area) { return std::size_t(area.width) * 4; };
+		const auto areaRow = [&](const FrameControl& area, std::uint32_t y) { return canvas.data.data() + ((std::size_t(area.y) + y) * canvas.width + area.x) * 4; };
+
+		// The previous frame leaves its area as it asked to
+		if (frameIndex > 0 && frame.dispose == 1)
+		{
+			for (std::uint32_t y = 0; y < frame.height; y++)
+			{
+				std::memset(areaRow(frame, y), 0, rowBytes(frame));
+			}
+		}
+		else if (frameIndex > 0 && frame.dispose == 2)
+		{
+			for (std::uint32_t y = 0; y < frame.height; y++)
+			{
+				std::memcpy(areaRow(frame, y), savedArea.data() + y * rowBytes(frame), rowBytes(frame));
+			}
+		}
+
+		// Restoring the first frame clears its area, the canvas being transparent black before it
+		if (control->dispose == 2 && frameIndex == 0)
+		{
+			control->dispose = 1;
+		}
+
+		if (control->dispose == 2)
+		{
+			savedArea.resize(rowBytes(*control) * control->height);
+			for (std::uint32_t y = 0; y < control->height; y++)
+			{
+				std::memcpy(savedArea.data() + y * rowBytes(*control), areaRow(*control, y), rowBytes(*control));
+			}
+		}
+
+		for (std::uint32_t y = 0; y < control->height; y++)
+		{
+			const auto* source = image->data.data() + y * rowBytes(*control);
+
+			if (control->blend == 1)
+			{
+				blendOver(source, areaRow(*control, y), control->width);
+			}
+			else
+			{
+				std::memcpy(areaRow(*control, y), source, rowBytes(*control));
+			}
+		}
+
+		frame = *control;
+		frameIndex++;
+
+		return true;
+	}
+};
+
+// Applies filter to one row into out, previous being the row above or null on the first row.
+// The same cases as unfilterRowKernel, but without a dependency on the previous output byte every loop vectorizes
+void filterRowKernel(std::uint8_t filter, std::uint8_t* out, const std::uint8_t* row, const std::uint8_t* previous, std::size_t length, std::size_t bytePerPixel)
+{
+	const auto first = std::min(length, bytePerPixel);
+
+	if (filter == 0 || (filter == 2 && !previous))
+	{
+		std::memcpy(out, row, length);
+	}
+	else if (filter == 1 || (filter == 4 && !previous))
+	{
+		std::memcpy(out, row, first);
+
+		for (std::size_t x = bytePerPixel; x < length; x++)
+		{
+			out[x] = row[x] - row[x - bytePerPixel];
+		}
+	}
+	else if (filter == 2)
+	{
+		for (std::size_t x = 0; x < length; x++)
+		{
+			out[x] = row[x] - previous[x];
+		}
+	}
+	else if (filter == 3 && !previous)
+	{
+		std::memcpy(out, row, first);
+
+		for (std::size_t x = bytePerPixel; x < length; x++)
+		{
+			out[x] = row[x] - row[x - bytePerPixel] / 2;
+		}
+	}
+	else if (filter == 3)
+	{
+		for (std::size_t x = 0; x < first; x++)
+		{
+			out[x] = row[x] - previous[x] / 2;
+		}
+
+		for (std::size_t x = bytePerPixel; x < length; x++)
+		{
+			out[x] = row[x] - averagePredictor(row[x - bytePerPixel], previous[x]);
+		}
+	}
+	else if (filter == 4)
+	{
+		for (std::size_t x = 0; x < first; x++)
+		{
+			out[x] = row[x] - previous[x];
+		}
+
+		for (std::size_t x = bytePerPixel; x < length; x++)
+		{
+			out[x] = row[x] - paethPredictor(row[x - bytePerPixel], previous[x], previous[x - bytePerPixel]);
+		}
+	}
+}
+
+CPU_DISPATCHED_KERNEL(void, filterRow, filterRowKernel, (std::uint8_t filter, std::uint8_t* out, const std::uint8_t* row, const std::uint8_t* previous, std::size_t length, std::size_t bytePerPixel), (filter, out, row, previous, length, bytePerPixel))
+
+enum class FilterStrategy
+{
+	Fixed,		// WriteOptions::filter on every row
+	MinimumSum,	// Smallest sum of the residuals taken as signed bytes, libpng's heuristic
+	Entropy,	// Smallest order 0 entropy of the residual bytes
+	BruteForce,	// Smallest compressed size after the rows above, by far the slowest
+};
+
+// Sum of the filtered bytes taken as signed values. Flipping the sign bit turns |byte| into the distance
+// of the flipped byte to 128, which compilers map to psadbw over blocks read against a row of 128s
+std::size_t filterCost(const std::uint8_t* data, std::size_t length)
+{
+	static constexpr auto middle = []()
+	{
+		std::array<std::uint8_t, 32> bytes{};
+		std::fill(bytes.begin(), bytes.end(), 0x80);
+		return bytes;
+	}();
+
+	std::size_t cost{};
+	std::size_t x{};
+
+	for (; x + middle.size() <= length; x += middle.size())
+	{
+		int blockCost{};
+		for (std::size_t y = 0; y < middle.size(); y++)
+		{
+			const std::uint8_t flipped = data[x + y] ^ 0x80;
+			blockCost += std::abs(flipped - middle[y]);
+		}
+
+		cost += blockCost;
+	}
+
+	for (; x < length; x++)
+	{
+		cost += std::abs(int(std::int8_t(data[x])));
+	}
+
+	return cost;
+}
+
+// Bits an order 0 entropy coder would need for the filtered bytes
+double filterEntropy(const std::uint8_t* data, std::size_t length)
+{
+	// Interleaved counts so consecutive equal bytes don't wait on each other's increments
+	std::array<std::array<std::uint32_t, 256>, 4> counts{};
+
+	std::size_t x{};
+	for (; x + 4 <= length; x += 4)
+	{
+		counts[0][data[x]]++;
+		counts[1][data[x + 1]]++;
+		counts[2][data[x + 2]]++;
+		counts[3][data[x + 3]]++;
+	}
+
+	for (; x < length; x++)
+	{
+		counts[0][data[x]]++;
+	}
+
+	double bits{};
+	for (std::size_t symbol = 0; symbol < 256; symbol++)
+	{
+		if (const auto count = counts[0][symbol] + counts[1][symbol] + counts[2][symbol] + counts[3][symbol])
+		{
+			bits -= count * std::log2(double(count) / length);
+		}
+	}
+
+	return bits;
+}
+
+// Filters one row with every filter and keeps the cheapest by the MinimumSum or Entropy strategy in out,
+// after its filter type byte. scratch holds a row for the candidates
+void filterRowAdaptiveKernel(FilterStrategy strategy, std::uint8_t* out, std::uint8_t* scratch, const std::uint8_t* row, const std::uint8_t* previous, std::size_t length, std::size_t bytePerPixel)
+{
+	double bestCost = INFINITY;
+
+	for (std::uint8_t filter = 0; filter < 5; filter++)
+	{
+		// Without a row above, Up repeats None and Paeth repeats Sub
+		if (!previous && (filter == 2 || filter == 4))
+		{
+			continue;
+		}
+
+		filterRowKernel(filter, scratch, row, previous, length, bytePerPixel);
+
+		const auto cost = strategy == FilterStrategy::Entropy ? filterEntropy(scratch, length) : double(filterCost(scratch, length));
+		if (cost < bestCost)
+		{
+			bestCost = cost;
+			out[0] = filter;
+			std::memcpy(out + 1, scratch, length);
+		}
+	}
+}
+
+CPU_DISPATCHED_KERNEL(void, filterRowAdaptive, filterRowAdaptiveKernel, (FilterStrategy strategy, std::uint8_t* out, std::uint8_t* scratch, const std::uint8_t* row, const std::uint8_t* previous, std::size_t length, std::size_t bytePerPixel), (strategy, out, scratch, row, previous, length, bytePerPixel))
+
+// Filtered bytes the brute force strategy compresses before each candidate row, when available
+static constexpr std::size_t bruteForceHistorySize = 8192;
+
+// Filters one row with every filter and keeps in out the one that compresses smallest after the
+// historySize filtered bytes just before out, compressed with deflater at level
+void filterRowBruteForce(std::uint8_t* out, const std::uint8_t* row, const std::uint8_t* previous, std::size_t length, std::size_t bytePerPixel,
+	std::size_t historySize, int level, deflate::Deflater& deflater, deflate::BitWriter& writer)
+{
+	std::size_t bestBits = SIZE_MAX;
+	std::uint8_t bestFilter{};
+
+	for (std::uint8_t filter = 0; filter < 5; filter++)
+	{
+		out[0] = filter;
+		filterRow(filter, out + 1, row, previous, length, bytePerPixel);
+
+		writer.data.clear();
+		writer.bits = 0;
+		writer.count = 0;
+		deflater.compress(writer, std::span(out - historySize, historySize + 1 + length), historySize, level, true);
+
+		if (const auto bits = writer.data.size() * 8 + writer.count; bits < bestBits)
+		{
+			bestBits = bits;
+			bestFilter = filter;
+		}
+	}
+
+	if (bestFilter != 4)
+	{
+		out[0] = bestFilter;
+		filterRow(bestFilter, out + 1, row, previous, length, bytePerPixel);
+	}
+}
+
+// Codes of the fast encoding mode, fixed once from a model of Up filtered pixels rather than measured
+// per image: residuals close to zero make most literals, and matches mostly repeat the previous pixel
+struct FastCodes
+{
+	std::array<std::uint8_t, deflate::Alphabet::LiteralCount> literalLengths{};
+	std::array<std::uint16_t, deflate::Alphabet::LiteralCount> literalCodes{};
+	std::array<std::uint8_t, deflate::Alphabet::DistanceCount> distanceLengths{};
+	std::array<std::uint16_t, deflate::Alphabet::DistanceCount> distanceCodes{};
+
+	// Code and extra bits of every match length, merged into a single write
+	std::array<std::uint32_t, 259> lengthBits{};
+	std::array<std::uint8_t, 259> lengthBitCount{};
+
+	std::optional<deflate::DynamicHeader> header;
+};
+
+const FastCodes& fastCodes()
+{
+	static const FastCodes codes = []()
+	{
+		namespace Alphabet = deflate::Alphabet;
+
+		FastCodes codes;
+
+		std::array<std::uint32_t, Alphabet::LiteralCount> literalFrequencies{};
+		std::array<std::uint32_t, Alphabet::DistanceCount> distanceFrequencies{};
+
+		for (int literal = 0; literal < 256; literal++)
+		{
+			const auto residual = std::min(literal, 256 - literal);
+			literalFrequencies[literal] = 1 + 1'000'000 / ((residual + 2) * (residual + 2));
+		}
+
+		literalFrequencies[Alphabet::EndOfBlock] = 1;
+
+		for (std::size_t symbol = 0; symbol < Alphabet::Length.size(); symbol++)
+		{
+			literalFrequencies[Alphabet::LengthOffest + symbol] = 1 + 20'000 / (symbol + 1);
+		}
+
+		// Long runs of flat pixels
+		literalFrequencies[Alphabet::LengthOffest + Alphabet::Length.size() - 1] = 20'000;
+
+		for (std::size_t symbol = 0; symbol < Alphabet::Distance.size(); symbol++)
+		{
+			distanceFrequencies[symbol] = 50;
+		}
+
+		// One pixel back, for 3 and 4 byte pixels
+		distanceFrequencies[Alphabet::distanceSymbol(3)] = 10'000;
+		distanceFrequencies[Alphabet::distanceSymbol(4)] = 10'000;
+
+		deflate::buildCodeLengths(literalFrequencies, deflate::MaxCodeLength, codes.literalLengths);
+		deflate::buildCodeLengths(distanceFrequencies, deflate::MaxCodeLength, codes.distanceLengths);
+		deflate::buildCodes(codes.literalLengths, codes.literalCodes);
+		deflate::buildCodes(codes.distanceLengths, codes.distanceCodes);
+
+		for (std::size_t length = 3; length < codes.lengthBits.size(); length++)
+		{
+			const auto symbol = Alphabet::LengthSymbols[length];
+			const auto entry = Alphabet::Length[symbol];
+			const auto code = Alphabet::LengthOffest + symbol;
+
+			codes.lengthBits[length] = codes.literalCodes[code] | ((length - entry.baseLength) << codes.literalLengths[code]);
+			codes.lengthBitCount[length] = codes.literalLengths[code] + entry.extraBits;
+		}
+
+		codes.header.emplace(codes.literalLengths, codes.distanceLengths);
+
+		return codes;
+	}();
+
+	return codes;
+}
+
+// Deflates filtered rows in a single pass with the fast codes. Matches cover whole pixels and end within
+// their row, though they may start in an earlier one: either runs of the previous pixel, or the last earlier
+// occurrence of the same pixel value found through a hash table. The table is the caller's, so strips
+// compressed one after the other reuse its memory; it is cleared first, matches never reach before filtered.
+// filtered needs 4 readable bytes past its end. Without final the block is followed by an empty stored block,
+// a sync flush as with Deflater::compress
+void compressFastKernel(deflate::BitWriter& writer, const std::uint8_t* filtered, std::size_t rowCount, std::size_t rowLength, std::size_t bytePerPixel, bool final, std::vector<std::uint32_t>& table)
+{
+	namespace Alphabet = deflate::Alphabet;
+
+	const auto& codes = fastCodes();
+
+	constexpr std::size_t HashBits = 14;
+	table.assign(std::size_t(1) << HashBits, 0);
+
+	const std::uint32_t pixelMask = bytePerPixel >= 4 ? 0xFFFFFFFF : (1u << (8 * bytePerPixel)) - 1;
+	const auto loadPixel = [&](std::size_t pos)
+	{
+		std::uint32_t pixel;
+		std::memcpy(&pixel, filtered + pos, sizeof(pixel));
+		return pixel & pixelMask;
+	};
+
+	const auto writeLiteral = [&](std::uint8_t literal)
+	{
+		writer.writeBits(codes.literalCodes[literal], codes.literalLengths[literal]);
+	};
+
+	const auto writeMatch = [&](std::size_t length, std::size_t distance)
+	{
+		writer.writeBits(codes.lengthBits[length], codes.lengthBitCount[length]);
+
+		const auto symbol = Alphabet::distanceSymbol(distance);
+		const auto entry = Alphabet::Distance[symbol];
+		writer.writeBits(codes.distanceCodes[symbol] | ((distance - entry.baseLength) << codes.distanceLengths[symbol]), codes.distanceLengths[symbol] + entry.extraBits);
+	};
+
+	// Longest run of whole pixels, at most a maximal match
+	const auto pixelMatchLength = [&](std::size_t pos, std::size_t match, std::size_t remaining)
+	{
+		const auto length = deflate::matchLength(filtered + match, filtered + pos, std::min<std::size_t>(remaining, deflate::Deflater::MaxMatch));
+		return length - length % bytePerPixel;
+	};
+
+	codes.header->write(writer, final);
+
+	for (std::size_t y = 0; y < rowCount; y++)
+	{
+		const auto rowStart = y * (rowLength + 1);
+		writeLiteral(filtered[rowStart]);
+
+		const auto rowEnd = rowStart + 1 + rowLength;
+		for (auto pos = rowStart + 1; pos < rowEnd;)
+		{
+			const auto remaining = rowEnd - pos;
+			const auto pixel = loadPixel(pos);
+
+			if (pos >= rowStart + 1 + bytePerPixel && pixel == loadPixel(pos - bytePerPixel))
+			{
+				if (const auto length = pixelMatchLength(pos, pos - bytePerPixel, remaining); length >= deflate::Deflater::MinMatch)
+				{
+					writeMatch(length, bytePerPixel);
+					pos += length;
+					continue;
+				}
+			}
+
+			const auto hash = (pixel * 2654435761u) >> (32 - HashBits);
+			const auto candidate = table[hash];
+			table[hash] = std::uint32_t(pos + 1);
+
+			if (candidate && pos - (candidate - 1) < deflate::Deflater::WindowSize && loadPixel(candidate - 1) == pixel)
+			{
+				// A single pixel is cheaper as literals
+				if (const auto length = pixelMatchLength(pos, candidate - 1, remaining); length >= std::max(2 * bytePerPixel, deflate::Deflater::MinMatch))
+				{
+					writeMatch(length, pos - (candidate - 1));
+					pos += length;
+					continue;
+				}
+			}
+
+			for (std::size_t x = 0; x < bytePerPixel && pos < rowEnd; x++)
+			{
+				writeLiteral(filtered[pos++]);
+			}
+		}
+	}
+
+	writer.writeBits(codes.literalCodes[Alphabet::EndOfBlock], codes.literalLengths[Alphabet::EndOfBlock]);
+}
+
+CPU_KERNEL_VARIANTS(void, compressFast, compressFastKernel, (deflate::BitWriter& writer, const std::uint8_t* filtered, std::size_t rowCount, std::size_t rowLength, std::size_t bytePerPixel, bool final, std::vector<std::uint32_t>& table), (writer, filtered, rowCount, rowLength, bytePerPixel, final, table))
+
+void compressFast(deflate::BitWriter& writer, const std::uint8_t* filtered, std::size_t rowCount, std::size_t rowLength, std::size_t bytePerPixel, bool final, std::vector<std::uint32_t>& table)
+{
+	CPU_DISPATCH_VARIANTS(compressFast)(writer, filtered, rowCount, rowLength, bytePerPixel, final, table);
+
+	if (!final)
+	{
+		deflate::writeStoredBlocks(writer, {}, false);
+	}
+}
+
+// Open addressing set of up to MaxColors RGBA colours, numbering them in insertion order
+struct ColorTable
+{
+	static constexpr std::size_t MaxColors = 256;
+	static constexpr std::size_t SlotBits = 10;
+
+	std::array<std::uint32_t, 1 << SlotBits> keys{};
+	std::array<std::int16_t, 1 << SlotBits> indices = []()
+	{
+		std::array<std::int16_t, 1 << SlotBits> empty{};
+		std::fill(empty.begin(), empty.end(), -1);
+		return empty;
+	}();
+
+	std::vector<std::uint32_t> colors;
+	bool full = false;
+
+	static std::size_t slot(std::uint32_t color)
+	{
+		return (color * 2654435761u) >> (32 - SlotBits);
+	}
+
+	// Index of color, adding it when missing, or -1 when there was no room left
+	int insert(std::uint32_t color)
+	{
+		for (auto position = slot(color); ; position = (position + 1) % keys.size())
+		{
+			if (indices[position] < 0)
+			{
+				if (colors.size() == MaxColors)
+				{
+					full = true;
+					return -1;
+				}
+
+				keys[position] = color;
+				indices[position] = std::int16_t(colors.size());
+				colors.push_back(color);
+
+				return indices[position];
+			}
+			else if (keys[position] == color)
+			{
+				return indices[position];
+			}
+		}
+	}
+
+	int find(std::uint32_t color) const
+	{
+		for (auto position = slot(color); indices[position] >= 0; position = (position + 1) % keys.size())
+		{
+			if (keys[position] == color)
+			{
+				return indices[position];
+			}
+		}
+
+		return -1;
+	}
+};
+
+// Pixels are handled as R | G << 8 | B << 16 | A << 24 whatever the byte order of the machine
+std::uint32_t loadRgba(const std::uint8_t* pixel)
+{
+	return std::uint32_t(pixel[0]) | std::uint32_t(pixel[1]) << 8 | std::uint32_t(pixel[2]) << 16 | std::uint32_t(pixel[3]) << 24;
+}
+
+// What the pixels of an RGBA image need to be stored exactly
+struct ColorAnalysis
+{
+	bool opaque = true;
+	bool gray = true;
+
+	// Smallest bit depth holding every gray level exactly, when gray
+	std::uint8_t grayDepth = 1;
+
+	// Every distinct colour, unless the table is full
+	ColorTable colors;
+};
+
+// Checks opacity and grayness with bitwise reductions over blocks of pixels, which vectorize,
+// and counts colours over the same block while it is in cache
+void analyzeColorsKernel(const std::uint8_t* data, std::size_t pixelCount, ColorAnalysis& analysis)
+{
+	constexpr std::size_t BlockSize = 4096;
+
+	std::uint32_t alpha = 0xFF;
+	std::uint32_t colorDifference{};
+
+	// Non zero once a gray level doesn't repeat its top 4, 2 or 1 bits, so needs more bits than that
+	std::uint32_t beyond4{};
+	std::uint32_t beyond2{};
+	std::uint32_t beyond1{};
+
+	for (std::size_t begin = 0; begin < pixelCount; begin += BlockSize)
+	{
+		const auto end = std::min(pixelCount, begin + BlockSize);
+
+		for (auto x = begin; x < end; x++)
+		{
+			const auto pixel = loadRgba(data + 4 * x);
+			const auto level = pixel & 0xFF;
+
+			alpha &= pixel >> 24;
+			colorDifference |= (pixel ^ (pixel >> 8)) & 0xFFFF;
+
+			beyond4 |= (level >> 4) ^ (level & 0xF);
+			beyond2 |= (level >> 6) ^ ((level >> 4) & 0x3);
+			beyond1 |= (level >> 7) ^ ((level >> 6) & 0x1);
+		}
+
+		if (!analysis.colors.full)
+		{
+			std::uint32_t previous = ~loadRgba(data + 4 * begin);
+			for (auto x = begin; x < end && !analysis.colors.full; x++)
+			{
+				if (const auto pixel = loadRgba(data + 4 * x); pixel != previous)
+				{
+					analysis.colors.insert(pixel);
+					previous = pixel;
+				}
+			}
+		}
+
+		// Nothing left to find out
+		if (alpha != 0xFF && colorDifference && analysis.colors.full)
+		{
+			break;
+		}
+	}
+
+	analysis.opaque = alpha == 0xFF;
+	analysis.gray = colorDifference == 0;
+	analysis.grayDepth = beyond4 ? 8 : beyond2 ? 4 : beyond1 ? 2 : 1;
+}
+
+CPU_DISPATCHED_KERNEL(void, analyzeColors, analyzeColorsKernel, (const std::uint8_t* data, std::size_t pixelCount, ColorAnalysis& analysis), (data, pixelCount, analysis))
+
+// Colour type and bit depth of the written pixels, with the palette when colorType is 3
+struct PixelFormat
+{
+	std::uint8_t colorType = 6;
+	std::uint8_t depth = 8;
+	ColorTable palette;
+
+	int channels() const
+	{
+		return colorType == 0 || colorType == 3 ? 1 : colorType == 4 ? 2 : colorType == 2 ? 3 : 4;
+	}
+
+	int bitsPerPixel() const
+	{
+		return channels() * depth;
+	}
+};
+
+// The format with the fewest bits per pixel that holds every pixel exactly, preferring no palette on ties
+PixelFormat choosePixelFormat(const ColorAnalysis& analysis)
+{
+	PixelFormat format;
+
+	if (analysis.gray)
+	{
+		format.colorType = analysis.opaque ? 0 : 4;
+		format.depth = analysis.opaque ? analysis.grayDepth : 8;
+	}
+	else if (analysis.opaque)
+	{
+		format.colorType = 2;
+	}
+
+	if (analysis.colors.full)
+	{
+		return format;
+	}
+
+	const auto colorCount = analysis.colors.colors.size();
+	const std::uint8_t paletteDepth = colorCount <= 2 ? 1 : colorCount <= 4 ? 2 : colorCount <= 16 ? 4 : 8;
+
+	if (paletteDepth < format.bitsPerPixel())
+	{
+		format.colorType = 3;
+		format.depth = paletteDepth;
+
+		// Translucent colours first, so the tRNS chunk can leave out the opaque ones
+		auto colors = analysis.colors.colors;
+		std::stable_partition(colors.begin(), colors.end(), [](std::uint32_t color) { return color >> 24 != 0xFF; });
+
+		for (auto color : colors)
+		{
+			format.palette.insert(color);
+		}
+	}
+
+	return format;
+}
+
+// Writes one row of RGBA pixels in format, packing samples below 8 bits from the most significant bit
+void convertRow(const std::uint8_t* row, std::uint8_t* out, std::size_t width, const PixelFormat& format)
+{
+	if (format.depth < 8)
+	{
+		std::memset(out, 0, (width * format.depth + 7) / 8);
+
+		const int pixelPerByte = 8 / format.depth;
+
+		std::uint32_t previous = ~loadRgba(row);
+		int index{};
+
+		for (std::size_t x = 0; x < width; x++)
+		{
+			const auto pixel = loadRgba(row + 4 * x);
+
+			if (format.colorType == 0)
+			{
+				index = (pixel & 0xFF) >> (8 - format.depth);
+			}
+			else if (pixel != previous)
+			{
+				index = format.palette.find(pixel);
+				previous = pixel;
+			}
+
+			out[x / pixelPerByte] |= index << (8 - format.depth * (x % pixelPerByte + 1));
+		}
+	}
+	else if (format.colorType == 3)
+	{
+		std::uint32_t previous = ~loadRgba(row);
+		int index{};
+
+		for (std::size_t x = 0; x < width; x++)
+		{
+			if (const auto pixel = loadRgba(row + 4 * x); pixel != previous)
+			{
+				index = format.palette.find(pixel);
+				previous = pixel;
+			}
+
+			out[x] = std::uint8_t(index);
+		}
+	}
+	else if (format.colorType == 0)
+	{
+		for (std::size_t x = 0; x < width; x++)
+		{
+			out[x] = row[4 * x];
+		}
+	}
+	else if (format.colorType == 4)
+	{
+		for (std::size_t x = 0; x < width; x++)
+		{
+			out[2 * x] = row[4 * x];
+			out[2 * x + 1] = row[4 * x + 3];
+		}
+	}
+	else if (format.colorType == 2)
+	{
+		for (std::size_t x = 0; x < width; x++)
+		{
+			out[3 * x] = row[4 * x];
+			out[3 * x + 1] = row[4 * x + 1];
+			out[3 * x + 2] = row[4 * x + 2];
+		}
+	}
+	else
+	{
+		std::memcpy(out, row, 4 * width);
+	}
+}
+
+struct WriteOptions
+{
+	// 0 stores the pixels unfiltered and uncompressed, 1 to 9 trade speed for size like zlib levels.
+	// 10 searches for the smallest coding of the pixels, compressing around a hundred times slower than 9
+	int level = 6;
+
+	// Encodes an order of magnitude faster than level 1 for a somewhat larger file, ignoring level and
+	// reduceColors: 8 bit RGBA, Up filter on every row but the first, which uses Sub, and a single pass with
+	// fixed codes. Reducing would cost two more passes over the image and leave pixels too short to match whole
+	bool fast = false;
+
+	// How each row's filter is picked, unless level is 0 or fast is set
+	FilterStrategy filterStrategy = FilterStrategy::MinimumSum;
+
+	// Filter type of every row with FilterStrategy::Fixed, 0 to 4
+	std::uint8_t filter = 4;
+
+	// Writes the image with the fewest bits per pixel that keep every pixel exact: grayscale, without
+	// alpha, or with a palette, down to 1 bit per pixel. Otherwise, or with fast, every image is written as 8 bit RGBA
+	bool reduceColors = true;
+
+	// Largest IDAT chunk written
+	std::size_t idatSize = 1 << 20;
+
+	// Large images are filtered and compressed in strips of rows on this many threads, 0 meaning one
+	// per hardware thread. Each strip is compressed with the end of the previous one as history and ends on
+	// a sync flush, so the file grows by a few bytes a strip.
+	// Level 10 also looks for block splits and parses blocks on them
+	unsigned threadCount = 1;
+
+	// Filtered bytes per strip, about, 0 meaning the encoder's own: 4MiB for writePng, 256KiB for FrameEncoder.
+	// Small strips let tests join many of them on small images
+	std::size_t stripSize = 0;
+};
+
+using Sink = std::function<void(std::span<const std::uint8_t>)>;
+
+void writeChunk(const Sink& sink, std::string_view type, std::span<const std::uint8_t> data)
+{
+	const auto length = std::uint32_t(data.size());
+	const std::array<std::uint8_t, 8> header{ std::uint8_t(length >> 24), std::uint8_t(length >> 16), std::uint8_t(length >> 8), std::uint8_t(length),
+		std::uint8_t(type[0]), std::uint8_t(type[1]), std::uint8_t(type[2]), std::uint8_t(type[3]) };
+
+	const auto crc = deflate::crc32(data, deflate::crc32(std::span(header).subspan(4)));
+	const std::array<std::uint8_t, 4> trailer{ std::uint8_t(crc >> 24), std::uint8_t(crc >> 16), std::uint8_t(crc >> 8), std::uint8_t(crc) };
+
+	sink(header);
+	sink(data);
+	sink(trailer);
+}
+
+// Signature, IHDR and the palette chunks
+void writeHeader(const Sink& sink, std::uint32_t width, std::uint32_t height, const PixelFormat& format, bool interlace = false)
+{
+	std::array<std::uint8_t, 13> header{};
+	for (int x = 0; x < 4; x++)
+	{
+		header[x] = std::uint8_t(width >> (24 - 8 * x));
+		header[4 + x] = std::uint8_t(height >> (24 - 8 * x));
+	}
+
+	header[8] = format.depth;
+	header[9] = format.colorType;
+	header[12] = interlace;
+
+	sink(pngSignature);
+	writeChunk(sink, "IHDR", header);
+
+	if (format.colorType == 3)
+	{
+		std::vector<std::uint8_t> palette;
+		std::vector<std::uint8_t> transparency;
+
+		// tRNS ends at the last translucent colour, choosePixelFormat sorts them first to keep it short
+		for (std::size_t index = 0; index < format.palette.colors.size(); index++)
+		{
+			const auto color = format.palette.colors[index];
+			palette.insert(palette.end(), { std::uint8_t(color), std::uint8_t(color >> 8), std::uint8_t(color >> 16) });
+
+			if (color >> 24 != 0xFF)
+			{
+				transparency.resize(index + 1, 0xFF);
+				transparency[index] = std::uint8_t(color >> 24);
+			}
+		}
+
+		writeChunk(sink, "PLTE", palette);
+
+		if (!transparency.empty())
+		{
+			writeChunk(sink, "tRNS", transparency);
+		}
+	}
+}
+
+// Writes data as IDAT chunks of idatSize bytes and returns how much it wrote: everything with final,
+// otherwise only whole chunks
+std::size_t writeImageData(const Sink& sink, std::span<const std::uint8_t> data, std::size_t idatSize, bool final = true)
+{
+	idatSize = std::clamp<std::size_t>(idatSize, 1, INT32_MAX);
+
+	std::size_t offset{};
+	for (; data.size() - offset >= idatSize || (final && offset < data.size()); offset += std::min(idatSize, data.size() - offset))
+	{
+		writeChunk(sink, "IDAT", data.subspan(offset, std::min(idatSize, data.size() - offset)));
+	}
+
+	return offset;
+}
+
+// Filters one row into out, after its filter type byte, the way options ask for. The brute force
+// strategy compresses its candidates after the historySize filtered bytes just before out
+void filterRowWith(const WriteOptions& options, std::uint8_t* out, std::uint8_t* scratch, const std::uint8_t* row, const std::uint8_t* previous,
+	std::size_t rowLength, std::size_t bytePerPixel, std::size_t historySize, deflate::Deflater& deflater, deflate::BitWriter& trialWriter)
+{
+	if (options.fast)
+	{
+		out[0] = previous ? 2 : 1;
+		filterRow(out[0], out + 1, row, previous, rowLength, bytePerPixel);
+	}
+	else if (options.level == 0)
+	{
+		out[0] = 0;
+		std::memcpy(out + 1, row, rowLength);
+	}
+	else if (options.filterStrategy == FilterStrategy::Fixed)
+	{
+		out[0] = options.filter;
+		filterRow(out[0], out + 1, row, previous, rowLength, bytePerPixel);
+	}
+	else if (options.filterStrategy == FilterStrategy::BruteForce)
+	{
+		// Every row is compressed five times, which the optimal parse makes far too slow for what it changes in the choice
+		filterRowBruteForce(out, row, previous, rowLength, bytePerPixel, historySize, std::min(options.level, 9), deflater, trialWriter);
+	}
+	else
+	{
+		filterRowAdaptive(options.filterStrategy, out, scratch, row, previous, rowLength, bytePerPixel);
+	}
+}
+
+// Writes the RGBA pixels of image, the layout readPng produces, as a non interlaced PNG.
+// The deflater keeps its tables between calls, like the inflater when reading
+bool writePng(const Image& image, const Sink& sink, const WriteOptions& options, deflate::Deflater& deflater)
+{
+	if (image.width == 0 || image.height == 0 || image.width > INT32_MAX || image.height > INT32_MAX)
+	{
+		std::cerr << "Invalid image size" << std::endl;
+		return false;
+	}
+
+	if (image.data.size() != std::size_t(image.width) * image.height * 4)
+	{
+		std::cerr << "Image data doesn't match its size" << std::endl;
+		return false;
+	}
+
+	if (options.filter > 4)
+	{
+		std::cerr << "Invalid filter type" << std::endl;
+		return false;
+	}
+
+	PixelFormat format;
+	if (options.reduceColors && !options.fast)
+	{
+		ColorAnalysis analysis;
+		analyzeColors(image.data.data(), std::size_t(image.width) * image.height, analysis);
+
+		format = choosePixelFormat(analysis);
+	}
+
+	// Filters work on whole bytes, so pixels below 8 bits filter like a single byte
+	const auto bytePerPixel = std::max<std::size_t>(1, format.bitsPerPixel() / 8);
+	const auto rowLength = (std::size_t(image.width) * format.bitsPerPixel() + 7) / 8;
+
+	// Strips of about StripSize bytes are filtered and compressed on their own, the compressor still
+	// finding matches in the previous strip. A single strip goes through Deflater::deflate, which
+	// also handles data too large for the positions of a single compress call
+	constexpr std::size_t StripSize = 4 << 20;
+	constexpr std::size_t MaxStripSize = std::size_t(1) << 30;
+
+	const auto stripSize = options.stripSize ? options.stripSize : StripSize;
+	const auto stripRows = options.threadCount != 1 && rowLength < MaxStripSize ? std::max<std::size_t>(1, stripSize / (rowLength + 1)) : std::size_t(image.height);
+	const auto stripCount = (image.height + stripRows - 1) / stripRows;
+	const auto workerCount = parallel::workerCount(stripCount, options.threadCount);
+
+	// Pixels in any other format than RGBA are converted first, whole, so each strip has the row above its first
+	std::vector<std::uint8_t> convertedData;
+	const auto* pixels = image.data.data();
+
+	if (format.colorType != 6)
+	{
+		convertedData.resize(rowLength * image.height);
+		pixels = convertedData.data();
+
+		parallel::forEach(stripCount, options.threadCount, [&](std::size_t strip, unsigned)
+		{
+			const auto end = std::min<std::size_t>(image.height, (strip + 1) * stripRows);
+			for (auto y = strip * stripRows; y < end; y++)
+			{
+				convertRow(image.data.data() + y * image.width * 4, convertedData.data() + y * rowLength, image.width, format);
+			}
+		});
+	}
+
+	// Every row is preceded by its filter type. The padding lets the fast mode read whole pixels at the end
+	const auto filteredSize = (rowLength + 1) * image.height;
+	std::vector<std::uint8_t> filteredData(filteredSize + 4);
+	std::vector<std::vector<std::uint8_t>> scratch(workerCount, std::vector<std::uint8_t>(rowLength));
+	std::vector<deflate::Deflater> workerDeflaters(workerCount - 1);
+	std::vector<deflate::BitWriter> trialWriters(workerCount);
+	std::vector<std::vector<std::uint32_t>> fastTables(workerCount);
+
+	const auto deflaterFor = [&](unsigned worker) -> deflate::Deflater&
+	{
+		return worker == 0 ? deflater : workerDeflaters[worker - 1];
+	};
+
+	// Brute force trials only look back within the strip, since the previous one may still be filtering
+
+	parallel::forEach(stripCount, options.threadCount, [&](std::size_t strip, unsigned worker)
+	{
+		const auto stripBegin = strip * stripRows * (rowLength + 1);
+		const auto end = std::min<std::size_t>(image.height, (strip + 1) * stripRows);
+		for (auto y = strip * stripRows; y < end; y++)
+		{
+			const auto* row = pixels + y * rowLength;
+			const auto* previous = y > 0 ? row - rowLength : nullptr;
+			auto* out = filteredData.data() + y * (rowLength + 1);
+
+			const auto historySize = std::min(std::size_t(out - filteredData.data()) - stripBegin, bruteForceHistorySize);
+			filterRowWith(options, out, scratch[worker].data(), row, previous, rowLength, bytePerPixel, historySize, deflaterFor(worker), trialWriters[worker]);
+		}
+	});
+
+	const auto filtered = std::span(filteredData).first(filteredSize);
+
+	std::vector<std::uint8_t> compressedData;
+	if (stripCount == 1 && !options.fast)
+	{
+		// Only the optimal parse has threads of its own to use
+		deflater.threadCount = options.threadCount;
+		compressedData = deflater.deflate(filtered, options.level, deflate::Format::Zlib);
+	}
+	else
+	{
+		std::vector<deflate::BitWriter> strips(stripCount);
+		std::vector<std::uint32_t> checksums(stripCount);
+
+		parallel::forEach(stripCount, options.threadCount, [&](std::size_t strip, unsigned worker)
+		{
+			const auto begin = strip * stripRows * (rowLength + 1);
+			const auto rowCount = std::min<std::size_t>(stripRows, image.height - strip * stripRows);
+			const auto size = rowCount * (rowLength + 1);
+			const bool final = strip + 1 == stripCount;
+
+			auto& writer = strips[strip];
+			writer.data.reserve(size / 2 + 64);
+
+			if (options.fast)
+			{
+				compressFast(writer, filteredData.data() + begin, rowCount, rowLength, bytePerPixel, final, fastTables[worker]);
+			}
+			else
+			{
+				const auto history = std::min(begin, deflate::Deflater::WindowSize);
+				deflaterFor(worker).compress(writer, filtered.subspan(begin - history, size + history), history, options.level, final);
+			}
+
+			writer.alignToByte();
+			checksums[strip] = deflate::adler32(filtered.subspan(begin, size));
+		});
+
+		std::size_t compressedSize = 6;
+		for (const auto& strip : strips)
+		{
+			compressedSize += strip.data.size();
+		}
+
+		compressedData.reserve(compressedSize);
+
+		const auto zlibHeader = deflate::zlibHeader(options.fast ? 0 : options.level);
+		compressedData.insert(compressedData.end(), zlibHeader.begin(), zlibHeader.end());
+
+		std::uint32_t adler = 1;
+		for (std::size_t strip = 0; strip < stripCount; strip++)
+		{
+			compressedData.insert(compressedData.end(), strips[strip].data.begin(), strips[strip].data.end());
+
+			const auto rowCount = std::min<std::size_t>(stripRows, image.height - strip * stripRows);
+			adler = deflate::adler32Combine(adler, checksums[strip], rowCount * (rowLength + 1));
+		}
+
+		const auto zlibTrailer = deflate::zlibTrailer(adler);
+		compressedData.insert(compressedData.end(), zlibTrailer.begin(), zlibTrailer.end());
+	}
+
+	writeHeader(sink, image.width, image.height, format);
+
+	writeImageData(sink, compressedData, options.idatSize);
+	writeChunk(sink, "IEND", {});
+
+	return true;
+}
+
+bool writePng(const Image& image, const Sink& sink, const WriteOptions& options = {})
+{
+	deflate::Deflater deflater;
+	return writePng(image, sink, options, deflater);
+}
+
+bool writePng(const Image& image, std::ostream& stream, const WriteOptions& options = {})
+{
+	const auto written = writePng(image, [&](std::span<const std::uint8_t> data)
+	{
+		stream.write((const char*)data.data(), data.size());
+	}, options);
+
+	return written && stream;
+}
+
+// Adam7 passes: first column and row, then the step between columns and between rows
+constexpr std::uint32_t adam7StartX[]{ 0, 4, 0, 2, 0, 1, 0 };
+constexpr std::uint32_t adam7StartY[]{ 0, 0, 4, 0, 2, 0, 1 };
+constexpr std::uint32_t adam7StepX[]{ 8, 8, 4, 4, 2, 2, 1 };
+constexpr std::uint32_t adam7StepY[]{ 8, 8, 8, 4, 4, 2, 2 };
+
+// Encodes a PNG from rows handed over one at a time, top to bottom, already in format: samples packed high
+// bits first and 16 bit ones big endian, as the file holds them. Colours can't be reduced without seeing every
+// pixel first, so the format is the caller's, 8 bit RGBA by default. Interlaced images take the rows of every
+// Adam7 pass in turn, each holding only the pixels of its pass.
+// Each row is filtered against the previous one of its pass only, and compressed in pieces of PieceSize
+// bytes, so memory stays at a couple of rows, the piece and the deflate window whatever the image size.
+// Each piece is compressed with the end of the previous one as history and ends on a sync flush, which byte
+// aligns the output so IDAT chunks of WriteOptions::idatSize go to the sink as soon as they fill
+struct RowEncoder
+{
+	static constexpr std::size_t PieceSize = 256 << 10;
+
+	std::uint32_t width;
+	std::uint32_t height;
+	Sink sink;
+	WriteOptions options;
+	PixelFormat format;
+	bool interlace;
+
+	deflate::Deflater deflater;
+	deflate::BitWriter writer;
+	deflate::BitWriter trialWriter;
+
+	std::size_t bytePerPixel{};
+
+	// Pass the next rows belong to, 0 without interlacing, the length of its rows and how many are still to come
+	int pass = -1;
+	std::size_t rowLength{};
+	std::uint32_t passRowsLeft{};
+	bool firstRow = true;
+	std::vector<std::uint8_t> previousRow;
+	std::vector<std::uint8_t> scratch;
+	std::vector<std::uint32_t> fastTable;
+
+	// Filtered rows not compressed yet, after up to a window of the bytes already compressed
+	std::vector<std::uint8_t> filtered;
+	std::size_t historySize{};
+	std::uint32_t adler = 1;
+
+	bool failed = false;
+
+	RowEncoder(std::uint32_t width, std::uint32_t height, Sink sink, const WriteOptions& options = {}, const PixelFormat& format = {}, bool interlace = false)
+		: width(width), height(height), sink(std::move(sink)), options(options), format(format), interlace(interlace)
+	{
+		if (width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX)
+		{
+			std::cerr << "Invalid image size" << std::endl;
+			failed = true;
+			return;
+		}
+
+		if (options.filter > 4)
+		{
+			std::cerr << "Invalid filter type" << std::endl;
+			failed = true;
+			return;
+		}
+
+		const auto depth = format.depth;
+		const bool validFormat = format.colorType == 0 ? depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16
+			: format.colorType == 3 ? (depth == 1 || depth == 2 || depth == 4 || depth == 8) && !format.palette.colors.empty() && format.palette.colors.size() <= (1u << depth)
+			: (format.colorType == 2 || format.colorType == 4 || format.colorType == 6) && (depth == 8 || depth == 16);
+
+		if (!validFormat)
+		{
+			std::cerr << "Invalid pixel format" << std::endl;
+			failed = true;
+			return;
+		}
+
+		bytePerPixel = std::max(1, format.bitsPerPixel() / 8);
+		deflater.threadCount = options.threadCount;
+
+		writeHeader(this->sink, width, height, format, interlace);
+		writer.writeBytes(deflate::zlibHeader(options.fast ? 0 : options.level));
+
+		beginPass();
+	}
+
+	// Moves on to the next pass holding any pixels, returns false when there's none left.
+	// The fast mode only compresses rows of one length at a time, so a new pass ends its piece
+	bool beginPass()
+	{
+		const auto passSize = [](std::uint32_t size, std::uint32_t start, std::uint32_t step) -> std::uint32_t
+		{
+			return size > start ? (size - start + step - 1) / step : 0;
+		};
+
+		while (pass + 1 < (interlace ? 7 : 1))
+		{
+			pass++;
+
+			const auto passWidth = interlace ? passSize(width, adam7StartX[pass], adam7StepX[pass]) : width;
+			const auto passHeight = interlace ? passSize(height, adam7StartY[pass], adam7StepY[pass]) : height;
+
+			if (passWidth == 0 || passHeight == 0)
+			{
+				continue;
+			}
+
+			if (options.fast && filtered.size() > historySize)
+			{
+				compressPending(false);
+			}
+
+			rowLength = (std::size_t(passWidth) * format.bitsPerPixel() + 7) / 8;
+			passRowsLeft = passHeight;
+			firstRow = true;
+			previousRow.resize(rowLength);
+			scratch.resize(rowLength);
+
+			return true;
+		}
+
+		return false;
+	}
+
+	// Returns false once the encoder failed
+	bool writeRow(std::span<const std::uint8_t> row)
+	{
+		if (failed)
+		{
+			return false;
+		}
+
+		if (passRowsLeft == 0 && !beginPass())
+		{
+			std::cerr << "Too many rows" << std::endl;
+			failed = true;
+			return false;
+		}
+
+		if (row.size() != rowLength)
+		{
+			std::cerr << "Row doesn't match the image width" << std::endl;
+			failed = true;
+			return false;
+		}
+
+		const auto offset = filtered.size();
+		filtered.resize(offset + 1 + rowLength);
+
+		auto* out = filtered.data() + offset;
+		filterRowWith(options, out, scratch.data(), row.data(), firstRow ? nullptr : previousRow.data(), rowLength, bytePerPixel,
+			std::min(offset, bruteForceHistorySize), deflater, trialWriter);
+
+		adler = deflate::adler32(std::span(out, 1 + rowLength), adler);
+		std::memcpy(previousRow.data(), row.data(), rowLength);
+		firstRow = false;
+		passRowsLeft--;
+
+		if (filtered.size() - historySize >= PieceSize)
+		{
+			compressPending(false);
+		}
+
+		return true;
+	}
+
+	// Writes the rest of the image and IEND, returns false if rows are missing or the encoder failed
+	bool finish()
+	{
+		if (failed)
+		{
+			return false;
+		}
+
+		if (passRowsLeft != 0 || beginPass())
+		{
+			std::cerr << "Missing rows" << std::endl;
+			failed = true;
+			return false;
+		}
+
+		compressPending(true);
+		writeChunk(sink, "IEND", {});
+
+		// Nothing more can be written
+		failed = true;
+
+		return true;
+	}
+
+	void compressPending(bool final)
+	{
+		if (options.fast)
+		{
+			// The fast mode reads whole pixels, up to 4 bytes past the last row
+			const auto size = filtered.size();
+			filtered.resize(size + 4);
+
+			compressFast(writer, filtered.data() + historySize, (size - historySize) / (rowLength + 1), rowLength, bytePerPixel, final, fastTable);
+			filtered.resize(size);
+		}
+		else
+		{
+			deflater.compress(writer, filtered, historySize, options.level, final);
+		}
+
+		if (final)
+		{
+			writer.alignToByte();
+			writer.writeBytes(deflate::zlibTrailer(adler));
+		}
+
+		const auto written = writeImageData(sink, writer.data, options.idatSize, final);
+		writer.data.erase(writer.data.begin(), writer.data.begin() + written);
+
+		const auto kept = std::min(filtered.size(), deflate::Deflater::WindowSize);
+		filtered.erase(filtered.begin(), filtered.end() - kept);
+		historySize = kept;
+	}
+};
+
+// Whether size bytes at a and b differ. Blocks are or-reduced whole before the only branch, which
+// the compiler turns into a few vector compares per block
+bool bytesDifferKernel(const std::uint8_t* a, const std::uint8_t* b, std::size_t size)
+{
+	constexpr std::size_t Block = 256;
+
+	std::size_t x = 0;
+	for (; x + Block <= size; x += Block)
+	{
+		std::uint8_t difference{};
+		for (std::size_t k = 0; k < Block; k++)
+		{
+			difference |= a[x + k] ^ b[x + k];
+		}
+
+		if (difference)
+		{
+			return true;
+		}
+	}
+
+	std::uint8_t difference{};
+	for (; x < size; x++)
+	{
+		difference |= a[x] ^ b[x];
+	}
+
+	return difference != 0;
+}
+
+CPU_DISPATCHED_KERNEL(bool, bytesDiffer, bytesDifferKernel, (const std::uint8_t* a, const std::uint8_t* b, std::size_t size), (a, b, size))
+
+// Encodes a sequence of frames of one size, such as screen captures, re-encoding only the strips of rows
+// that changed since the previous frame. Strips of about StripSize filtered bytes are compressed without
+// history and end on full flushes, so the compressed bytes of a strip stay valid as long as its rows and
+// the row above it, which its first row is filtered against, are unchanged. Frames are written as 8 bit RGBA,
+// since reducing colours would change every strip whenever the colours of one strip do
+struct FrameEncoder
+{
+	static constexpr std::size_t BytePerPixel = 4;
+	static constexpr std::size_t StripSize = 256 << 10;
+
+	std::uint32_t width;
+	std::uint32_t height;
+	WriteOptions options;
+
+	std::size_t rowLength{};
+	std::size_t stripRows{};
+	std::size_t stripCount{};
+
+	// Pixels of the previous frame, and the compressed bytes and checksum of each of its strips
+	std::vector<std::uint8_t> previousFrame;
+	std::vector<std::vector<std::uint8_t>> strips;
+	std::vector<std::uint32_t> checksums;
+	bool hasPrevious = false;
+
+	std::vector<deflate::Deflater> deflaters;
+	std::vector<deflate::BitWriter> writers;
+	std::vector<deflate::BitWriter> trialWriters;
+	std::vector<std::vector<std::uint8_t>> filtered;
+	std::vector<std::vector<std::uint8_t>> scratch;
+	std::vector<std::vector<std::uint32_t>> fastTables;
+
+	// Strips the last frame re-encoded
+	std::size_t changedStrips{};
+
+	bool failed = false;
+
+	FrameEncoder(std::uint32_t width, std::uint32_t height, const WriteOptions& options = {})
+		: width(width), height(height), options(options)
+	{
+		if (width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX)
+		{
+			std::cerr << "Invalid image size" << std::endl;
+			failed = true;
+			return;
+		}
+
+		if (options.filter > 4)
+		{
+			std::cerr << "Invalid filter type" << std::endl;
+			failed = true;
+			return;
+		}
+
+		rowLength = std::size_t(width) * BytePerPixel;
+		stripRows = std::max<std::size_t>(1, (options.stripSize ? options.stripSize : StripSize) / (rowLength + 1));
+		stripCount = (height + stripRows - 1) / stripRows;
+
+		previousFrame.resize(rowLength * height);
+		strips.resize(stripCount);
+		checksums.resize(stripCount);
+
+		const auto workerCount = parallel::workerCount(stripCount, options.threadCount);
+		deflaters.resize(workerCount);
+		writers.resize(workerCount);
+		trialWriters.resize(workerCount);
+		fastTables.resize(workerCount);
+
+		// The padding lets the fast mode read whole pixels at the end
+		const auto rowCount = std::min<std::size_t>(stripRows, height);
+		filtered.resize(workerCount, std::vector<std::uint8_t>(rowCount * (rowLength + 1) + 4));
+		scratch.resize(workerCount, std::vector<std::uint8_t>(rowLength));
+	}
+
+	// Writes frame as a whole PNG, returns false if it doesn't match the encoder size or the encoder failed
+	bool encode(const Image& frame, const Sink& sink)
+	{
+		if (failed)
+		{
+			return false;
+		}
+
+		if (frame.width != width || frame.height != height || frame.data.size() != previousFrame.size())
+		{
+			std::cerr << "Frame doesn't match the encoder size" << std::endl;
+			return false;
+		}
+
+		const auto* pixels = frame.data.data();
+
+		std::vector<std::size_t> changed;
+		for (std::size_t strip = 0; strip < stripCount; strip++)
+		{
+			const auto first = strip * stripRows;
+			const auto end = std::min<std::size_t>(height, first + stripRows);
+			const auto from = first > 0 ? first - 1 : first;
+
+			if (!hasPrevious || bytesDiffer(pixels + from * rowLength, previousFrame.data() + from * rowLength, (end - from) * rowLength))
+			{
+				changed.push_back(strip);
+			}
+		}
+
+		parallel::forEach(changed.size(), options.threadCount, [&](std::size_t index, unsigned worker)
+		{
+			const auto strip = changed[index];
+			const auto first = strip * stripRows;
+			const auto rowCount = std::min<std::size_t>(stripRows, height - first);
+			const auto size = rowCount * (rowLength + 1);
+
+			auto* out = filtered[worker].data();
+			for (std::size_t y = 0; y < rowCount; y++)
+			{
+				const auto* row = pixels + (first + y) * rowLength;
+				const auto* previous = first + y > 0 ? row - rowLength : nullptr;
+				const auto offset = y * (rowLength + 1);
+
+				filterRowWith(options, out + offset, scratch[worker].data(), row, previous, rowLength, BytePerPixel,
+					std::min(offset, bruteForceHistorySize), deflaters[worker], trialWriters[worker]);
+			}
+
+			auto& writer = writers[worker];
+			writer.data.clear();
+
+			if (options.fast)
+			{
+				compressFast(writer, out, rowCount, rowLength, BytePerPixel, false, fastTables[worker]);
+			}
+			else
+			{
+				deflaters[worker].compress(writer, std::span(out, size), 0, options.level, false);
+			}
+
+			writer.alignToByte();
+			strips[strip].assign(writer.data.begin(), writer.data.end());
+			checksums[strip] = deflate::adler32(std::span(out, size));
+
+			std::memcpy(previousFrame.data() + first * rowLength, pixels + first * rowLength, rowCount * rowLength);
+		});
+
+		hasPrevious = true;
+		changedStrips = changed.size();
+
+		// Every strip ends on a full flush, an empty block with fixed codes ends the stream
+		std::vector<std::uint8_t> compressedData;
+		const auto zlibHeader = deflate::zlibHeader(options.fast ? 0 : options.level);
+		compressedData.insert(compressedData.end(), zlibHeader.begin(), zlibHeader.end());
+
+		std::uint32_t adler = 1;
+		for (std::size_t strip = 0; strip < stripCount; strip++)
+		{
+			compressedData.insert(compressedData.end(), strips[strip].begin(), strips[strip].end());
+
+			const auto rowCount = std::min<std::size_t>(stripRows, height - strip * stripRows);
+			adler = deflate::adler32Combine(adler, checksums[strip], rowCount * (rowLength + 1));
+		}
+
+		deflate::BitWriter end;
+		end.writeBits(1, 1);
+		end.writeBits(1, 2);
+		end.writeBits(0, 7);
+		end.alignToByte();
+		compressedData.insert(compressedData.end(), end.data.begin(), end.data.end());
+
+		const auto zlibTrailer = deflate::zlibTrailer(adler);
+		compressedData.insert(compressedData.end(), zlibTrailer.begin(), zlibTrailer.end());
+
+		writeHeader(sink, width, height, PixelFormat{});
+		writeImageData(sink, compressedData, options.idatSize);
+		writeChunk(sink, "IEND", {});
+
+		return true;
+	}
+};
+
+// Chunks of a PNG file held in memory, up to IEND
+std::optional<std::vector<PngChunk>> readChunks(std::span<const std::uint8_t> file)
+{
+	if (file.size() < pngSignature.size() || !std::equal(pngSignature.begin(), pngSignature.end(), file.begin()))
+	{
+		std::cerr << "Incorrect file header" << std::endl;
+		return std::nullopt;
+	}
+
+	const auto readUint32 = [&](std::size_t offset)
+	{
+		return std::uint32_t(file[offset]) << 24 | std::uint32_t(file[offset + 1]) << 16 | std::uint32_t(file[offset + 2]) << 8 | file[offset + 3];
+	};
+
+	std::vector<PngChunk> chunks;
+	std::size_t offset = pngSignature.size();
+
+	while (chunks.empty() || chunks.back().type != "IEND")
+	{
+		// Length, type and CRC
+		constexpr std::size_t ChunkOverhead = 12;
+
+		if (file.size() - offset < ChunkOverhead || readUint32(offset) > std::min<std::size_t>(INT32_MAX, file.size() - offset - ChunkOverhead))
+		{
+			std::cerr << "Truncated chunk" << std::endl;
+			return std::nullopt;
+		}
+
+		const auto length = readUint32(offset);
+		const auto data = file.subspan(offset + 8, length);
+
+		auto& chunk = chunks.emplace_back();
+		chunk.length = std::int32_t(length);
+		std::copy_n(file.begin() + offset + 4, 4, chunk.type.bytes.begin());
+		chunk.data.assign(data.begin(), data.end());
+		chunk.crc = std::int32_t(readUint32(offset + 8 + length));
+
+		offset += ChunkOverhead + length;
+	}
+
+	return chunks;
+}
+
+// Ancillary chunks that stay valid whatever the pixel format: the colour space chunks, which describe
+// the samples rather than their encoding, and those marked safe to copy by a lowercase fourth letter
+bool keepsMeaningWhenReencoded(const PngChunkType& type)
+{
+	static constexpr std::string_view colorSpaceChunks[]{ "gAMA", "cHRM", "sRGB", "iCCP", "cICP", "mDCV", "cLLI" };
+
+	const bool ancillary = type.bytes[0] & 0x20;
+	const bool safeToCopy = type.bytes[3] & 0x20;
+
+	return ancillary && (safeToCopy || std::ranges::find(colorSpaceChunks, type.toStr()) != std::end(colorSpaceChunks));
+}
+
+// Levels 8 and 9 with every filter strategy, then level 10, by far the slowest, with the two adaptive ones
+std::vector<WriteOptions> defaultOptimizeTrials()
+{
+	std::vector<WriteOptions> trials;
+
+	for (int level : { 8, 9 })
+	{
+		for (std::uint8_t filter = 0; filter < 5; filter++)
+		{
+			trials.push_back({ .level = level, .filterStrategy = FilterStrategy::Fixed, .filter = filter });
+		}
+
+		trials.push_back({ .level = level, .filterStrategy = FilterStrategy::MinimumSum });
+		trials.push_back({ .level = level, .filterStrategy = FilterStrategy::Entropy });
+	}
+
+	trials.push_back({ .level = 9, .filterStrategy = FilterStrategy::BruteForce });
+
+	trials.push_back({ .level = 10, .filterStrategy = FilterStrategy::MinimumSum });
+	trials.push_back({ .level = 10, .filterStrategy = FilterStrategy::Entropy });
+
+	// Palette indices filter poorly, so a photo with few colours may still be smaller as RGB
+	trials.push_back({ .level = 9, .filterStrategy = FilterStrategy::Fixed, .reduceColors = false });
+	trials.push_back({ .level = 9, .filterStrategy = FilterStrategy::MinimumSum, .reduceColors = false });
+
+	return trials;
+}
+
+struct OptimizeOptions
+{
+	// Encoder settings to try, the smallest file decoding to the same pixels wins
+	std::vector<WriteOptions> trials = defaultOptimizeTrials();
+
+	// Trials run in parallel on this many threads, 0 meaning one per hardware thread
+	unsigned threadCount = 0;
+};
+
+// Re-encodes a PNG file with every trial setting and returns the smallest result, or the input itself
+// when nothing beats it. Candidates are decoded again and only kept when their pixels match the input's.
+// Critical chunks are not kept: a candidate carries the IHDR, PLTE and tRNS writePng wrote for it, with
+// colour type and bit depth reduced when the pixels allow it (see WriteOptions::reduceColors) and without
+// interlacing. Only the input itself is returned with its own. Ancillary chunks that keep their meaning
+// are copied over unchanged, on the same side of the image data, except iCCP when the colour type moved
+// between gray and colour.
+// 16 bit and animated images are returned as they are, since readPng only keeps 8 bits of the first frame
+std::optional<std::vector<std::uint8_t>> optimize(std::span<const std::uint8_t> input, const OptimizeOptions& options = {})
+{
+	const auto chunks = readChunks(input);
+	if (!chunks)
+	{
+		return std::nullopt;
+	}
+
+	const auto pngInfo = readHeaderChunk(chunks->front());
+	if (!pngInfo)
+	{
+		return std::nullopt;
+	}
+
+	const auto original = std::vector<std::uint8_t>(input.begin(), input.end());
+
+	if (pngInfo->depth == 16 || std::ranges::any_of(*chunks, [](const PngChunk& chunk) { return chunk.type == "acTL"; }))
+	{
+		return original;
+	}
+
+	const auto decode = [](std::span<const std::uint8_t> file)
+	{
+		std::ispanstream stream(std::span<const char>((const char*)file.data(), file.size()));
+		return readPng(stream);
+	};
+
+	const auto image = decode(input);
+	if (!image)
+	{
+		return std::nullopt;
+	}
+
+	std::vector<const PngChunk*> chunksBefore;
+	std::vector<const PngChunk*> chunksAfter;
+	bool imageDataSeen = false;
+
+	for (const auto& chunk : *chunks)
+	{
+		imageDataSeen = imageDataSeen || chunk.type == "IDAT";
+
+		if (keepsMeaningWhenReencoded(chunk.type))
+		{
+			(imageDataSeen ? chunksAfter : chunksBefore).push_back(&chunk);
+		}
+	}
+
+	std::vector<std::uint8_t> best = original;
+	std::mutex bestMutex;
+
+	std::vector<deflate::Deflater> deflaters(parallel::workerCount(options.trials.size(), options.threadCount));
+
+	parallel::forEach(options.trials.size(), options.threadCount, [&](std::size_t trial, unsigned worker)
+	{
+		auto trialOptions = options.trials[trial];
+		trialOptions.threadCount = 1;
+
+		std::vector<std::uint8_t> encoded;
+		if (!writePng(*image, [&](std::span<const std::uint8_t> data) { encoded.insert(encoded.end(), data.begin(), data.end()); }, trialOptions, deflaters[worker]))
+		{
+			return;
+		}
+
+		const auto encodedChunks = readChunks(encoded);
+		if (!encodedChunks)
+		{
+			return;
+		}
+
+		std::vector<std::uint8_t> file;
+		const Sink sink = [&](std::span<const std::uint8_t> data)
+		{
+			file.insert(file.end(), data.begin(), data.end());
+		};
+
+		sink(pngSignature);
+
+		// An ICC profile is either for gray or for colour images, so it can't follow the pixels from one to the other
+		const auto gray = [](std::uint8_t colorType) { return !(colorType & 2); };
+		const bool profileFits = gray(pngInfo->colorType) == gray(encodedChunks->front().data[9]);
+
+		const auto writeChunks = [&](const auto& chunkList)
+		{
+			for (const PngChunk* chunk : chunkList)
+			{
+				if (chunk->type != "iCCP" || profileFits)
+				{
+					writeChunk(sink, chunk->type, chunk->data);
+				}
+			}
+		};
+
+		for (const auto& chunk : *encodedChunks)
+		{
+			if (chunk.type == "IHDR")
+			{
+				writeChunk(sink, chunk.type, chunk.data);
+				writeChunks(chunksBefore);
+			}
+			else if (chunk.type == "IEND")
+			{
+				writeChunks(chunksAfter);
+				writeChunk(sink, chunk.type, chunk.data);
+			}
+			else
+			{
+				writeChunk(sink, chunk.type, chunk.data);
+			}
+		}
+
+		{
+			std::lock_guard lock(bestMutex);
+			if (file.size() >= best.size())
+			{
+				return;
+			}
+		}
+
+		const auto decoded = decode(file);
+		if (!decoded || decoded->width != image->width || decoded->height != image->height || decoded->data != image->data)
+		{
+			std::cerr << "Optimized image doesn't match the original" << std::endl;
+			return;
+		}
+
+		std::lock_guard lock(bestMutex);
+		if (file.size() < best.size())
+		{
+			best = std::move(file);
+		}
+	});
 
-	return Image{ pngInfo->width, pngInfo->height, std::move(imageData) };
+	return best;
 }
 
 }
\ No newline at end of file
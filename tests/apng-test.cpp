@@ -0,0 +1,325 @@
+#include "../src/png.hpp"
+#include "check.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <spanstream>
+#include <string>
+
+// Animated PNGs built here frame by frame, read with ApngReader and checked after every frame against
+// a canvas composited pixel by pixel. A first frame not covering the canvas is rejected. Still images must read as
+// a single frame equal to readPng's image
+namespace
+{
+
+constexpr std::uint32_t Width = 24;
+constexpr std::uint32_t Height = 20;
+
+struct TestFrame
+{
+	png::Image pixels;
+	std::uint32_t x{};
+	std::uint32_t y{};
+	std::uint8_t dispose{};
+	std::uint8_t blend{};
+};
+
+// Opaque pixels of varying colour, with a column of transparent ones and a column at half alpha
+png::Image makePixels(std::uint32_t width, std::uint32_t height, std::uint8_t seed)
+{
+	png::Image image{ width, height, std::vector<std::uint8_t>(std::size_t(width) * height * 4) };
+
+	for (std::uint32_t y = 0; y < height; y++)
+	{
+		for (std::uint32_t x = 0; x < width; x++)
+		{
+			auto* pixel = image.data.data() + (std::size_t(y) * width + x) * 4;
+			pixel[0] = std::uint8_t(seed + x * 9);
+			pixel[1] = std::uint8_t(seed * 3 + y * 11);
+			pixel[2] = std::uint8_t(seed ^ (x * y));
+			pixel[3] = x == 1 ? 0 : x == 2 ? 128 : 255;
+		}
+	}
+
+	return image;
+}
+
+void appendUint32(std::vector<std::uint8_t>& data, std::uint32_t value)
+{
+	data.insert(data.end(), { std::uint8_t(value >> 24), std::uint8_t(value >> 16), std::uint8_t(value >> 8), std::uint8_t(value) });
+}
+
+// Unfiltered rows of image as a zlib stream
+std::vector<std::uint8_t> compressPixels(const png::Image& image)
+{
+	std::vector<std::uint8_t> filtered;
+
+	for (std::uint32_t y = 0; y < image.height; y++)
+	{
+		const auto row = std::span(image.data).subspan(std::size_t(y) * image.width * 4, std::size_t(image.width) * 4);
+
+		filtered.push_back(0);
+		filtered.insert(filtered.end(), row.begin(), row.end());
+	}
+
+	return deflate::deflate(filtered);
+}
+
+// An 8 bit RGBA APNG of frames. The first frame is the default image unless a hidden one is given,
+// which then comes as IDAT before any frame control and isn't part of the animation
+std::vector<std::uint8_t> makeApng(const std::vector<TestFrame>& frames, const png::Image* hidden = nullptr)
+{
+	std::vector<std::uint8_t> file;
+	const png::Sink sink = [&](std::span<const std::uint8_t> data) { file.insert(file.end(), data.begin(), data.end()); };
+
+	png::writeHeader(sink, Width, Height, png::PixelFormat{});
+
+	std::vector<std::uint8_t> animationControl;
+	appendUint32(animationControl, std::uint32_t(frames.size()));
+	appendUint32(animationControl, 0);
+	png::writeChunk(sink, "acTL", animationControl);
+
+	if (hidden)
+	{
+		png::writeChunk(sink, "IDAT", compressPixels(*hidden));
+	}
+
+	std::uint32_t sequence{};
+
+	for (std::size_t index = 0; index < frames.size(); index++)
+	{
+		const auto& frame = frames[index];
+
+		std::vector<std::uint8_t> frameControl;
+		appendUint32(frameControl, sequence++);
+		appendUint32(frameControl, frame.pixels.width);
+		appendUint32(frameControl, frame.pixels.height);
+		appendUint32(frameControl, frame.x);
+		appendUint32(frameControl, frame.y);
+		frameControl.insert(frameControl.end(), { 0, 1, 0, 10, frame.dispose, frame.blend });
+		png::writeChunk(sink, "fcTL", frameControl);
+
+		const auto compressed = compressPixels(frame.pixels);
+
+		if (index == 0 && !hidden)
+		{
+			png::writeChunk(sink, "IDAT", compressed);
+			continue;
+		}
+
+		// Split over two fdAT chunks, which the reader has to join
+		const auto half = compressed.size() / 2;
+		for (const auto part : { std::span(compressed).first(half), std::span(compressed).subspan(half) })
+		{
+			std::vector<std::uint8_t> frameData;
+			appendUint32(frameData, sequence++);
+			frameData.insert(frameData.end(), part.begin(), part.end());
+			png::writeChunk(sink, "fdAT", frameData);
+		}
+	}
+
+	png::writeChunk(sink, "IEND", {});
+
+	return file;
+}
+
+std::uint8_t* canvasPixel(png::Image& canvas, std::uint32_t x, std::uint32_t y)
+{
+	return canvas.data.data() + (std::size_t(y) * canvas.width + x) * 4;
+}
+
+// Composites frames one after the other the way the APNG specification describes it, calling check
+// with the canvas as shown after each frame
+template<typename F>
+void compositeReference(const std::vector<TestFrame>& frames, F&& check)
+{
+	png::Image canvas{ Width, Height, std::vector<std::uint8_t>(std::size_t(Width) * Height * 4) };
+
+	for (std::size_t index = 0; index < frames.size(); index++)
+	{
+		const auto& frame = frames[index];
+		const auto before = canvas;
+
+		for (std::uint32_t y = 0; y < frame.pixels.height; y++)
+		{
+			for (std::uint32_t x = 0; x < frame.pixels.width; x++)
+			{
+				const auto* source = frame.pixels.data.data() + (std::size_t(y) * frame.pixels.width + x) * 4;
+				auto* destination = canvasPixel(canvas, frame.x + x, frame.y + y);
+
+				if (frame.blend == 0)
+				{
+					std::memcpy(destination, source, 4);
+				}
+				else if (source[3] != 0)
+				{
+					// Porter-Duff over with colours that aren't premultiplied
+					const auto sourceAlpha = source[3] / 255.0;
+					const auto destinationAlpha = destination[3] / 255.0 * (1 - sourceAlpha);
+					const auto alpha = sourceAlpha + destinationAlpha;
+
+					for (int channel = 0; channel < 3; channel++)
+					{
+						destination[channel] = std::uint8_t((source[channel] * sourceAlpha + destination[channel] * destinationAlpha) / alpha + 0.5);
+					}
+
+					destination[3] = std::uint8_t(alpha * 255 + 0.5);
+				}
+			}
+		}
+
+		check(index, canvas);
+
+		// Restoring before the first frame means clearing, the canvas starting out transparent black
+		const auto dispose = index == 0 && frame.dispose == 2 ? 1 : frame.dispose;
+
+		for (std::uint32_t y = 0; y < frame.pixels.height; y++)
+		{
+			for (std::uint32_t x = 0; x < frame.pixels.width; x++)
+			{
+				auto* pixel = canvasPixel(canvas, frame.x + x, frame.y + y);
+
+				if (dispose == 1)
+				{
+					std::memset(pixel, 0, 4);
+				}
+				else if (dispose == 2)
+				{
+					std::memcpy(pixel, before.data.data() + (std::size_t(frame.y + y) * Width + frame.x + x) * 4, 4);
+				}
+			}
+		}
+	}
+}
+
+// The reader blends in integers, rounding down, so partially transparent pixels may be one off
+bool closeTo(const std::vector<std::uint8_t>& actual, const std::vector<std::uint8_t>& expected)
+{
+	return actual.size() == expected.size() && std::ranges::equal(actual, expected, [](int a, int b) { return std::abs(a - b) <= 1; });
+}
+
+void testAnimation(const std::string& name, const std::vector<TestFrame>& frames, bool hiddenDefaultImage = false)
+{
+	const auto hidden = makePixels(Width, Height, 200);
+	const auto file = makeApng(frames, hiddenDefaultImage ? &hidden : nullptr);
+
+	std::ispanstream stream(std::span((const char*)file.data(), file.size()));
+	png::ApngReader reader(stream);
+
+	test::check(!reader.failed && reader.frameCount == frames.size(), name + ": animation read");
+
+	compositeReference(frames, [&](std::size_t index, const png::Image& expected)
+	{
+		const auto what = name + ", frame " + std::to_string(index);
+
+		test::check(reader.nextFrame(), what + " decoded");
+		test::check(closeTo(reader.canvas.data, expected.data), what + " composited");
+	});
+
+	test::check(!reader.nextFrame() && !reader.failed, name + ": ends after the last frame");
+}
+
+// A full first frame, then frames over parts of it, two of which overlap
+std::vector<TestFrame> makeFrames(std::uint8_t dispose, std::uint8_t blend)
+{
+	std::vector<TestFrame> frames;
+
+	// An opaque background, so the first frame leaves no transparent pixels to show through
+	auto background = makePixels(Width, Height, 7);
+	for (std::size_t pixel = 3; pixel < background.data.size(); pixel += 4)
+	{
+		background.data[pixel] = 255;
+	}
+
+	frames.push_back({ std::move(background), 0, 0, dispose, 0 });
+	frames.push_back({ makePixels(8, 6, 40), 3, 2, dispose, blend });
+	frames.push_back({ makePixels(10, 9, 90), 6, 5, dispose, blend });
+	frames.push_back({ makePixels(5, 5, 130), Width - 5, Height - 5, dispose, blend });
+	frames.push_back({ makePixels(1, 1, 170), 0, Height - 1, dispose, blend });
+
+	return frames;
+}
+
+// A first frame smaller than the canvas or away from its corner fails the reader before any frame is shown
+void testPartialFirstFrame(const std::string& name, TestFrame first)
+{
+	auto frames = makeFrames(0, 0);
+	frames[0] = std::move(first);
+
+	const auto file = makeApng(frames);
+	std::ispanstream stream(std::span((const char*)file.data(), file.size()));
+	png::ApngReader reader(stream);
+
+	std::cerr.setstate(std::ios::failbit);
+	const bool decoded = reader.nextFrame();
+	std::cerr.clear();
+
+	test::check(!decoded && reader.failed, name + ": rejected");
+}
+
+void testStillImages()
+{
+	int images = 0;
+
+	for (const auto& entry : std::filesystem::directory_iterator(TEST_FILES_DIR))
+	{
+		if (entry.path().extension() != ".png")
+		{
+			continue;
+		}
+
+		std::ifstream stillStream(entry.path(), std::ios::binary);
+
+		std::cerr.setstate(std::ios::failbit);
+		const auto image = png::readPng(stillStream);
+		std::cerr.clear();
+
+		if (!image)
+		{
+			continue;
+		}
+
+		images++;
+
+		std::ifstream stream(entry.path(), std::ios::binary);
+		png::ApngReader reader(stream);
+
+		const auto what = entry.path().filename().string();
+
+		test::check(!reader.animated && reader.frameCount == 1, what + " reads as a single frame");
+		test::check(reader.nextFrame() && reader.canvas.width == image->width && reader.canvas.height == image->height
+			&& reader.canvas.data == image->data, what + " frame matches readPng");
+		test::check(!reader.nextFrame() && !reader.failed, what + " ends after its frame");
+	}
+
+	test::check(images > 0, "PngSuite images found in " TEST_FILES_DIR);
+}
+
+}
+
+int main()
+{
+	testAnimation("dispose none, blend source", makeFrames(0, 0));
+	testAnimation("dispose none, blend over", makeFrames(0, 1));
+	testAnimation("dispose background, blend source", makeFrames(1, 0));
+	testAnimation("dispose background, blend over", makeFrames(1, 1));
+	testAnimation("dispose previous, blend source", makeFrames(2, 0));
+	testAnimation("dispose previous, blend over", makeFrames(2, 1));
+
+	auto mixed = makeFrames(0, 1);
+	mixed[1].dispose = 2;
+	mixed[2].dispose = 1;
+	mixed[3].blend = 0;
+	testAnimation("mixed dispose and blend", mixed);
+
+	testAnimation("hidden default image", makeFrames(0, 1), true);
+
+	testPartialFirstFrame("first frame smaller than the canvas", { makePixels(Width - 1, Height, 7) });
+	testPartialFirstFrame("first frame away from the corner", { makePixels(Width - 2, Height - 2, 7), 1, 1 });
+
+	testStillImages();
+
+	return test::failures;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <iostream>
+#include <string_view>
+
+// Tests are plain programs: every failed check is printed and main returns the failure count,
+// so ctest, and the build which runs each test once it's linked, see a non-zero exit
+namespace test
+{
+
+inline int failures = 0;
+
+inline void check(bool passed, std::string_view what)
+{
+	if (!passed)
+	{
+		std::cerr << "FAILED: " << what << std::endl;
+		failures++;
+	}
+}
+
+}
@@ -0,0 +1,151 @@
+#include "../src/png.hpp"
+#include "check.hpp"
+
+#include <spanstream>
+#include <string>
+
+// A sequence of frames changing in small rectangles, fully, or not at all, encoded with FrameEncoder.
+// Every emitted file must decode to its source frame, whichever strips were reused from earlier frames
+namespace
+{
+
+constexpr std::uint32_t Width = 67;
+constexpr std::uint32_t Height = 53;
+
+png::Image makeFrame(std::uint32_t seed)
+{
+	png::Image frame{ Width, Height, std::vector<std::uint8_t>(std::size_t(Width) * Height * 4) };
+
+	for (std::uint32_t y = 0; y < Height; y++)
+	{
+		for (std::uint32_t x = 0; x < Width; x++)
+		{
+			auto* pixel = frame.data.data() + (std::size_t(y) * Width + x) * 4;
+			pixel[0] = std::uint8_t(x * 3 + seed);
+			pixel[1] = std::uint8_t(y * 5);
+			pixel[2] = std::uint8_t((x ^ y) + seed * 7);
+			pixel[3] = std::uint8_t(255 - (x + y) % 64);
+		}
+	}
+
+	return frame;
+}
+
+void fillRectangle(png::Image& frame, std::uint32_t left, std::uint32_t top, std::uint32_t width, std::uint32_t height, std::uint32_t color)
+{
+	for (auto y = top; y < top + height; y++)
+	{
+		for (auto x = left; x < left + width; x++)
+		{
+			std::memcpy(frame.data.data() + (std::size_t(y) * frame.width + x) * 4, &color, 4);
+		}
+	}
+}
+
+std::vector<png::Image> makeSequence()
+{
+	std::vector<png::Image> frames{ makeFrame(0) };
+
+	const auto next = [&]() -> png::Image&
+	{
+		auto copy = frames.back();
+		return frames.emplace_back(std::move(copy));
+	};
+
+	// The cursor moving, a window redrawn, the same frame again, then everything at once
+	fillRectangle(next(), 10, 10, 2, 2, 0xFF0000FF);
+	fillRectangle(next(), 12, 11, 2, 2, 0xFF00FF00);
+	fillRectangle(next(), 0, 30, Width, 5, 0x80FFFFFF);
+	next();
+	fillRectangle(next(), Width - 1, Height - 1, 1, 1, 0);
+	fillRectangle(next(), 0, 0, 1, 1, 0xFFFFFFFF);
+	frames.push_back(makeFrame(1));
+	fillRectangle(next(), 20, 40, 30, 13, 0x11223344);
+
+	return frames;
+}
+
+std::optional<png::Image> decode(std::span<const std::uint8_t> file)
+{
+	std::ispanstream stream(std::span((const char*)file.data(), file.size()));
+	return png::readPng(stream);
+}
+
+void testSequence(const std::string& name, const png::WriteOptions& options, const std::vector<png::Image>& frames)
+{
+	png::FrameEncoder encoder(Width, Height, options);
+
+	for (std::size_t index = 0; index < frames.size(); index++)
+	{
+		const auto& frame = frames[index];
+		const auto what = name + ", frame " + std::to_string(index);
+
+		std::vector<std::uint8_t> file;
+		const bool encoded = encoder.encode(frame, [&](std::span<const std::uint8_t> data) { file.insert(file.end(), data.begin(), data.end()); });
+
+		const auto decoded = encoded ? decode(file) : std::nullopt;
+		test::check(decoded && decoded->width == Width && decoded->height == Height && decoded->data == frame.data, what + " decodes to its source");
+
+		// Only strips whose rows, or the row above them, changed are encoded again
+		if (index > 0 && frame.data == frames[index - 1].data)
+		{
+			test::check(encoder.changedStrips == 0, what + " unchanged re-encodes nothing");
+		}
+		else if (index > 0 && encoder.stripCount > 2 && frame.data != makeFrame(1).data)
+		{
+			test::check(encoder.changedStrips < encoder.stripCount, what + " re-encodes only some strips");
+		}
+	}
+}
+
+}
+
+int main()
+{
+	const auto frames = makeSequence();
+
+	struct Setting
+	{
+		std::string name;
+		png::WriteOptions options;
+	};
+
+	std::vector<Setting> settings{
+		{ "level 0", { .level = 0 } },
+		{ "level 6", {} },
+		{ "level 10", { .level = 10 } },
+		{ "fast", { .fast = true } },
+		{ "filter 0", { .filterStrategy = png::FilterStrategy::Fixed, .filter = 0 } },
+		{ "entropy", { .filterStrategy = png::FilterStrategy::Entropy } },
+		{ "brute force", { .filterStrategy = png::FilterStrategy::BruteForce } },
+	};
+
+	for (const auto& setting : settings)
+	{
+		for (std::size_t stripSize : { 0, 1, 700 })
+		{
+			auto options = setting.options;
+			options.stripSize = stripSize;
+			options.threadCount = 4;
+
+			testSequence(setting.name + " in strips of " + std::to_string(stripSize), options, frames);
+		}
+	}
+
+	// A frame of another size is refused, and the encoder still works after it
+	png::FrameEncoder encoder(Width, Height);
+
+	std::cerr.setstate(std::ios::failbit);
+	const bool refused = !encoder.encode(png::Image{ Width, Height - 1, std::vector<std::uint8_t>(std::size_t(Width) * (Height - 1) * 4) }, [](std::span<const std::uint8_t>) {});
+	std::cerr.clear();
+
+	test::check(refused, "frame of another size refused");
+
+	std::vector<std::uint8_t> file;
+	encoder.encode(frames.front(), [&](std::span<const std::uint8_t> data) { file.insert(file.end(), data.begin(), data.end()); });
+
+	const auto decoded = decode(file);
+	test::check(decoded && decoded->data == frames.front().data, "frame after a refused one");
+
+	return test::failures;
+}
@@ -0,0 +1,204 @@
+#include "../src/deflate.hpp"
+#include "check.hpp"
+
+#include <string>
+
+namespace
+{
+
+std::vector<std::uint8_t> bytes(std::string_view text)
+{
+	return { text.begin(), text.end() };
+}
+
+// A zlib stream of payload compressed against dictionary, with FDICT set and its DICTID
+std::vector<std::uint8_t> compressWithDictionary(std::span<const std::uint8_t> dictionary, std::span<const std::uint8_t> payload)
+{
+	std::vector<std::uint8_t> data(dictionary.begin(), dictionary.end());
+	data.insert(data.end(), payload.begin(), payload.end());
+
+	constexpr std::uint8_t CMF = 0x78;
+	constexpr std::uint8_t FDICT = 1 << 5;
+	constexpr std::uint8_t FCHECK = (31 - (CMF << 8 | FDICT) % 31) % 31;
+
+	const auto id = deflate::adler32(dictionary);
+
+	deflate::BitWriter writer;
+	writer.writeBytes(std::array<std::uint8_t, 2>{ CMF, FDICT | FCHECK });
+	writer.writeBytes(deflate::zlibTrailer(id));
+
+	deflate::Deflater deflater;
+	deflater.compress(writer, data, dictionary.size(), 6, true);
+
+	writer.alignToByte();
+	writer.writeBytes(deflate::zlibTrailer(deflate::adler32(payload)));
+
+	return std::move(writer.data);
+}
+
+void testDictionaries()
+{
+	const auto dictionary = bytes("the quick brown fox jumps over the lazy dog, ");
+
+	std::string text;
+	for (int x = 0; x < 200; x++)
+	{
+		text += "the lazy dog jumps over the quick brown fox " + std::to_string(x) + ", ";
+	}
+
+	const auto payload = bytes(text);
+	const auto compressed = compressWithDictionary(dictionary, payload);
+
+	deflate::DictionaryRegistry registry;
+	registry.add(dictionary);
+
+	deflate::Inflater inflater;
+	inflater.dictionaries = &registry;
+
+	const auto output = inflater.decompress(compressed, deflate::Format::Zlib, payload.size());
+	test::check(output && *output == payload, "stream against a registered dictionary");
+	test::check(output && output->capacity() == payload.size(), "output reserved for the expected size only");
+
+	// The same inflater, without a dictionary, right after one
+	const auto plain = inflater.inflate(deflate::deflate(payload));
+	test::check(plain && *plain == payload, "stream without a dictionary after one");
+
+	deflate::DictionaryRegistry other;
+	other.add(bytes("some other dictionary"));
+
+	inflater.dictionaries = &other;
+	inflater.quiet = true;
+
+	test::check(!inflater.decompress(compressed, deflate::Format::Zlib), "unknown DICTID rejected");
+
+	inflater.dictionaries = nullptr;
+
+	test::check(!inflater.decompress(compressed, deflate::Format::Zlib), "DICTID without a registry rejected");
+}
+
+// A gzip member whose matches reach into the previous member is invalid, each member starts a new window
+void testIndependentMembers()
+{
+	const auto first = bytes("abcdefghijklmnopqrstuvwxyz abcdefghijklmnopqrstuvwxyz");
+
+	auto file = deflate::deflate(first, 6, deflate::Format::Gzip);
+	const auto valid = file;
+
+	deflate::BitWriter writer;
+	writer.writeBytes(std::array<std::uint8_t, 10>{ 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 255 });
+
+	std::vector<std::uint8_t> data(first.begin(), first.end());
+	data.insert(data.end(), first.begin(), first.end());
+
+	deflate::Deflater deflater;
+	deflater.compress(writer, data, first.size(), 6, true);
+
+	const auto crc = deflate::crc32(first);
+	const auto size = std::uint32_t(first.size());
+
+	writer.alignToByte();
+	writer.writeBytes(std::array<std::uint8_t, 8>{ std::uint8_t(crc), std::uint8_t(crc >> 8), std::uint8_t(crc >> 16), std::uint8_t(crc >> 24),
+		std::uint8_t(size), std::uint8_t(size >> 8), std::uint8_t(size >> 16), std::uint8_t(size >> 24) });
+
+	file.insert(file.end(), writer.data.begin(), writer.data.end());
+
+	deflate::Inflater inflater;
+	inflater.quiet = true;
+
+	test::check(!inflater.decompress(file, deflate::Format::Gzip), "match into the previous gzip member rejected");
+
+	file = valid;
+	file.insert(file.end(), valid.begin(), valid.end());
+
+	const auto twice = inflater.decompress(file, deflate::Format::Gzip);
+	test::check(twice && twice->size() == first.size() * 2, "two independent gzip members");
+}
+
+void appendLittleEndian(std::vector<std::uint8_t>& data, std::uint32_t value, int size)
+{
+	for (int x = 0; x < size; x++)
+	{
+		data.push_back(std::uint8_t(value >> (8 * x)));
+	}
+}
+
+// data cut in blocks of blockSize bytes, each a BGZF member with its BC subfield, then the empty member bgzip ends files with
+std::vector<std::uint8_t> makeBgzf(std::span<const std::uint8_t> data, std::size_t blockSize)
+{
+	std::vector<std::uint8_t> file;
+
+	for (std::size_t offset = 0; offset <= data.size(); offset += blockSize)
+	{
+		const auto block = data.subspan(offset, std::min(blockSize, data.size() - offset));
+		const auto compressed = deflate::deflate(block, 6, deflate::Format::Raw);
+
+		file.insert(file.end(), { 0x1F, 0x8B, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0 });
+		appendLittleEndian(file, std::uint32_t(18 + 8 + compressed.size() - 1), 2);
+		file.insert(file.end(), compressed.begin(), compressed.end());
+		appendLittleEndian(file, deflate::crc32(block), 4);
+		appendLittleEndian(file, std::uint32_t(block.size()), 4);
+	}
+
+	return file;
+}
+
+// BGZF members decode straight into their place in the output, other members through the speculative scan.
+// Either way the output is decompress's, and a member that doesn't decode fails the whole file
+void testParallelMembers()
+{
+	std::string text;
+	for (int x = 0; x < 20000; x++)
+	{
+		text += "record " + std::to_string(x) + " of " + std::to_string(x * 7919 % 1000) + "\n";
+	}
+
+	const auto data = bytes(text);
+	const auto bgzf = makeBgzf(data, 20000);
+
+	const auto sequential = deflate::decompress(bgzf, deflate::Format::Gzip);
+	const auto parallel = deflate::decompressParallel(bgzf, 4);
+	test::check(sequential && *sequential == data, "BGZF file decoded sequentially");
+	test::check(parallel && *parallel == data, "BGZF file decoded in parallel");
+
+	std::vector<std::uint8_t> members;
+	for (std::size_t offset = 0; offset < data.size(); offset += 30000)
+	{
+		const auto member = deflate::deflate(std::span(data).subspan(offset, std::min<std::size_t>(30000, data.size() - offset)), 6, deflate::Format::Gzip);
+		members.insert(members.end(), member.begin(), member.end());
+	}
+
+	const auto scanned = deflate::decompressParallel(members, 4);
+	test::check(scanned && *scanned == data, "concatenated gzip members decoded in parallel");
+
+	// A flipped CRC-32 byte in the third member, then an ISIZE larger than the member's data
+	auto badChecksum = bgzf;
+	auto badSize = bgzf;
+
+	std::size_t memberEnd{};
+	for (int member = 0; member < 3; member++)
+	{
+		memberEnd += *deflate::bgzfMemberSize(bgzf, memberEnd);
+	}
+
+	badChecksum[memberEnd - 8] ^= 1;
+	badSize[memberEnd - 4] ^= 1;
+
+	std::cerr.setstate(std::ios::failbit);
+	const bool checksumRejected = !deflate::decompressParallel(badChecksum, 4);
+	const bool sizeRejected = !deflate::decompressParallel(badSize, 4);
+	std::cerr.clear();
+
+	test::check(checksumRejected, "BGZF member with a wrong CRC-32 rejected");
+	test::check(sizeRejected, "BGZF member with a wrong ISIZE rejected");
+}
+
+}
+
+int main()
+{
+	testDictionaries();
+	testIndependentMembers();
+	testParallelMembers();
+
+	return test::failures;
+}
@@ -0,0 +1,139 @@
+#include "../src/png.hpp"
+#include "check.hpp"
+
+#include <fstream>
+#include <map>
+#include <spanstream>
+#include <string>
+
+// An observer registered with readPng must hear of every chunk, deflate block, Adam7 pass, stage and buffer of
+// an interlaced PngSuite image, its stage durations summing to the StageTimes of the same decode. IDAT data made
+// only of stored blocks isn't inflated, so it reports no blocks
+namespace
+{
+
+struct CountingObserver : png::Observer
+{
+	std::vector<png::PngChunkType> chunks;
+	std::vector<deflate::BlockEvent> blocks;
+	std::vector<png::PassEvent> passes;
+	png::StageTimes stages;
+	std::size_t stageCount{};
+	std::map<std::string, std::vector<std::size_t>> allocations;
+
+	void chunkParsed(const png::ChunkEvent& event) override
+	{
+		chunks.push_back(event.type);
+	}
+
+	void blockInflated(const deflate::BlockEvent& event) override
+	{
+		blocks.push_back(event);
+	}
+
+	void passFinished(const png::PassEvent& event) override
+	{
+		passes.push_back(event);
+	}
+
+	void stageFinished(const png::StageEvent& event) override
+	{
+		stages[event.stage] += event.duration;
+		stageCount++;
+	}
+
+	void allocated(const png::AllocationEvent& event) override
+	{
+		allocations[std::string(event.buffer)].push_back(event.bytes);
+	}
+};
+
+std::optional<png::Image> decode(std::span<const std::uint8_t> file, png::StageTimes& times, CountingObserver& observer)
+{
+	deflate::Inflater inflater;
+	std::ispanstream stream(std::span((const char*)file.data(), file.size()));
+
+	return png::readPng(stream, inflater, &times, observer);
+}
+
+void testInterlaced()
+{
+	// 32x32 8 bit RGB, Adam7 interlaced
+	std::ifstream stream(TEST_FILES_DIR "/basi2c08.png", std::ios::binary);
+	const std::vector<std::uint8_t> file{ std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+
+	png::StageTimes times;
+	CountingObserver observer;
+	const auto image = decode(file, times, observer);
+
+	test::check(image && image->width == 32 && image->height == 32, "basi2c08.png decoded");
+
+	std::vector<png::PngChunkType> chunkTypes;
+	const auto chunks = png::readChunks(file);
+	for (const auto& chunk : chunks ? *chunks : std::vector<png::PngChunk>{})
+	{
+		chunkTypes.push_back(chunk.type);
+	}
+
+	test::check(!chunkTypes.empty() && observer.chunks == chunkTypes, "every chunk parsed, in file order");
+
+	// Unfiltered pass bytes, a filter byte ahead of every row of every pass
+	std::size_t filteredSize{};
+	for (int pass = 0; pass < 7; pass++)
+	{
+		const auto width = (32 - png::adam7StartX[pass] + png::adam7StepX[pass] - 1) / png::adam7StepX[pass];
+		const auto height = (32 - png::adam7StartY[pass] + png::adam7StepY[pass] - 1) / png::adam7StepY[pass];
+		filteredSize += std::size_t(height) * (1 + width * 3);
+
+		const auto& event = observer.passes.size() > std::size_t(pass) ? observer.passes[pass] : png::PassEvent{};
+		test::check(event.pass == pass && event.width == width && event.height == height, "pass " + std::to_string(pass) + " finished");
+	}
+
+	test::check(observer.passes.size() == 7, "seven passes");
+
+	std::size_t inflatedBytes{};
+	for (const auto& block : observer.blocks)
+	{
+		inflatedBytes += block.outputBytes;
+	}
+
+	test::check(!observer.blocks.empty() && observer.blocks.back().last
+		&& std::ranges::count_if(observer.blocks, [](const deflate::BlockEvent& block) { return block.last; }) == 1, "blocks inflated up to the last one");
+	test::check(inflatedBytes == filteredSize, "blocks inflated to every filtered byte");
+
+	test::check(observer.stageCount > 0 && observer.stages.durations == times.durations, "stage durations match StageTimes");
+
+	test::check(observer.allocations["image"] == std::vector<std::size_t>{ 32 * 32 * 4 }, "image allocated");
+	test::check(observer.allocations["pass"].size() == 7, "every pass allocated");
+	test::check(observer.allocations["inflated"].size() == 1 && observer.allocations["inflated"][0] >= filteredSize, "inflated data allocated");
+}
+
+void testStoredBlocks()
+{
+	png::Image image{ 16, 8, std::vector<std::uint8_t>(16 * 8 * 4) };
+	for (std::size_t x = 0; x < image.data.size(); x++)
+	{
+		image.data[x] = std::uint8_t(x * 7);
+	}
+
+	std::vector<std::uint8_t> file;
+	png::writePng(image, [&](std::span<const std::uint8_t> data) { file.insert(file.end(), data.begin(), data.end()); }, { .level = 0, .reduceColors = false });
+
+	png::StageTimes times;
+	CountingObserver observer;
+	const auto decoded = decode(file, times, observer);
+
+	test::check(decoded && decoded->data == image.data, "stored blocks decoded");
+	test::check(observer.blocks.empty() && !observer.allocations.contains("inflated"), "stored blocks read without inflating");
+	test::check(observer.passes.size() == 1 && observer.passes[0].pass == 0 && observer.passes[0].height == 8, "single pass finished");
+}
+
+}
+
+int main()
+{
+	testInterlaced();
+	testStoredBlocks();
+
+	return test::failures;
+}
@@ -0,0 +1,186 @@
+#include "../src/png.hpp"
+#include "check.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <ranges>
+#include <spanstream>
+#include <string>
+
+// optimize must return a file decoding to the pixels of its input, never a larger one, and carry the input's
+// ancillary chunks over to the side of the image data they were on, dropping a profile that no longer fits
+namespace
+{
+
+std::optional<png::Image> decode(std::span<const std::uint8_t> file)
+{
+	std::ispanstream stream(std::span((const char*)file.data(), file.size()));
+	return png::readPng(stream);
+}
+
+std::vector<std::string> chunkTypes(std::span<const std::uint8_t> file)
+{
+	std::vector<std::string> types;
+
+	if (const auto chunks = png::readChunks(file))
+	{
+		for (const auto& chunk : *chunks)
+		{
+			types.emplace_back(chunk.type.toStr());
+		}
+	}
+
+	return types;
+}
+
+// image written as 8 bit RGBA, with gAMA, iCCP and a chunk that isn't safe to copy before the image data
+// and tEXt after it
+std::vector<std::uint8_t> makeFile(const png::Image& image)
+{
+	std::vector<std::uint8_t> written;
+	png::writePng(image, [&](std::span<const std::uint8_t> data) { written.insert(written.end(), data.begin(), data.end()); }, { .reduceColors = false });
+
+	std::vector<std::uint8_t> file;
+	const png::Sink sink = [&](std::span<const std::uint8_t> data) { file.insert(file.end(), data.begin(), data.end()); };
+
+	std::vector<std::uint8_t> profile{ 'R', 'G', 'B', 0, 0 };
+	const auto compressedProfile = deflate::deflate(std::vector<std::uint8_t>(128, 'P'));
+	profile.insert(profile.end(), compressedProfile.begin(), compressedProfile.end());
+
+	const std::uint8_t gamma[]{ 0, 0, 0xB1, 0x8F };
+	const std::uint8_t background[]{ 0, 1, 0, 2, 0, 3 };
+	const std::string_view text = "Comment\0kept";
+
+	sink(png::pngSignature);
+
+	const auto chunks = png::readChunks(written);
+	for (const auto& chunk : *chunks)
+	{
+		if (chunk.type == "IEND")
+		{
+			png::writeChunk(sink, "tEXt", std::span((const std::uint8_t*)text.data(), text.size()));
+		}
+
+		png::writeChunk(sink, chunk.type, chunk.data);
+
+		if (chunk.type == "IHDR")
+		{
+			png::writeChunk(sink, "gAMA", gamma);
+			png::writeChunk(sink, "iCCP", profile);
+			png::writeChunk(sink, "bKGD", background);
+		}
+	}
+
+	return file;
+}
+
+png::Image makeImage(bool gray)
+{
+	constexpr std::uint32_t Width = 40;
+	constexpr std::uint32_t Height = 30;
+
+	png::Image image{ Width, Height, std::vector<std::uint8_t>(std::size_t(Width) * Height * 4) };
+
+	for (std::uint32_t y = 0; y < Height; y++)
+	{
+		for (std::uint32_t x = 0; x < Width; x++)
+		{
+			auto* pixel = image.data.data() + (std::size_t(y) * Width + x) * 4;
+			const auto value = std::uint8_t(x * 6 + y);
+
+			pixel[0] = value;
+			pixel[1] = gray ? value : std::uint8_t(y * 8);
+			pixel[2] = gray ? value : std::uint8_t(x ^ y);
+			pixel[3] = 255;
+		}
+	}
+
+	return image;
+}
+
+void testChunks(const std::string& name, bool gray)
+{
+	const auto image = makeImage(gray);
+	const auto input = makeFile(image);
+	const auto optimized = png::optimize(input);
+
+	test::check(optimized && optimized->size() < input.size(), name + ": smaller than the input");
+
+	if (!optimized)
+	{
+		return;
+	}
+
+	const auto decoded = decode(*optimized);
+	test::check(decoded && decoded->data == image.data, name + ": pixels kept");
+
+	const auto chunks = *png::readChunks(*optimized);
+	const auto colorType = chunks.front().data[9];
+	test::check(gray ? colorType == 0 : colorType == 2 || colorType == 3, name + ": colour type reduced");
+
+	// bKGD holds samples of the input's colour type, so it doesn't outlive the reduction
+	std::vector<std::string> expected{ "IHDR", "gAMA" };
+	if (!gray)
+	{
+		expected.push_back("iCCP");
+	}
+
+	auto types = chunkTypes(*optimized);
+	std::erase_if(types, [](const std::string& type) { return type == "PLTE" || type == "tRNS"; });
+
+	const auto firstData = std::ranges::find(types, "IDAT");
+	const auto afterData = std::ranges::find(types | std::views::reverse, "IDAT").base();
+
+	test::check(std::vector(types.begin(), firstData) == expected, name + ": chunks before the image data");
+	test::check(firstData != types.end() && std::vector(afterData, types.end()) == std::vector<std::string>{ "tEXt", "IEND" }, name + ": chunks after the image data");
+}
+
+void testPngSuite()
+{
+	// Two quick trials keep this to a few seconds, the default ones are exercised above
+	const png::OptimizeOptions options{ .trials = { { .level = 6 }, { .level = 9, .filterStrategy = png::FilterStrategy::Entropy } }, .threadCount = 4 };
+
+	int images = 0;
+
+	for (const auto& entry : std::filesystem::directory_iterator(TEST_FILES_DIR))
+	{
+		if (entry.path().extension() != ".png")
+		{
+			continue;
+		}
+
+		std::ifstream stream(entry.path(), std::ios::binary);
+		const std::vector<std::uint8_t> file{ std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+
+		std::cerr.setstate(std::ios::failbit);
+		const auto image = decode(file);
+		const auto optimized = image ? png::optimize(file, options) : std::nullopt;
+		std::cerr.clear();
+
+		if (!image)
+		{
+			continue;
+		}
+
+		images++;
+
+		const auto what = entry.path().filename().string();
+		const auto decoded = optimized ? decode(*optimized) : std::nullopt;
+
+		test::check(optimized && optimized->size() <= file.size(), what + " not larger");
+		test::check(decoded && decoded->width == image->width && decoded->height == image->height && decoded->data == image->data, what + " pixels kept");
+	}
+
+	test::check(images > 0, "PngSuite images found in " TEST_FILES_DIR);
+}
+
+}
+
+int main()
+{
+	testChunks("gray pixels in RGBA", true);
+	testChunks("colour pixels in RGBA", false);
+	testPngSuite();
+
+	return test::failures;
+}
@@ -0,0 +1,171 @@
+#include "../src/png.hpp"
+#include "check.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <ranges>
+#include <spanstream>
+#include <string>
+
+// Every PngSuite image readPng decodes is written with every encoder setting and read back, which must
+// give the same pixels byte for byte. All of it runs once per kernel level the CPU supports
+namespace
+{
+
+struct Setting
+{
+	std::string name;
+	png::WriteOptions options;
+};
+
+std::vector<Setting> settings()
+{
+	std::vector<Setting> settings;
+
+	for (int level = 0; level <= 10; level++)
+	{
+		settings.push_back({ "level " + std::to_string(level), { .level = level } });
+	}
+
+	for (std::uint8_t filter = 0; filter < 5; filter++)
+	{
+		settings.push_back({ "filter " + std::to_string(filter), { .filterStrategy = png::FilterStrategy::Fixed, .filter = filter } });
+	}
+
+	settings.push_back({ "minimum sum", { .filterStrategy = png::FilterStrategy::MinimumSum } });
+	settings.push_back({ "entropy", { .filterStrategy = png::FilterStrategy::Entropy } });
+	settings.push_back({ "brute force", { .filterStrategy = png::FilterStrategy::BruteForce } });
+
+	settings.push_back({ "fast", { .fast = true } });
+	settings.push_back({ "RGBA", { .reduceColors = false } });
+	settings.push_back({ "small IDAT", { .idatSize = 16 } });
+
+	// A strip per row, then a few rows per strip, each ending on a sync flush
+	for (std::size_t stripSize : { 1, 200 })
+	{
+		const auto strips = " in strips of " + std::to_string(stripSize);
+
+		settings.push_back({ "level 6" + strips, { .threadCount = 4, .stripSize = stripSize } });
+		settings.push_back({ "level 10" + strips, { .level = 10, .threadCount = 4, .stripSize = stripSize } });
+		settings.push_back({ "fast" + strips, { .fast = true, .threadCount = 4, .stripSize = stripSize } });
+		settings.push_back({ "brute force" + strips, { .filterStrategy = png::FilterStrategy::BruteForce, .threadCount = 4, .stripSize = stripSize } });
+	}
+
+	return settings;
+}
+
+std::optional<png::Image> decode(std::span<const char> file)
+{
+	std::ispanstream stream(file);
+	return png::readPng(stream);
+}
+
+// The last byte of the Adler-32 trailer flipped, with the chunk CRC written for the corrupted data,
+// must be caught whether the stream is inflated or, at level 0, read straight from its stored blocks
+void testCorruptChecksum(const png::Image& image)
+{
+	for (int level : { 0, 6 })
+	{
+		std::vector<std::uint8_t> encoded;
+		png::writePng(image, [&](std::span<const std::uint8_t> data) { encoded.insert(encoded.end(), data.begin(), data.end()); }, { .level = level });
+
+		auto chunks = *png::readChunks(encoded);
+		const auto lastData = std::ranges::find_if(chunks | std::views::reverse, [](const png::PngChunk& chunk) { return chunk.type == "IDAT"; });
+		lastData->data.back() ^= 1;
+
+		std::vector<char> corrupted;
+		const png::Sink sink = [&](std::span<const std::uint8_t> data) { corrupted.insert(corrupted.end(), data.begin(), data.end()); };
+
+		sink(png::pngSignature);
+		for (const auto& chunk : chunks)
+		{
+			png::writeChunk(sink, chunk.type, chunk.data);
+		}
+
+		std::cerr.setstate(std::ios::failbit);
+		const auto decoded = decode(corrupted);
+		std::cerr.clear();
+
+		test::check(!decoded, "Adler-32 mismatch rejected at level " + std::to_string(level));
+	}
+}
+
+// Decodes PngSuite and round-trips every image at the level kernels are forced to, checking the decoded
+// images against those of the first level run
+int testCorpus(const std::string& isaName, const std::vector<Setting>& allSettings, std::map<std::string, std::vector<std::uint8_t>>& firstDecodes)
+{
+	int images = 0;
+
+	for (const auto& entry : std::filesystem::directory_iterator(TEST_FILES_DIR))
+	{
+		if (entry.path().extension() != ".png")
+		{
+			continue;
+		}
+
+		std::ifstream stream(entry.path(), std::ios::binary);
+		const std::vector<char> file{ std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>() };
+
+		// Files PngSuite made invalid on purpose are rejected with a message, only images that decode matter here
+		std::cerr.setstate(std::ios::failbit);
+		const auto image = decode(file);
+		std::cerr.clear();
+
+		if (!image)
+		{
+			continue;
+		}
+
+		if (images++ == 0)
+		{
+			testCorruptChecksum(*image);
+		}
+
+		const auto name = entry.path().filename().string();
+		const auto [first, inserted] = firstDecodes.try_emplace(name, image->data);
+		test::check(inserted || first->second == image->data, name + " decodes the same with " + isaName);
+
+		for (const auto& setting : allSettings)
+		{
+			std::vector<char> encoded;
+			const bool written = png::writePng(*image, [&](std::span<const std::uint8_t> data) { encoded.insert(encoded.end(), data.begin(), data.end()); }, setting.options);
+
+			const auto decoded = written ? decode(encoded) : std::nullopt;
+
+			test::check(decoded && decoded->width == image->width && decoded->height == image->height && decoded->data == image->data,
+				name + " with " + setting.name + ", " + isaName);
+		}
+	}
+
+	return images;
+}
+
+}
+
+int main()
+{
+	const auto allSettings = settings();
+
+	std::map<std::string, std::vector<std::uint8_t>> firstDecodes;
+
+	// Every kernel variant the CPU can run, not only the one it would pick
+	static constexpr std::pair<cpu::Isa, std::string_view> levels[]{ { cpu::Isa::Generic, "generic" }, { cpu::Isa::Bmi2, "bmi2" }, { cpu::Isa::Avx512, "avx512" } };
+
+	for (const auto& [isa, isaName] : levels)
+	{
+		if (isa > cpu::detectIsa())
+		{
+			continue;
+		}
+
+		cpu::forceIsa(isa);
+
+		const auto images = testCorpus(std::string(isaName), allSettings, firstDecodes);
+		test::check(images > 0, "PngSuite images found in " TEST_FILES_DIR);
+
+		std::cout << isaName << ": " << images << " images, " << allSettings.size() << " settings each, " << test::failures << " failures so far" << std::endl;
+	}
+
+	return test::failures;
+}
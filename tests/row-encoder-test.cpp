@@ -0,0 +1,201 @@
+#include "../src/png.hpp"
+#include "check.hpp"
+
+#include <spanstream>
+#include <string>
+
+// An image several pieces long streamed through RowEncoder row by row must decode to its rows, in IDAT
+// chunks of the size asked for, and so must it interlaced or as gray. Rows past the height, missing or
+// of the wrong length fail the encoder
+namespace
+{
+
+constexpr std::uint32_t Width = 300;
+constexpr std::uint32_t Height = 700;
+
+static_assert(std::size_t(Width) * 4 * Height > 3 * png::RowEncoder::PieceSize);
+
+// Noise on the left, which stays literals, gradients on the right, which match
+png::Image makeImage()
+{
+	png::Image image{ Width, Height, std::vector<std::uint8_t>(std::size_t(Width) * Height * 4) };
+
+	std::uint32_t state = 1;
+	for (std::uint32_t y = 0; y < Height; y++)
+	{
+		for (std::uint32_t x = 0; x < Width; x++)
+		{
+			auto* pixel = image.data.data() + (std::size_t(y) * Width + x) * 4;
+
+			for (int channel = 0; channel < 4; channel++)
+			{
+				state = state * 1664525 + 1013904223;
+				pixel[channel] = x < Width / 3 ? std::uint8_t(state >> 24) : std::uint8_t(x + y * channel);
+			}
+		}
+	}
+
+	return image;
+}
+
+std::span<const std::uint8_t> imageRow(const png::Image& image, std::uint32_t y)
+{
+	return std::span(image.data).subspan(std::size_t(y) * image.width * 4, std::size_t(image.width) * 4);
+}
+
+void testImage(const std::string& name, const png::WriteOptions& options, const png::Image& image)
+{
+	std::vector<std::uint8_t> file;
+	png::RowEncoder encoder(Width, Height, [&](std::span<const std::uint8_t> data) { file.insert(file.end(), data.begin(), data.end()); }, options);
+
+	bool written = true;
+	for (std::uint32_t y = 0; y < Height; y++)
+	{
+		written = encoder.writeRow(imageRow(image, y)) && written;
+	}
+
+	test::check(written && encoder.finish(), name + ": encoded");
+
+	std::ispanstream stream(std::span((const char*)file.data(), file.size()));
+	const auto decoded = png::readPng(stream);
+	test::check(decoded && decoded->width == Width && decoded->height == Height && decoded->data == image.data, name + ": decodes to its rows");
+
+	// Every IDAT chunk but the last is full
+	const auto chunks = png::readChunks(file);
+	std::vector<std::size_t> dataSizes;
+	for (const auto& chunk : chunks ? *chunks : std::vector<png::PngChunk>{})
+	{
+		if (chunk.type == "IDAT")
+		{
+			dataSizes.push_back(chunk.data.size());
+		}
+	}
+
+	test::check(dataSizes.size() > 1 && std::all_of(dataSizes.begin(), dataSizes.end() - 1, [&](std::size_t size) { return size == options.idatSize; })
+		&& dataSizes.back() <= options.idatSize, name + ": IDAT chunks of " + std::to_string(options.idatSize) + " bytes");
+}
+
+// The image's pixels written pass by pass with Adam7, each row holding only the pixels of its pass
+void testInterlaced(const std::string& name, const png::WriteOptions& options, const png::Image& image)
+{
+	std::vector<std::uint8_t> file;
+	png::RowEncoder encoder(Width, Height, [&](std::span<const std::uint8_t> data) { file.insert(file.end(), data.begin(), data.end()); }, options, {}, true);
+
+	bool written = true;
+	for (int pass = 0; pass < 7; pass++)
+	{
+		for (auto y = png::adam7StartY[pass]; y < Height; y += png::adam7StepY[pass])
+		{
+			std::vector<std::uint8_t> row;
+			for (auto x = png::adam7StartX[pass]; x < Width; x += png::adam7StepX[pass])
+			{
+				const auto pixel = imageRow(image, y).subspan(std::size_t(x) * 4, 4);
+				row.insert(row.end(), pixel.begin(), pixel.end());
+			}
+
+			written = encoder.writeRow(row) && written;
+		}
+	}
+
+	test::check(written && encoder.finish(), name + ": encoded");
+
+	std::ispanstream stream(std::span((const char*)file.data(), file.size()));
+	const auto decoded = png::readPng(stream);
+	test::check(decoded && decoded->data == image.data, name + ": decodes to its rows");
+}
+
+// The red channel as 8 bit gray, which reads back with every channel equal and opaque
+void testGray(const std::string& name, const png::WriteOptions& options, const png::Image& image)
+{
+	std::vector<std::uint8_t> file;
+	png::PixelFormat gray;
+	gray.colorType = 0;
+
+	png::RowEncoder encoder(Width, Height, [&](std::span<const std::uint8_t> data) { file.insert(file.end(), data.begin(), data.end()); }, options, gray);
+
+	std::vector<std::uint8_t> expected;
+	bool written = true;
+	for (std::uint32_t y = 0; y < Height; y++)
+	{
+		std::vector<std::uint8_t> row;
+		for (std::uint32_t x = 0; x < Width; x++)
+		{
+			const auto value = imageRow(image, y)[std::size_t(x) * 4];
+			row.push_back(value);
+			expected.insert(expected.end(), { value, value, value, 255 });
+		}
+
+		written = encoder.writeRow(row) && written;
+	}
+
+	test::check(written && encoder.finish(), name + ": encoded");
+
+	std::ispanstream stream(std::span((const char*)file.data(), file.size()));
+	const auto decoded = png::readPng(stream);
+	test::check(decoded && decoded->data == expected, name + ": decodes to its rows");
+}
+
+void testErrors(const png::Image& image)
+{
+	const auto sink = [](std::span<const std::uint8_t>) {};
+
+	std::cerr.setstate(std::ios::failbit);
+
+	png::RowEncoder tooMany(Width, 2, sink);
+	const bool twoRows = tooMany.writeRow(imageRow(image, 0)) && tooMany.writeRow(imageRow(image, 1));
+	const bool tooManyRefused = twoRows && !tooMany.writeRow(imageRow(image, 2)) && !tooMany.finish();
+
+	png::RowEncoder missing(Width, 2, sink);
+	const bool missingRefused = missing.writeRow(imageRow(image, 0)) && !missing.finish();
+
+	png::RowEncoder wrongLength(Width, 2, sink);
+	const bool wrongLengthRefused = !wrongLength.writeRow(imageRow(image, 0).first(Width * 4 - 1)) && !wrongLength.finish();
+
+	// Two rows leave passes 2 and 4 empty, and the last pass holds the second row
+	png::RowEncoder missingPass(Width, 2, sink, {}, {}, true);
+	bool passesWritten = true;
+	for (int pass : { 0, 1, 3, 5 })
+	{
+		const auto passWidth = (Width - png::adam7StartX[pass] + png::adam7StepX[pass] - 1) / png::adam7StepX[pass];
+		passesWritten = missingPass.writeRow(imageRow(image, 0).first(std::size_t(passWidth) * 4)) && passesWritten;
+	}
+
+	const bool missingPassRefused = passesWritten && !missingPass.finish();
+
+	png::PixelFormat deepPalette;
+	deepPalette.colorType = 3;
+	deepPalette.depth = 16;
+	deepPalette.palette.colors = { 0xFF000000 };
+
+	png::RowEncoder invalid(Width, 2, sink, {}, deepPalette);
+	const bool invalidRefused = !invalid.writeRow(imageRow(image, 0));
+
+	std::cerr.clear();
+
+	test::check(tooManyRefused, "too many rows refused");
+	test::check(missingRefused, "missing rows refused");
+	test::check(wrongLengthRefused, "row of another length refused");
+	test::check(missingPassRefused, "missing pass refused");
+	test::check(invalidRefused, "invalid pixel format refused");
+}
+
+}
+
+int main()
+{
+	const auto image = makeImage();
+
+	testImage("level 0", { .level = 0, .idatSize = 1000 }, image);
+	testImage("level 6", { .idatSize = 1000 }, image);
+	testImage("fast", { .fast = true, .idatSize = 1000 }, image);
+	testImage("brute force", { .filterStrategy = png::FilterStrategy::BruteForce, .idatSize = 4096 }, image);
+
+	testInterlaced("interlaced", { .idatSize = 1000 }, image);
+	testInterlaced("interlaced fast", { .fast = true, .idatSize = 1000 }, image);
+	testGray("gray", { .idatSize = 1000 }, image);
+	testGray("gray fast", { .fast = true, .idatSize = 1000 }, image);
+
+	testErrors(image);
+
+	return test::failures;
+}